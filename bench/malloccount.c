@@ -0,0 +1,165 @@
+/*
+ * malloccount.c -- count the heap allocations of a process
+ *
+ * Preloaded (LD_PRELOAD) by upfbench.sh: counts the calls to the C
+ * library allocation functions (C++'s operator new ends up in malloc()
+ * too) and, at exit, writes their number into the file named by
+ * $MALLOCCOUNT_FILE.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long long allocations;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+
+/* dlsym() may allocate: serve it from here while resolving */
+static char bootstrap[4096] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+static int resolving;
+
+static void *bootstrap_alloc(size_t size) {
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (bootstrap_used + size > sizeof(bootstrap)) {
+        return NULL;
+    }
+
+    p = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+    return p;
+}
+
+static int in_bootstrap(const void *p) {
+    return (const char *)p >= bootstrap &&
+           (const char *)p < bootstrap + sizeof(bootstrap);
+}
+
+static void resolve(void) {
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    resolving = 0;
+}
+
+static void count(void) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    if (!real_malloc) {
+        if (resolving) {
+            return bootstrap_alloc(size);
+        }
+        resolve();
+    }
+
+    count();
+    return real_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (!real_calloc) {
+        if (resolving) {
+            /* Static memory is already zeroed */
+            return bootstrap_alloc(n * size);
+        }
+        resolve();
+    }
+
+    count();
+    return real_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    void *q;
+
+    if (!real_realloc) {
+        resolve();
+    }
+
+    count();
+
+    if (!in_bootstrap(p)) {
+        return real_realloc(p, size);
+    }
+
+    /* Move out of the bootstrap buffer */
+    q = real_malloc(size);
+    if (q) {
+        const size_t left = bootstrap + sizeof(bootstrap) - (char *)p;
+        memcpy(q, p, size < left ? size : left);
+    }
+    return q;
+}
+
+void free(void *p) {
+    if (in_bootstrap(p)) {
+        return;
+    }
+
+    if (!real_free) {
+        resolve();
+    }
+
+    real_free(p);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size) {
+    if (!real_posix_memalign) {
+        resolve();
+    }
+
+    count();
+    return real_posix_memalign(p, alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (!real_aligned_alloc) {
+        resolve();
+    }
+
+    count();
+    return real_aligned_alloc(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (!real_memalign) {
+        resolve();
+    }
+
+    count();
+    return real_memalign(alignment, size);
+}
+
+__attribute__((destructor)) static void report(void) {
+    const unsigned long long total = allocations;
+    const char *fileName = getenv("MALLOCCOUNT_FILE");
+    FILE *f;
+
+    if (!fileName) {
+        return;
+    }
+
+    f = fopen(fileName, "w");
+    if (f) {
+        fprintf(f, "%llu\n", total);
+        fclose(f);
+    }
+}
@@ -0,0 +1,247 @@
+#!/bin/sh
+#
+# upfbench.sh -- end-to-end UPFRouter throughput benchmarks
+#
+# Runs UPFRouter under the Click userlevel driver for each scenario, UE
+# count and MatchMap size, and appends one JSON object per run to the
+# results file:
+#
+#   {"scenario": "decap", "ues": 1000, "rules": 1, "packets": 10000000,
+#    "mpps": 4.2, "ns_per_packet": 238.1, "allocs_per_packet": 0.0,
+#    "paths": {"gtpu_diverted": 10000000, ...}}
+#
+# Scenarios (traffic from UPFGTPTrafficGen, half uplink, half
+# downlink, unless noted):
+#
+#   passthrough  GTP-U traffic matching no rule, forwarded as is
+#   decap        GTP-U traffic all matching a rule, decapsulated to port 2
+#   encap        plain IPv4 traffic from/to UEs on port 2, encapsulated
+#   s1ap         S1AP attach storm, replayed from the capture $S1AP_PCAP
+#                (UEs taken from the capture; skipped if not set)
+#   mix          30% decap, 20% encap, the rest passthrough, mixed sizes
+#
+# Every configuration is run twice, for WARMUP and for WARMUP + PACKETS
+# packets (s1ap: for 1 and 1 + $S1AP_REPEATS replays of the capture),
+# and only the difference between the two runs (in time, allocations
+# and packets per path) is reported: startup and shutdown (e.g. adding
+# 1M UEs to the UEMap) cancel out. Allocations are counted only if the
+# malloccount.c shim ($MALLOCCOUNT) is there.
+#
+# Environment: CLICK (the click userlevel driver), CLICKPATH (where the
+# 'upf' package is looked for), MALLOCCOUNT, S1AP_PCAP, S1AP_EPC (the
+# EPC address in $S1AP_PCAP, to tell its direction), S1AP_REPEATS.
+
+set -e
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+
+CLICK=${CLICK:-click}
+MALLOCCOUNT=${MALLOCCOUNT:-$bench_dir/malloccount.so}
+S1AP_REPEATS=${S1AP_REPEATS:-1000}
+
+results=upfbench-results.jsonl
+packets=10000000
+warmup=1000000
+scenarios="passthrough decap encap s1ap mix"
+ue_counts="1000 10000 100000 1000000"
+rule_counts="1 10 100 1000 10000"
+
+usage() {
+    cat <<EOF
+Usage: $0 [-o RESULTS] [-n PACKETS] [-w WARMUP] [-s "SCENARIO ..."]
+          [-u "UES ..."] [-r "RULES ..."]
+
+Defaults: -o $results -n $packets -w $warmup
+          -s "$scenarios"
+          -u "$ue_counts" -r "$rule_counts"
+EOF
+    exit 1
+}
+
+while getopts o:n:w:s:u:r:h opt; do
+    case $opt in
+    o) results=$OPTARG ;;
+    n) packets=$OPTARG ;;
+    w) warmup=$OPTARG ;;
+    s) scenarios=$OPTARG ;;
+    u) ue_counts=$OPTARG ;;
+    r) rule_counts=$OPTARG ;;
+    *) usage ;;
+    esac
+done
+
+work_dir=$(mktemp -d "${TMPDIR:-/tmp}/upfbench.XXXXXX")
+trap 'rm -rf "$work_dir"' EXIT
+
+# The MatchMap: RULES - 1 rules matching no generated packet, then the
+# one the decap traffic matches
+match_rule=6-0.0.0.0/0-80
+
+matchmap() {
+    awk -v n="$1" -v last="$match_rule" 'BEGIN {
+        for (i = 1; i < n; i++)
+            printf "17-172.%d.%d.0/24-%d, ", 16 + int(i / 65536) % 16,
+                int(i / 256) % 256, 1000 + i % 50000
+        print last
+    }'
+}
+
+# Write the Click configuration of a run of 'limit' packets
+write_config() {
+    scenario=$1
+    ues=$2
+    rules=$3
+    limit=$4
+    config=$5
+
+    case $scenario in
+    passthrough) traffic="UPLINK 0.5" ;;
+    decap) traffic="MATCH $match_rule, MATCHRATIO 1" ;;
+    encap) traffic="PLAIN 1" ;;
+    # MATCHRATIO counts plain packets too: 0.375 of the 80% of GTP-U
+    # packets makes the 30% to decapsulate
+    mix) traffic="MATCH $match_rule, MATCHRATIO 0.375, PLAIN 0.2,
+                  SIZES \"64 576 1400\",
+                  PROTOCOLS \"6-443 17-53 17-5000\"" ;;
+    esac
+
+    cat >"$config" <<EOF
+require(package "upf");
+
+upfr :: UPFRouter(uemapcapacity $((ues * 2 > 65536 ? ues * 2 : 65536)),
+                  matchmap "$(matchmap "$rules")");
+
+upfr[0] -> Discard;
+upfr[1] -> Discard;
+upfr[2] -> Discard;
+upfr[3] -> Discard;
+EOF
+
+    if [ "$scenario" = s1ap ]; then
+        # The capture, replayed 'limit' times
+        cat >>"$config" <<EOF
+
+UPFRouterPcapReader($S1AP_PCAP, $limit, PRELOAD true)
+    -> Strip(14)
+    -> CheckIPHeader
+    -> count :: Counter
+    -> dir :: IPClassifier(src host $S1AP_EPC, -);
+
+dir[0] -> [0]upfr;
+dir[1] -> [1]upfr;
+Idle -> [2]upfr;
+
+DriverManager(wait_stop, print count.count, print upfr.stats, stop);
+EOF
+    else
+        cat >>"$config" <<EOF
+
+gen :: UPFGTPTrafficGen(UES $ues, UEPREFIX 45.0.0.0/8, ROUTER upfr,
+                        LIMIT $limit, STOP true, $traffic);
+
+gen[0] -> [0]upfr;
+gen[1] -> [1]upfr;
+gen[2] -> [2]upfr;
+
+DriverManager(wait_stop, print gen.count, print upfr.stats, stop);
+EOF
+    fi
+}
+
+# Run a configuration, its output going to 'output'; sets 'elapsed'
+# (ns) and 'allocs'
+run_config() {
+    config=$1
+    output=$2
+
+    start=$(date +%s%N)
+    if [ -r "$MALLOCCOUNT" ]; then
+        MALLOCCOUNT_FILE=$work_dir/allocs LD_PRELOAD=$MALLOCCOUNT \
+            "$CLICK" "$config" >"$output" 2>"$work_dir/errors" ||
+            { cat "$work_dir/errors" >&2; return 1; }
+        allocs=$(cat "$work_dir/allocs")
+    else
+        "$CLICK" "$config" >"$output" 2>"$work_dir/errors" ||
+            { cat "$work_dir/errors" >&2; return 1; }
+        allocs=0
+    fi
+    elapsed=$(($(date +%s%N) - start))
+}
+
+# Run a configuration for 'warmup' and 'warmup' + 'packets' packets,
+# then append the results
+bench() {
+    scenario=$1
+    ues=$2
+    rules=$3
+
+    if [ "$scenario" = s1ap ]; then
+        base_limit=1
+        full_limit=$((1 + S1AP_REPEATS))
+    else
+        base_limit=$warmup
+        full_limit=$((warmup + packets))
+    fi
+
+    write_config "$scenario" "$ues" "$rules" $base_limit \
+        "$work_dir/base.click"
+    write_config "$scenario" "$ues" "$rules" $full_limit \
+        "$work_dir/full.click"
+
+    run_config "$work_dir/base.click" "$work_dir/base.out"
+    base_elapsed=$elapsed
+    base_allocs=$allocs
+
+    run_config "$work_dir/full.click" "$work_dir/full.out"
+
+    awk -v scenario="$scenario" -v ues="$ues" -v rules="$rules" \
+        -v ns=$((elapsed - base_elapsed)) \
+        -v allocs=$((allocs - base_allocs)) '
+        # First line: packets generated; then one path,packets,bytes
+        # line per path
+        FILENAME == ARGV[1] && FNR == 1 { base = $1; next }
+        FILENAME == ARGV[1] { split($0, f, ","); before[f[1]] = f[2]; next }
+        FNR == 1 { n = $1 - base; next }
+        {
+            split($0, f, ",")
+            if (f[2] - before[f[1]] > 0)
+                paths = paths (paths ? ", " : "") \
+                        sprintf("\"%s\": %d", f[1], f[2] - before[f[1]])
+        }
+        END {
+            if (n <= 0)
+                exit 1
+            printf "{\"scenario\": \"%s\", \"ues\": %d, \"rules\": %d, " \
+                   "\"packets\": %d, \"mpps\": %.3f, " \
+                   "\"ns_per_packet\": %.1f, \"allocs_per_packet\": %.3f, " \
+                   "\"paths\": {%s}}\n",
+                   scenario, ues, rules, n, n * 1000 / ns, ns / n,
+                   allocs / n, paths
+        }' "$work_dir/base.out" "$work_dir/full.out" | tee -a "$results"
+}
+
+for scenario in $scenarios; do
+    case $scenario in
+    s1ap)
+        if [ -z "$S1AP_PCAP" ] || [ -z "$S1AP_EPC" ]; then
+            echo "$0: S1AP_PCAP and S1AP_EPC not set, skipping s1ap" >&2
+            continue
+        fi
+        # UEs come from the capture
+        for rules in $rule_counts; do
+            bench s1ap 0 "$rules"
+        done
+        ;;
+    passthrough | decap | encap | mix)
+        for ues in $ue_counts; do
+            for rules in $rule_counts; do
+                bench "$scenario" "$ues" "$rules"
+            done
+        done
+        ;;
+    *)
+        echo "$0: unknown scenario '$scenario'" >&2
+        exit 1
+        ;;
+    esac
+done
@@ -14,6 +14,8 @@
 #include <click/args.hh>
 #include <click/router.hh>
 
+#include <cstring>
+
 // clang-format off
 CLICK_DECLS
 // clang-format on
@@ -27,28 +29,88 @@ int UPFRouterPcapReader::configure(Vector<String> &conf, ErrorHandler *errh) {
     if (Args(conf, this, errh)
             .read_mp("FILENAME", StringArg(), mFilename)
             .read_p("REPEATS", mRepeats)
+            .read("MMAP", BoolArg(), mMmap)
+            .read("ZEROCOPY", BoolArg(), mZeroCopy)
+            .read("PRELOAD", BoolArg(), mPreload)
+            .read("RATE", mRate)
+            .read("SPEED", DoubleArg(), mSpeed)
+            .read("BURST", mBurst)
             .complete() < 0) {
         errh->error("Error while parsing arguments!");
         return -1;
     }
 
+    if (mZeroCopy) {
+        if (mRepeats != 1) {
+            errh->error("ZEROCOPY requires REPEATS 1");
+            return -1;
+        }
+        if (mPreload) {
+            errh->error("ZEROCOPY and PRELOAD are mutually exclusive");
+            return -1;
+        }
+        mMmap = true;
+    }
+
+    if (mRate != 0 && mSpeed != 0) {
+        errh->error("RATE and SPEED are mutually exclusive");
+        return -1;
+    }
+
+    if (mSpeed < 0) {
+        errh->error("SPEED must be positive");
+        return -1;
+    }
+
+    if (mSpeed != 0 && !mMmap && !mPreload) {
+        errh->error("SPEED requires MMAP or PRELOAD");
+        return -1;
+    }
+
+    if (mBurst == 0) {
+        errh->error("BURST must be at least 1");
+        return -1;
+    }
+
     return 0;
 }
 
 int UPFRouterPcapReader::initialize(ErrorHandler *errh) {
     std::string fileName(mFilename.c_str());
-    try {
-        errh->message("Reading from file %s (repeats: %u)", fileName.c_str(),
+
+    if (mPreload) {
+        if (preload(errh) < 0) {
+            return -1;
+        }
+    } else if (mMmap) {
+        errh->message("Mapping file %s (repeats: %u)", fileName.c_str(),
                       mRepeats);
-        mEthReader =
-            std::make_unique<NetworkLib::PcapEthReader>(fileName, mRepeats);
-    } catch (std::exception &e) {
-        errh->error("%s", e.what());
-        return -1;
+
+        if (!mPcapFile.open(mFilename, mZeroCopy, errh)) {
+            return -1;
+        }
+
+        if (mPcapFile.linkType() != UPF_PCAP_LINKTYPE_ETHERNET &&
+            mPcapFile.linkType() != UPF_PCAP_LINKTYPE_LINUX_SLL) {
+            errh->error("%s: unsupported link type %u", fileName.c_str(),
+                        mPcapFile.linkType());
+            return -1;
+        }
+    } else {
+        try {
+            errh->message("Reading from file %s (repeats: %u)",
+                          fileName.c_str(), mRepeats);
+            mEthReader = std::make_unique<NetworkLib::PcapEthReader>(
+                fileName, mRepeats);
+        } catch (std::exception &e) {
+            errh->error("%s", e.what());
+            return -1;
+        }
     }
 
     if (output_is_push(0)) {
         ScheduleInfo::join_scheduler(this, &mTask, errh);
+        mTimer.initialize(this);
     }
 
     mActive = true;
@@ -56,7 +118,160 @@ int UPFRouterPcapReader::initialize(ErrorHandler *errh) {
     return 0;
 }
 
-WritablePacket *UPFRouterPcapReader::doRead() {
+// Sizes of the Ethernet and LinuxCooked headers
+static const uint32_t ETH_HEADER_LENGTH = 14;
+static const uint32_t SLL_HEADER_LENGTH = 16;
+
+/// @brief Write the LinuxCooked record 'sll' (at least
+///        SLL_HEADER_LENGTH bytes long) as an Ethernet frame into
+///        'eth': (fake) destination MAC address, then source MAC
+///        address and EthType from the LinuxCooked header.
+static void sllToEthernet(const unsigned char *sll, uint32_t length,
+                          unsigned char *eth) {
+    memset(eth, 0, 6);
+    memcpy(eth + 6, sll + 6, 6);
+    memcpy(eth + 12, sll + 14, 2);
+    memcpy(eth + ETH_HEADER_LENGTH, sll + SLL_HEADER_LENGTH,
+           length - SLL_HEADER_LENGTH);
+}
+
+int UPFRouterPcapReader::preload(ErrorHandler *errh) {
+    if (!mPcapFile.open(mFilename, false, errh)) {
+        return -1;
+    }
+
+    const uint32_t linkType = mPcapFile.linkType();
+
+    if (linkType != UPF_PCAP_LINKTYPE_ETHERNET &&
+        linkType != UPF_PCAP_LINKTYPE_LINUX_SLL) {
+        errh->error("%s: unsupported link type %u", mFilename.c_str(),
+                    linkType);
+        mPcapFile.close();
+        return -1;
+    }
+
+    UPFPcapRecord record;
+
+    while (mPcapFile.next(record)) {
+        PreloadedPacket packet;
+        packet.offset = mArena.size();
+        packet.timestamp = record.timestamp;
+
+        if (linkType == UPF_PCAP_LINKTYPE_ETHERNET) {
+            packet.length = record.length;
+            mArena.insert(mArena.end(), record.data,
+                          record.data + record.length);
+        } else if (record.length >= SLL_HEADER_LENGTH) {
+            packet.length =
+                record.length - SLL_HEADER_LENGTH + ETH_HEADER_LENGTH;
+            mArena.resize(packet.offset + packet.length);
+            sllToEthernet(record.data, record.length, &mArena[packet.offset]);
+        } else {
+            // Too short to be a LinuxCooked record: skip it
+            continue;
+        }
+
+        mPreloaded.push_back(packet);
+    }
+
+    mPcapFile.close();
+    mArena.shrink_to_fit();
+
+    errh->message("Preloaded %u packets (%u bytes) from file %s (repeats: %u)",
+                  static_cast<unsigned>(mPreloaded.size()),
+                  static_cast<unsigned>(mArena.size()), mFilename.c_str(),
+                  mRepeats);
+    return 0;
+}
+
+/// @brief Buffer destructor of ZEROCOPY packets
+static void releasePcapMapping(unsigned char *, size_t, void *mapping) {
+    UPFPcapFile::release(mapping);
+}
+
+WritablePacket *UPFRouterPcapReader::doReadMapped(uint64_t &timestamp) {
+    UPFPcapRecord record;
+    WritablePacket *p = nullptr;
+
+    while (!p) {
+        if (!mPcapFile.next(record)) {
+            if (++mPass >= mRepeats) {
+                router()->please_stop_driver();
+                return nullptr;
+            }
+
+            mPcapFile.rewind();
+            continue;
+        }
+
+        if (mPcapFile.linkType() == UPF_PCAP_LINKTYPE_ETHERNET) {
+            if (mZeroCopy) {
+                void *mapping = mPcapFile.acquire();
+                p = Packet::make(const_cast<unsigned char *>(record.data),
+                                 record.length, releasePcapMapping, mapping);
+                if (!p) {
+                    UPFPcapFile::release(mapping);
+                }
+            } else {
+                p = Packet::make(0, record.data, record.length, 60);
+            }
+        } else if (record.length >= SLL_HEADER_LENGTH) {
+            p = Packet::make(0, (const unsigned char *)0,
+                             record.length - SLL_HEADER_LENGTH +
+                                 ETH_HEADER_LENGTH,
+                             60);
+            if (p) {
+                sllToEthernet(record.data, record.length, p->data());
+            }
+        } else {
+            // Too short to be a LinuxCooked record: skip it
+            continue;
+        }
+
+        if (!p) {
+            router()->please_stop_driver();
+            return nullptr;
+        }
+    }
+
+    timestamp = record.timestamp;
+    return p;
+}
+
+WritablePacket *UPFRouterPcapReader::doReadPreloaded(uint64_t &timestamp) {
+    if (mNextPreloaded == mPreloaded.size()) {
+        if (mPreloaded.empty() || ++mPass >= mRepeats) {
+            router()->please_stop_driver();
+            return nullptr;
+        }
+
+        mNextPreloaded = 0;
+    }
+
+    const PreloadedPacket &packet = mPreloaded[mNextPreloaded++];
+
+    WritablePacket *p =
+        Packet::make(0, &mArena[packet.offset], packet.length, 60);
+    if (!p) {
+        router()->please_stop_driver();
+        return nullptr;
+    }
+
+    timestamp = packet.timestamp;
+    return p;
+}
+
+WritablePacket *UPFRouterPcapReader::doRead(uint64_t &timestamp) {
+
+    timestamp = 0;
+
+    if (mPreload) {
+        return doReadPreloaded(timestamp);
+    }
+
+    if (mMmap) {
+        return doReadMapped(timestamp);
+    }
 
     if (!mEthReader->packetAvailable()) {
         router()->please_stop_driver();
@@ -99,24 +314,89 @@ WritablePacket *UPFRouterPcapReader::doRead() {
     return p;
 }
 
-Packet *UPFRouterPcapReader::pull(int) {
-    WritablePacket *p = doRead();
+Packet *UPFRouterPcapReader::nextPacket(bool &wait) {
+    wait = false;
+
+    if (mRate == 0 && mSpeed == 0) {
+        uint64_t timestamp;
+        return doRead(timestamp);
+    }
+
+    if (!mPending) {
+        uint64_t timestamp;
+        mPending = doRead(timestamp);
+
+        if (!mPending) {
+            return nullptr;
+        }
+
+        // Due time of this packet, relative to the first one (from
+        // the packet count, so rounding errors don't add up)
+        if (mRate != 0) {
+            mDue = mScheduled * 1000000000ULL / mRate;
+        } else if (mScheduled > 0 && timestamp > mLastTimestamp) {
+            // Going back in time (e.g. on a new pass): no gap
+            mDue += static_cast<uint64_t>((timestamp - mLastTimestamp) /
+                                          mSpeed);
+        }
+
+        mLastTimestamp = timestamp;
+        ++mScheduled;
+    }
+
+    const Timestamp now = Timestamp::now_steady();
+
+    if (!mStart) {
+        mStart = now;
+    }
+
+    if (static_cast<uint64_t>((now - mStart).nsecval()) < mDue) {
+        wait = true;
+        return nullptr;
+    }
+
+    Packet *p = mPending;
+    mPending = nullptr;
     return p;
 }
 
+Packet *UPFRouterPcapReader::pull(int) {
+    bool wait;
+    return nextPacket(wait);
+}
+
 bool UPFRouterPcapReader::run_task(Task *) {
     if (!mActive) {
         return false;
     }
 
-    WritablePacket *p = doRead();
+    uint32_t count = 0;
+    bool wait = false;
+
+    while (count < mBurst) {
+        Packet *p = nextPacket(wait);
+
+        if (!p) {
+            break;
+        }
 
-    if (p) {
         output(0).push(p);
+        ++count;
+    }
+
+    if (wait) {
+        const Timestamp due = mStart + Timestamp::make_nsec(mDue);
+
+        if (due > Timestamp::now_steady() +
+                      Timestamp::make_usec(SPIN_WAIT_USEC)) {
+            // mTimer reschedules the task
+            mTimer.schedule_at_steady(due);
+            return (count > 0);
+        }
     }
 
     mTask.fast_reschedule();
-    return (p != nullptr);
+    return (count > 0);
 }
 
 //////////////////////
@@ -125,10 +405,19 @@ bool UPFRouterPcapReader::run_task(Task *) {
 
 int UPFRouterPcapWriter::configure(Vector<String> &conf, ErrorHandler *errh) {
     String encap_type("ETHER");
+    String link_type("ETHER");
 
     if (Args(conf, this, errh)
             .read_mp("FILENAME", StringArg(), mFilename)
             .read_p("ENCAP", WordArg(), encap_type)
+            .read("ASYNC", BoolArg(), mAsync)
+            .read("BUFFER", mBufferSize)
+            .read("BLOCKSIZE", mBlockSize)
+            .read("DROP", BoolArg(), mDropOnFull)
+            .read("SNAPLEN", mSnapLen)
+            .read("LINKTYPE", WordArg(), link_type)
+            .read("ROTATESIZE", mRotateSize)
+            .read("ROTATETIME", SecondsArg(), mRotateTime)
             .complete() < 0) {
         errh->error("Error while parsing arguments!");
         return -1;
@@ -143,17 +432,58 @@ int UPFRouterPcapWriter::configure(Vector<String> &conf, ErrorHandler *errh) {
         return -1;
     }
 
+    if (link_type == "ETHER") {
+        mRawIPv4 = false;
+    } else if (link_type == "RAW" && mWriteIPv4) {
+        mRawIPv4 = true;
+    } else {
+        errh->error("bad link type (RAW requires ENCAP IP)");
+        return -1;
+    }
+
+    // Room for at least the Ethernet header (or the IPv4 one)
+    if (mSnapLen != 0 && mSnapLen < 20) {
+        errh->error("SNAPLEN must be 0 or at least 20");
+        return -1;
+    }
+
+    mUseFileWriter = mAsync || mRawIPv4 || mSnapLen != 0 ||
+                     mRotateSize != 0 || mRotateTime != 0;
+
     return 0;
 }
 
 int UPFRouterPcapWriter::initialize(ErrorHandler *errh) {
     std::string fileName(mFilename.c_str());
-    try {
-        errh->message("Writing to file %s", fileName.c_str());
-        mEthWriter = std::make_unique<NetworkLib::PcapEthWriterPlus>(fileName);
-    } catch (std::exception &e) {
-        errh->error("%s", e.what());
-        return -1;
+
+    if (mUseFileWriter) {
+        errh->message("Writing to file %s%s", fileName.c_str(),
+                      mAsync ? " (asynchronously)" : "");
+
+        const uint32_t linkType =
+            mRawIPv4 ? UPF_PCAP_LINKTYPE_RAW : UPF_PCAP_LINKTYPE_ETHERNET;
+
+        if (!mFileWriter.open(mFilename, linkType,
+                              mSnapLen ? mSnapLen : 65535, mBlockSize,
+                              errh)) {
+            return -1;
+        }
+
+        mFileWriter.setRotation(mRotateSize,
+                                mRotateTime * 1000000000ULL);
+
+        if (mAsync && !mAsyncWriter.start(&mFileWriter, mBufferSize, errh)) {
+            return -1;
+        }
+    } else {
+        try {
+            errh->message("Writing to file %s", fileName.c_str());
+            mEthWriter =
+                std::make_unique<NetworkLib::PcapEthWriterPlus>(fileName);
+        } catch (std::exception &e) {
+            errh->error("%s", e.what());
+            return -1;
+        }
     }
 
     if (input_is_pull(0)) {
@@ -165,12 +495,50 @@ int UPFRouterPcapWriter::initialize(ErrorHandler *errh) {
     return 0;
 }
 
+void UPFRouterPcapWriter::cleanup(CleanupStage) {
+    // Write out what is still queued
+    mAsyncWriter.stop();
+    mFileWriter.close();
+}
+
+void UPFRouterPcapWriter::doWriteRecord(Packet *p) {
+    // Fake Ethernet header of IPv4 packets
+    static const unsigned char ethHeader[14] = {0, 0, 0, 0, 0, 0, 0,
+                                                0, 0, 0, 0, 0, 0x08, 0x00};
+    const uint32_t headerLength =
+        (mWriteIPv4 && !mRawIPv4) ? sizeof(ethHeader) : 0;
+    const uint32_t origLength = headerLength + p->length();
+    uint32_t length = p->length();
+    const uint64_t timestamp = Timestamp::now().nsecval();
+
+    if (mSnapLen != 0 && origLength > mSnapLen) {
+        length = mSnapLen - headerLength;
+    }
+
+    if (mAsync) {
+        if (!mAsyncWriter.append(ethHeader, headerLength, p->data(), length,
+                                 origLength, timestamp, !mDropOnFull)) {
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    } else if (!mFileWriter.append(ethHeader, headerLength, p->data(),
+                                   length, origLength, timestamp)) {
+        click_chatter("*** UPFRouterPcapWriter:doWrite(Packet *): can't "
+                      "write: %s",
+                      strerror(mFileWriter.lastError()));
+    }
+}
+
 void UPFRouterPcapWriter::doWrite(Packet *p) {
     if (p == nullptr) {
         // No packet to write
         return;
     }
 
+    if (mUseFileWriter) {
+        doWriteRecord(p);
+        return;
+    }
+
     try {
 
         // Get a BufferView on the packet buffer
@@ -228,8 +596,35 @@ bool UPFRouterPcapWriter::run_task(Task *) {
     return (p != nullptr);
 }
 
+String UPFRouterPcapWriter::rh_dropped(void *) {
+    return String(static_cast<unsigned long long>(mDropped.load()));
+}
+
+String UPFRouterPcapWriter::rh_write_errors(void *) {
+    return String(
+        static_cast<unsigned long long>(mAsyncWriter.writeErrors()));
+}
+
+String UPFRouterPcapWriter::rh_last_error(void *) {
+    const int error = mAsyncWriter.lastError();
+    return error ? String(strerror(error)) : String();
+}
+
+String UPFRouterPcapWriter::rh_rotate_error(void *) {
+    const int error = mFileWriter.rotateError();
+    return error ? String(strerror(error)) : String();
+}
+
+void UPFRouterPcapWriter::add_handlers() {
+    add_read_handler("dropped", read_handler_dropped);
+    add_read_handler("writeerrors", read_handler_write_errors);
+    add_read_handler("lasterror", read_handler_last_error);
+    add_read_handler("rotateerror", read_handler_rotate_error);
+}
+
 // clang-format off
 CLICK_ENDDECLS
+ELEMENT_REQUIRES(UPFPcapFile UPFPcapFileWriter)
 EXPORT_ELEMENT(UPFRouterPcapReader)
 EXPORT_ELEMENT(UPFRouterPcapWriter)
 // clang-format on
@@ -4,11 +4,18 @@
 // clang-format off
 #include <click/element.hh>
 #include <click/task.hh>
+#include <click/timer.hh>
 CLICK_DECLS
 // clang-format on
 
 #include <upfs1aplib/s1aplib.hh>
 
+#include "upfpcapfile.hh"
+#include "upfpcapwriter.hh"
+
+#include <atomic>
+#include <vector>
+
 using namespace UPF;
 
 /*
@@ -23,11 +30,41 @@ using namespace UPF;
  * a fake Ethernet header is prepended, with a fake destination MAC
  * address -- source MAC address and EthType are taken from the
  * LinuxCooked header, see NetworkLib::PcapEthReader).
+ *
+ * When MMAP is true (default: false), the file is mapped in memory and
+ * each packet is allocated with the size of its record, instead of
+ * the snapshot length of the file (LinuxCooked records get a zero
+ * destination MAC address). With ZEROCOPY true (which implies MMAP),
+ * Ethernet records aren't even copied: packets point straight into the
+ * mapping, whose pages are copied only if a packet gets modified. As
+ * such changes would show up on the next pass, ZEROCOPY requires
+ * REPEATS to be 1. ZEROCOPY packets have no headroom: the bytes before
+ * a record belong to the previous one, so they can't be lent out. Only
+ * the Ethernet header, once stripped, leaves room, which is too little
+ * for the outer headers of GTPv1-U: elements pushing headers (e.g.
+ * UPFRouter encapsulating port-2 traffic) reallocate and copy such
+ * packets, losing the benefit of ZEROCOPY.
+ *
+ * When PRELOAD is true (default: false), the whole file is loaded in a
+ * contiguous memory arena at initialization time, so later passes
+ * don't touch the disk (and neither does the first one).
+ *
+ * By default, packets are emitted as fast as possible. With RATE N,
+ * they are emitted at N packets per second; with SPEED F, they keep
+ * the original gaps between records, divided by F (so SPEED 1 replays
+ * the capture in real time, SPEED 2 twice as fast). SPEED needs the
+ * record timestamps, so it requires MMAP or PRELOAD. In push mode,
+ * up to BURST packets (default: 1) are emitted each time the task
+ * runs.
  */
 class UPFRouterPcapReader : public Element {
   public:
-    UPFRouterPcapReader() : mActive(false), mTask(this){};
-    ~UPFRouterPcapReader(){};
+    UPFRouterPcapReader() : mActive(false), mTask(this), mTimer(&mTask){};
+    ~UPFRouterPcapReader() {
+        if (mPending) {
+            mPending->kill();
+        }
+    };
 
     // clang-format off
     const char *class_name() const	{ return "UPFRouterPcapReader"; }
@@ -42,7 +79,22 @@ class UPFRouterPcapReader : public Element {
     virtual bool run_task(Task *) override;
 
   private:
-    WritablePacket *doRead();
+    /// @brief Read the next packet, and the capture time of its record
+    ///        (in nanoseconds, 0 if unknown)
+    WritablePacket *doRead(uint64_t &timestamp);
+
+    /// @brief doRead() in MMAP mode
+    WritablePacket *doReadMapped(uint64_t &timestamp);
+
+    /// @brief doRead() in PRELOAD mode
+    WritablePacket *doReadPreloaded(uint64_t &timestamp);
+
+    /// @brief Load the whole file into mArena
+    int preload(ErrorHandler *errh);
+
+    /// @brief Return the next packet if it is due (as per RATE/SPEED),
+    ///        otherwise nullptr, setting 'wait' if it's not due yet
+    Packet *nextPacket(bool &wait);
 
     bool mActive;
     Task mTask;
@@ -52,6 +104,54 @@ class UPFRouterPcapReader : public Element {
     std::unique_ptr<NetworkLib::PcapEthReader> mEthReader;
     String mFilename;
     std::size_t mRepeats = 1;
+
+    /// @brief The file, in MMAP mode
+    UPFPcapFile mPcapFile;
+    bool mMmap = false;
+    bool mZeroCopy = false;
+
+    /// @brief Passes over mPcapFile (or mPreloaded) done so far
+    std::size_t mPass = 0;
+
+    /// @brief A packet of the arena (an Ethernet frame)
+    struct PreloadedPacket {
+        std::size_t offset;
+        uint32_t length;
+        uint64_t timestamp;
+    };
+
+    /// @brief The packets, in PRELOAD mode
+    std::vector<unsigned char> mArena;
+    std::vector<PreloadedPacket> mPreloaded;
+    std::size_t mNextPreloaded = 0;
+    bool mPreload = false;
+
+    /// @brief Timing of the emitted packets: RATE packets per second,
+    ///        or original gaps divided by SPEED (0: as fast as possible)
+    uint32_t mRate = 0;
+    double mSpeed = 0;
+    uint32_t mBurst = 1;
+
+    /// @brief Wakes mTask up when the next packet is due
+    Timer mTimer;
+
+    /// @brief Waits shorter than this spin instead of using mTimer
+    static const uint32_t SPIN_WAIT_USEC = 100;
+
+    /// @brief Packet read but not yet due
+    WritablePacket *mPending = nullptr;
+
+    /// @brief Time the first packet was emitted
+    Timestamp mStart;
+
+    /// @brief Time at which mPending is due, after mStart (ns)
+    uint64_t mDue = 0;
+
+    /// @brief Packets whose due time was computed so far
+    uint64_t mScheduled = 0;
+
+    /// @brief Capture time of the previous record (SPEED mode)
+    uint64_t mLastTimestamp = 0;
 };
 
 /*
@@ -64,6 +164,27 @@ class UPFRouterPcapReader : public Element {
  * This element writes Ethernet frames or IPv4 packets/fragments to a
  * .pcap file.
  *
+ * When ASYNC is true (default: false), packets are copied into a ring
+ * of BUFFER bytes (default: 16 MiB) and written to the file by a
+ * dedicated thread, in blocks of BLOCKSIZE bytes (default: 1 MiB), so
+ * pushing a packet never waits for the filesystem. If the ring is full,
+ * packets are dropped when DROP is true (the default), otherwise the
+ * element waits for room. The 'dropped' read handler reports how many
+ * packets were dropped, 'writeerrors' how many records the writer
+ * thread failed to write out, and 'lasterror' the reason of the last
+ * such failure. In this mode the element must not be pushed
+ * to by several threads at once.
+ *
+ * SNAPLEN N (default: 0, i.e. no limit) writes at most N bytes of each
+ * packet (e.g. just the outer, GTPv1-U and inner headers). With ENCAP
+ * IP, LINKTYPE RAW writes IPv4 packets as such, instead of prepending a
+ * fake Ethernet header to each one (LINKTYPE ETHER, the default).
+ * ROTATESIZE N and ROTATETIME T (default: 0, i.e. never) start a new
+ * file before the current one gets bigger than N bytes or after T
+ * seconds: files are named FILENAME, FILENAME.1, FILENAME.2, ...
+ * If the next file can't be created, the capture goes on in the
+ * current one, without rotating any more until the element is
+ * reconfigured; the 'rotateerror' read handler then tells why.
  */
 class UPFRouterPcapWriter : public Element {
   public:
@@ -84,10 +205,52 @@ class UPFRouterPcapWriter : public Element {
     virtual Packet *pull(int port) override;
 
     virtual bool run_task(Task *) override;
+    virtual void cleanup(CleanupStage) override;
+    virtual void add_handlers() override;
 
   private:
     void doWrite(Packet *p);
 
+    /// @brief doWrite() through mFileWriter (possibly via the
+    ///        ASYNC writer thread)
+    void doWriteRecord(Packet *p);
+
+    ///@brief Return the number of packets dropped in ASYNC mode
+    String rh_dropped(void *vparam);
+
+    ///@brief Glue code
+    static String read_handler_dropped(Element *e, void *vparam) {
+        UPFRouterPcapWriter &self = *(static_cast<UPFRouterPcapWriter *>(e));
+        return self.rh_dropped(vparam);
+    }
+
+    ///@brief Return the number of failed writes in ASYNC mode
+    String rh_write_errors(void *vparam);
+
+    ///@brief Glue code
+    static String read_handler_write_errors(Element *e, void *vparam) {
+        UPFRouterPcapWriter &self = *(static_cast<UPFRouterPcapWriter *>(e));
+        return self.rh_write_errors(vparam);
+    }
+
+    ///@brief Return the reason of the last failed write in ASYNC mode
+    String rh_last_error(void *vparam);
+
+    ///@brief Glue code
+    static String read_handler_last_error(Element *e, void *vparam) {
+        UPFRouterPcapWriter &self = *(static_cast<UPFRouterPcapWriter *>(e));
+        return self.rh_last_error(vparam);
+    }
+
+    ///@brief Return the reason why the capture stopped rotating
+    String rh_rotate_error(void *vparam);
+
+    ///@brief Glue code
+    static String read_handler_rotate_error(Element *e, void *vparam) {
+        UPFRouterPcapWriter &self = *(static_cast<UPFRouterPcapWriter *>(e));
+        return self.rh_rotate_error(vparam);
+    }
+
     bool mActive;
     Task mTask;
 
@@ -98,6 +261,31 @@ class UPFRouterPcapWriter : public Element {
 
     // By default, write out Ethernet packets
     bool mWriteIPv4 = false;
+
+    /// @brief Write IPv4 packets without a fake Ethernet header
+    bool mRawIPv4 = false;
+
+    /// @brief Maximum bytes written of each packet (0: no limit)
+    uint32_t mSnapLen = 0;
+
+    /// @brief When to start a new file (0: never)
+    uint64_t mRotateSize = 0;
+    uint32_t mRotateTime = 0;
+
+    /// @brief True if mFileWriter is used instead of mEthWriter (for
+    ///        ASYNC, SNAPLEN, LINKTYPE RAW or rotation)
+    bool mUseFileWriter = false;
+
+    /// @brief The file, and its writer thread in ASYNC mode
+    UPFPcapFileWriter mFileWriter;
+    UPFPcapAsyncWriter mAsyncWriter;
+    bool mAsync = false;
+    bool mDropOnFull = true;
+    uint32_t mBufferSize = 16 << 20;
+    uint32_t mBlockSize = 1 << 20;
+
+    /// @brief Packets dropped as the ring was full
+    std::atomic<uint64_t> mDropped = {0};
 };
 
 // clang-format off
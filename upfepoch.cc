@@ -0,0 +1,68 @@
+/*
+ * upfepoch.{cc,hh} -- epoch-based reclamation for UPFRouter
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfepoch.hh"
+
+#include <algorithm>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+UPFEpochDomain::~UPFEpochDomain() {
+    // No readers left by now
+    for (auto &retired : mRetired) {
+        retired.deleter();
+    }
+}
+
+void UPFEpochDomain::setReaders(unsigned nreaders) {
+    mReaders.reset(new Reader[nreaders]);
+    mNumReaders = nreaders;
+}
+
+void UPFEpochDomain::retire(std::function<void()> deleter) {
+    // Readers entering from now on read the pointer after it was
+    // swapped, so they can't see the retired object.
+    const uint64_t epoch = mEpoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+
+    mRetired.push_back(Retired{epoch, std::move(deleter)});
+}
+
+std::size_t UPFEpochDomain::reclaim() {
+    // Pairs with the fence in enter(): either we see the epoch of a
+    // reader, or it sees the pointer swapped before retire().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t oldestEpoch = UINT64_MAX;
+    for (unsigned i = 0; i < mNumReaders; ++i) {
+        const uint64_t epoch =
+            mReaders[i].epoch.load(std::memory_order_acquire);
+
+        if (epoch != 0) {
+            oldestEpoch = std::min(oldestEpoch, epoch);
+        }
+    }
+
+    auto firstWaiting = std::partition(
+        mRetired.begin(), mRetired.end(),
+        [oldestEpoch](const Retired &r) { return r.epoch <= oldestEpoch; });
+
+    for (auto it = mRetired.begin(); it != firstWaiting; ++it) {
+        it->deleter();
+    }
+    mRetired.erase(mRetired.begin(), firstWaiting);
+
+    return mRetired.size();
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_PROVIDES(UPFEpochDomain)
+// clang-format on
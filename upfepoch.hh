@@ -0,0 +1,105 @@
+#ifndef CLICK_UPFEPOCH_HH
+#define CLICK_UPFEPOCH_HH
+
+// clang-format off
+#include <click/glue.hh>
+CLICK_DECLS
+// clang-format on
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/*
+ * Epoch-based reclamation of objects that readers reach through an
+ * atomic pointer, without taking any lock.
+ *
+ * Each reader (e.g. a Click thread) has a slot of its own: it brackets
+ * every access to the published objects with enter()/exit(). A writer
+ * publishes a new object by swapping the pointer, then retire()s the
+ * old one: it is released by reclaim() once every reader has left the
+ * critical sections in which it could have seen it.
+ *
+ * Writers must be serialized by the caller.
+ */
+class UPFEpochDomain {
+  public:
+    UPFEpochDomain() {}
+    ~UPFEpochDomain();
+
+    UPFEpochDomain(const UPFEpochDomain &) = delete;
+    UPFEpochDomain &operator=(const UPFEpochDomain &) = delete;
+
+    /// @brief Set the number of reader slots (before any reader
+    ///        enters)
+    void setReaders(unsigned nreaders);
+
+    /// @brief Enter a critical section as reader 'reader'
+    void enter(unsigned reader) {
+        mReaders[reader].epoch.store(mEpoch.load(std::memory_order_acquire),
+                                     std::memory_order_relaxed);
+        // Make our epoch visible before reading any published pointer
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    /// @brief Leave the critical section of reader 'reader'
+    void exit(unsigned reader) {
+        mReaders[reader].epoch.store(0, std::memory_order_release);
+    }
+
+    /// @brief Critical section of a reader, lasting as long as the
+    ///        guard object
+    class Guard {
+      public:
+        Guard(UPFEpochDomain &domain, unsigned reader)
+            : mDomain(domain), mReader(reader) {
+            mDomain.enter(mReader);
+        }
+        ~Guard() { mDomain.exit(mReader); }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+      private:
+        UPFEpochDomain &mDomain;
+        unsigned mReader;
+    };
+
+    /// @brief Have 'deleter' called by reclaim() once no reader can
+    ///        see the object it releases anymore (the object must be
+    ///        unpublished already)
+    void retire(std::function<void()> deleter);
+
+    /// @brief Release the retired objects no reader can see anymore
+    ///
+    /// @return the number of retired objects still waiting
+    std::size_t reclaim();
+
+  private:
+    /// @brief Epoch a reader entered its critical section in (0 when
+    ///        outside), on a cache line of its own
+    struct alignas(64) Reader {
+        std::atomic<uint64_t> epoch = {0};
+    };
+
+    std::unique_ptr<Reader[]> mReaders;
+    unsigned mNumReaders = 0;
+
+    /// @brief Current epoch (never 0)
+    std::atomic<uint64_t> mEpoch = {1};
+
+    struct Retired {
+        /// @brief Readers entered in this epoch (or later) can't see it
+        uint64_t epoch;
+        std::function<void()> deleter;
+    };
+
+    std::vector<Retired> mRetired;
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,79 @@
+/*
+ * upfflathashtable.{cc,hh} -- open-addressing hash table for UPFRouter
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfflathashtable.hh"
+
+#if CLICK_USERLEVEL
+#include <sys/mman.h>
+#endif
+
+#include <cstdlib>
+#include <cstring>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+#if CLICK_USERLEVEL
+/// @brief Size of a (x86-64) hugepage
+static const std::size_t HUGEPAGE_SIZE = 2 * 1024 * 1024;
+#endif
+
+void *upfFlatHashTableAlloc(std::size_t &size, bool &hugePages) {
+#if CLICK_USERLEVEL
+    if (hugePages) {
+        const std::size_t hugeSize =
+            (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+        void *ptr = mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (ptr != MAP_FAILED) {
+            size = hugeSize;
+            return ptr;
+        }
+
+        // No hugepages reserved: fall back to normal pages (which
+        // transparent hugepages may still back).
+        hugePages = false;
+    }
+
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+    return ptr;
+#else
+    hugePages = false;
+    void *ptr = CLICK_LALLOC(size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+#endif
+}
+
+void upfFlatHashTableFree(void *ptr, std::size_t size) {
+#if CLICK_USERLEVEL
+    munmap(ptr, size);
+#else
+    CLICK_LFREE(ptr, size);
+#endif
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_PROVIDES(UPFFlatHashTable)
+// clang-format on
@@ -0,0 +1,353 @@
+#ifndef CLICK_UPFFLATHASHTABLE_HH
+#define CLICK_UPFFLATHASHTABLE_HH
+
+// clang-format off
+#include <click/glue.hh>
+CLICK_DECLS
+// clang-format on
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Allocate/release the (zero-filled) memory of a UPFFlatHashTable,
+ * optionally backed by hugepages. If hugepages are requested but not
+ * available, normal pages are used ('hugePages' is then set to
+ * false). 'size' is rounded up to the size actually allocated, to be
+ * passed back on release.
+ */
+void *upfFlatHashTableAlloc(std::size_t &size, bool &hugePages);
+void upfFlatHashTableFree(void *ptr, std::size_t size);
+
+/*
+ * Open-addressing hash table mapping an unsigned integer key of type K
+ * (up to 64 bits) to a value of type T, stored in a single contiguous
+ * array of slots (linear probing, with backward-shift deletion).
+ *
+ * Key 0 marks empty slots, so it can't be used as a key (this is fine
+ * for IPv4 addresses of UEs and for GTPv1-U TEIDs, which are never 0).
+ *
+ * Lookups never allocate. Inserting grows the table (rehashing it) if
+ * it gets more than half full, so reserve() enough capacity up front
+ * to keep that off the data path. Growing moves every entry to another
+ * slot, and bumps generation().
+ *
+ * Any number of threads may lookup() entries while a single writer
+ * changes the table, provided that the writer brackets its changes
+ * with writeBegin()/writeEnd() and that the table has a fixed capacity
+ * (see setFixedCapacity()): the slots are guarded by a sequence
+ * counter, and readers retry if a change overlapped their lookup.
+ * find() and forEach() are for the writer only.
+ *
+ * T must be trivially copyable.
+ */
+template <typename K, typename T> class UPFFlatHashTable {
+  public:
+    UPFFlatHashTable() {}
+    ~UPFFlatHashTable() { release(); }
+
+    UPFFlatHashTable(const UPFFlatHashTable &) = delete;
+    UPFFlatHashTable &operator=(const UPFFlatHashTable &) = delete;
+
+    /// @brief Make room for at least 'capacity' entries (never shrinks)
+    ///
+    /// @return false on allocation failure
+    bool reserve(std::size_t capacity, bool useHugePages = false) {
+        mUseHugePages = useHugePages;
+
+        std::size_t nslots = 16;
+        while (nslots < 2 * capacity) {
+            nslots <<= 1;
+        }
+
+        return (nslots <= mMask + 1) || rehash(nslots);
+    }
+
+    /// @brief Never grow beyond the reserved capacity (insert() fails
+    ///        instead), so the slots don't move under concurrent readers
+    void setFixedCapacity(bool fixedCapacity) {
+        mFixedCapacity = fixedCapacity;
+    }
+
+    /// @brief Copy the value of 'key' into 'value' (safe against a
+    ///        concurrent writer)
+    ///
+    /// @return false if not found
+    bool lookup(K key, T &value) const {
+        for (;;) {
+            const uint32_t seq = mSeq.load(std::memory_order_acquire);
+
+            if (unlikely(seq & 1)) {
+                // The writer is at it
+                continue;
+            }
+
+            const T *found = find(key);
+            if (found) {
+                value = *found;
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (likely(mSeq.load(std::memory_order_relaxed) == seq)) {
+                return (found != nullptr);
+            }
+        }
+    }
+
+    /// @brief Like lookup(), also setting the field 'field' of the
+    ///        entry to 'stamp' with an atomic store, if stampIf(value)
+    ///        (e.g. for readers to record when it was last used). The
+    ///        store is checked
+    ///        against the sequence counter along with the copy, and
+    ///        both are retried if a change overlapped them. A store
+    ///        retried so may have hit another entry, moved into the
+    ///        slot meanwhile: 'field' must be one that the writer only
+    ///        reads atomically, and where a spurious stamp is harmless.
+    ///
+    /// @return false if not found
+    template <typename F, typename P>
+    bool lookupAndStamp(K key, T &value, F T::*field, F stamp, P stampIf) {
+        for (;;) {
+            const uint32_t seq = mSeq.load(std::memory_order_acquire);
+
+            if (unlikely(seq & 1)) {
+                // The writer is at it
+                continue;
+            }
+
+            T *found = find(key);
+            if (found) {
+                value = *found;
+                if (stampIf(value)) {
+                    __atomic_store_n(&(found->*field), stamp,
+                                     __ATOMIC_RELAXED);
+                }
+            }
+
+            // The store too must come before checking again
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (likely(mSeq.load(std::memory_order_relaxed) == seq)) {
+                return (found != nullptr);
+            }
+        }
+    }
+
+    /// @brief Start a change of the table (insert(), erase(), clear()
+    ///        or writing through a pointer they returned)
+    void writeBegin() {
+        mSeq.store(mSeq.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    /// @brief End a change started by writeBegin()
+    void writeEnd() {
+        mSeq.store(mSeq.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+    }
+
+    /// @brief Return the value of 'key', or nullptr if not found
+    T *find(K key) const {
+        if (!mSlots || key == 0) {
+            return nullptr;
+        }
+
+        for (std::size_t i = hash(key);; i = (i + 1) & mMask) {
+            Slot &slot = mSlots[i];
+
+            if (slot.key == key) {
+                return &slot.value;
+            } else if (slot.key == 0) {
+                return nullptr;
+            }
+        }
+    }
+
+    /// @brief Return the value of 'key', adding a zero-filled one if
+    ///        not found (nullptr for key 0, or if the table is full and
+    ///        can't grow)
+    T *insert(K key) {
+        if (key == 0) {
+            return nullptr;
+        }
+
+        if (2 * (mSize + 1) > mMask + 1 &&
+            (mFixedCapacity || !rehash(2 * (mMask + 1)))) {
+            return find(key);
+        }
+
+        for (std::size_t i = hash(key);; i = (i + 1) & mMask) {
+            Slot &slot = mSlots[i];
+
+            if (slot.key == key) {
+                return &slot.value;
+            } else if (slot.key == 0) {
+                slot.key = key;
+                slot.value = T();
+                ++mSize;
+                return &slot.value;
+            }
+        }
+    }
+
+    /// @brief Remove 'key'
+    ///
+    /// @return false if not found
+    bool erase(K key) {
+        if (!mSlots || key == 0) {
+            return false;
+        }
+
+        std::size_t i = hash(key);
+        while (mSlots[i].key != key) {
+            if (mSlots[i].key == 0) {
+                return false;
+            }
+            i = (i + 1) & mMask;
+        }
+
+        // Shift back the following entries of the cluster that would
+        // no longer be reachable through slot i.
+        for (std::size_t j = (i + 1) & mMask; mSlots[j].key != 0;
+             j = (j + 1) & mMask) {
+            const std::size_t home = hash(mSlots[j].key);
+
+            if (((j - home) & mMask) >= ((j - i) & mMask)) {
+                mSlots[i] = mSlots[j];
+                i = j;
+            }
+        }
+
+        mSlots[i].key = 0;
+        --mSize;
+        return true;
+    }
+
+    /// @brief Call f(key, value) for each entry
+    template <typename F> void forEach(F f) const {
+        for (std::size_t i = 0; mSlots && i <= mMask; ++i) {
+            if (mSlots[i].key != 0) {
+                f(mSlots[i].key, mSlots[i].value);
+            }
+        }
+    }
+
+    /// @brief Call f(key, value) for each entry of slots 'start' to
+    ///        'end' - 1, in slot order, until it returns false
+    ///
+    /// @return the slot of the entry f() returned false for (to resume
+    ///         from), or 'end' (at most slots()) if it never did
+    template <typename F>
+    std::size_t forEachWhile(std::size_t start, std::size_t end, F f) const {
+        end = std::min(end, slots());
+
+        for (std::size_t i = start; i < end; ++i) {
+            if (mSlots[i].key != 0 && !f(mSlots[i].key, mSlots[i].value)) {
+                return i;
+            }
+        }
+        return std::max(start, end);
+    }
+
+    /// @brief Remove all entries (capacity is kept)
+    void clear() {
+        for (std::size_t i = 0; mSlots && i <= mMask; ++i) {
+            mSlots[i].key = 0;
+        }
+        mSize = 0;
+    }
+
+    /// @brief Number of entries
+    std::size_t size() const { return mSize; }
+
+    /// @brief Number of slots (entries are at slots 0 to slots() - 1)
+    std::size_t slots() const { return mSlots ? mMask + 1 : 0; }
+
+    /// @brief Number of entries that fit without growing
+    std::size_t capacity() const { return mSlots ? (mMask + 1) / 2 : 0; }
+
+    /// @brief True if the table is backed by hugepages
+    bool usesHugePages() const { return mHugePages; }
+
+    /// @brief Number of times the table grew (i.e. its entries moved to
+    ///        other slots) since its first allocation
+    uint32_t generation() const { return mGeneration; }
+
+  private:
+    struct Slot {
+        K key;
+        T value;
+    };
+
+    Slot *mSlots = nullptr;
+    std::size_t mMask = 0;
+    std::size_t mSize = 0;
+    std::size_t mAllocSize = 0;
+    bool mUseHugePages = false;
+    bool mHugePages = false;
+    bool mFixedCapacity = false;
+    uint32_t mGeneration = 0;
+
+    /// @brief Sequence counter, odd while the writer changes the table
+    std::atomic<uint32_t> mSeq = {0};
+
+    /// @brief Fibonacci hashing: bits 32+ of key * 2^64/phi (with the
+    ///        upper half of 64-bit keys folded in first)
+    std::size_t hash(K key) const {
+        const uint64_t k = static_cast<uint64_t>(key);
+        return static_cast<std::size_t>(((k ^ (k >> 32)) *
+                                         0x9e3779b97f4a7c15ULL) >>
+                                        32) &
+               mMask;
+    }
+
+    bool rehash(std::size_t nslots) {
+        bool hugePages = mUseHugePages;
+        std::size_t allocSize = nslots * sizeof(Slot);
+        Slot *slots =
+            static_cast<Slot *>(upfFlatHashTableAlloc(allocSize, hugePages));
+
+        if (!slots) {
+            return false;
+        }
+
+        Slot *oldSlots = mSlots;
+        const std::size_t oldNSlots = oldSlots ? mMask + 1 : 0;
+        const std::size_t oldAllocSize = mAllocSize;
+
+        mSlots = slots;
+        mMask = nslots - 1;
+        mSize = 0;
+        mAllocSize = allocSize;
+        mHugePages = hugePages;
+
+        for (std::size_t i = 0; i < oldNSlots; ++i) {
+            if (oldSlots[i].key != 0) {
+                *insert(oldSlots[i].key) = oldSlots[i].value;
+            }
+        }
+
+        if (oldSlots) {
+            upfFlatHashTableFree(oldSlots, oldAllocSize);
+            ++mGeneration;
+        }
+
+        return true;
+    }
+
+    void release() {
+        if (mSlots) {
+            upfFlatHashTableFree(mSlots, mAllocSize);
+            mSlots = nullptr;
+            mMask = 0;
+            mSize = 0;
+        }
+    }
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,384 @@
+/*
+ * upfgtptrafficgen.{cc,hh} -- Click element generating GTPv1-U traffic
+ * for load testing UPFRouter
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+#include <click/standard/scheduleinfo.hh>
+// clang-format on
+
+#include "upfgtptrafficgen.hh"
+#include "upfrouter.hh"
+
+#include <click/args.hh>
+#include <click/error.hh>
+#include <click/ipaddress.hh>
+#include <click/router.hh>
+#include <clicknet/ip.h>
+#include <clicknet/tcp.h>
+#include <clicknet/udp.h>
+
+#include <algorithm>
+#include <cstring>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+/// @brief Sizes of the outer IPv4, UDP and GTPv1-U headers
+static const uint32_t GTPU_OUTER_LENGTH = 20 + 8 + 8;
+
+/// @brief UDP port of GTPv1-U
+static const uint16_t GTPU_PORT = 2152;
+
+/// @brief First TEIDs of the eNodeB and EPC endpoints
+static const uint32_t ENB_TEID_BASE = 0x01000000;
+static const uint32_t EPC_TEID_BASE = 0x02000000;
+
+/// @brief Parse a `proto-port` pair
+static bool parseFlow(const String &str, uint8_t &protocol, uint16_t &port) {
+    const int dash = str.find_left('-');
+    int p;
+    int q;
+
+    if (dash < 0 || !IntArg().parse(str.substring(0, dash), p) ||
+        !IntArg().parse(str.substring(dash + 1), q) || p < 0 || p > 0xff ||
+        q < 0 || q > 0xffff) {
+        return false;
+    }
+
+    protocol = p;
+    port = q;
+    return true;
+}
+
+int UPFGTPTrafficGen::configure(Vector<String> &conf, ErrorHandler *errh) {
+    IPAddress ueAddress(htonl(0x2d2d0000));
+    IPAddress ueMask(htonl(0xffff0000));
+    IPAddress eNBAddress(htonl(0xc0a80000));
+    IPAddress eNBMask(htonl(0xffffff00));
+    IPAddress epcAddress(htonl(0xc0a80101));
+    IPAddress dstAddress(htonl(0x0ac80000));
+    IPAddress dstMask(htonl(0xffff0000));
+    String sizes("64");
+    String protocols("17-5000");
+    String match;
+
+    if (Args(conf, this, errh)
+            .read("UES", mNumUEs)
+            .read("UEPREFIX", IPPrefixArg(true), ueAddress, ueMask)
+            .read("ENBS", mNumENBs)
+            .read("ENBPREFIX", IPPrefixArg(true), eNBAddress, eNBMask)
+            .read("EPC", IPAddressArg(), epcAddress)
+            .read("DSTPREFIX", IPPrefixArg(true), dstAddress, dstMask)
+            .read("SIZES", StringArg(), sizes)
+            .read("PROTOCOLS", StringArg(), protocols)
+            .read("MATCH", StringArg(), match)
+            .read("MATCHRATIO", DoubleArg(), mMatchRatio)
+            .read("UPLINK", DoubleArg(), mUplinkRatio)
+            .read("PLAIN", DoubleArg(), mPlainRatio)
+            .read("RATE", mRate)
+            .read("BURST", mBurst)
+            .read("LIMIT", mLimit)
+            .read("STOP", BoolArg(), mStop)
+            .read("ROUTER", ElementCastArg("UPFRouter"), mUPFRouter)
+            .read("UEMAPFILE", FilenameArg(), mUEMapFile)
+            .complete() < 0) {
+        errh->error("Error while parsing arguments!");
+        return -1;
+    }
+
+    // Host numbers available in the UE and eNodeB prefixes (0 and the
+    // broadcast address excluded)
+    const uint32_t ueHosts = ~ntohl(ueMask.addr());
+    const uint32_t eNBHosts = ~ntohl(eNBMask.addr());
+
+    if (mNumUEs == 0 || ueHosts < 2 || mNumUEs > ueHosts - 1) {
+        errh->error("UES must be between 1 and the size of UEPREFIX");
+        return -1;
+    }
+
+    if (mNumENBs == 0 || eNBHosts < 2 || mNumENBs > eNBHosts - 1) {
+        errh->error("ENBS must be between 1 and the size of ENBPREFIX");
+        return -1;
+    }
+
+    if (mBurst == 0) {
+        errh->error("BURST must be at least 1");
+        return -1;
+    }
+
+    mUEBase = ntohl(ueAddress.addr() & ueMask.addr());
+    mENBBase = ntohl(eNBAddress.addr() & eNBMask.addr());
+    mEPCAddress = epcAddress.addr();
+    mDstBase = ntohl(dstAddress.addr() & dstMask.addr());
+    mDstMask = ~ntohl(dstMask.addr());
+
+    Vector<String> words;
+
+    cp_spacevec(sizes, words);
+    for (const String &word : words) {
+        uint32_t size;
+
+        if (!IntArg().parse(word, size) ||
+            size > 0xffff - GTPU_OUTER_LENGTH) {
+            errh->error("|%s| is not a valid packet size", word.c_str());
+            return -1;
+        }
+        mSizes.push_back(size);
+    }
+
+    words.clear();
+    cp_spacevec(protocols, words);
+    for (const String &word : words) {
+        Flow flow;
+
+        if (!parseFlow(word, flow.protocol, flow.port)) {
+            errh->error("|%s| is not a valid protocol-port pair",
+                        word.c_str());
+            return -1;
+        }
+        mFlows.push_back(flow);
+    }
+
+    if (mSizes.empty() || mFlows.empty()) {
+        errh->error("SIZES and PROTOCOLS can't be empty");
+        return -1;
+    }
+
+    if (match) {
+        // Format: <protocol>-<address>/<prefix length>-<port>
+        const int dash1 = match.find_left('-');
+        const int dash2 = (dash1 < 0) ? -1 : match.find_left('-', dash1 + 1);
+        IPAddress matchAddress;
+        IPAddress matchMask;
+
+        if (dash2 < 0 ||
+            !parseFlow(match.substring(0, dash1) + match.substring(dash2),
+                       mMatchFlow.protocol, mMatchFlow.port) ||
+            !IPPrefixArg(true).parse(
+                match.substring(dash1 + 1, dash2 - dash1 - 1), matchAddress,
+                matchMask)) {
+            errh->error("|%s| is not a valid MatchMap rule", match.c_str());
+            return -1;
+        }
+
+        mMatchBase = ntohl(matchAddress.addr() & matchMask.addr());
+        mMatchMask = ~ntohl(matchMask.addr());
+    } else {
+        mMatchRatio = 0;
+    }
+
+    // Build the UEs
+    mUEs.resize(mNumUEs);
+    for (uint32_t i = 0; i < mNumUEs; ++i) {
+        UPFUEMapRecord &ue = mUEs[i];
+
+        ue.ueAddress = htonl(mUEBase + 1 + i);
+        ue.eNBAddress = htonl(mENBBase + 1 + i % mNumENBs);
+        ue.eNBTeid = htonl(ENB_TEID_BASE + i);
+        ue.epcAddress = mEPCAddress;
+        ue.epcTeid = htonl(EPC_TEID_BASE + i);
+    }
+
+    return 0;
+}
+
+int UPFGTPTrafficGen::initialize(ErrorHandler *errh) {
+    if (mUPFRouter) {
+        std::size_t invalid;
+        const std::size_t dropped =
+            mUPFRouter->addUEs(mUEs.data(), mUEs.size(), invalid);
+
+        if (invalid > 0) {
+            errh->warning("%u UEs with address 0.0.0.0 skipped",
+                          static_cast<unsigned>(invalid));
+        }
+
+        if (dropped > 0) {
+            errh->warning("%u UEs don't fit in the UEMap of %s",
+                          static_cast<unsigned>(dropped),
+                          mUPFRouter->name().c_str());
+        }
+    }
+
+    if (mUEMapFile &&
+        !UPFUEMapFile::save(mUEMapFile, mUEs.data(), mUEs.size(), errh)) {
+        return -1;
+    }
+
+    ScheduleInfo::join_scheduler(this, &mTask, errh);
+    mTimer.initialize(this);
+
+    return 0;
+}
+
+void UPFGTPTrafficGen::writeIPv4Header(unsigned char *data, uint32_t length,
+                                       uint8_t protocol, uint32_t src,
+                                       uint32_t dst) {
+    click_ip *ip = reinterpret_cast<click_ip *>(data);
+
+    ip->ip_v = 4;
+    ip->ip_hl = sizeof(click_ip) >> 2;
+    ip->ip_len = htons(length);
+    ip->ip_ttl = 64;
+    ip->ip_p = protocol;
+    ip->ip_src.s_addr = src;
+    ip->ip_dst.s_addr = dst;
+    ip->ip_sum = click_in_cksum(data, sizeof(click_ip));
+}
+
+WritablePacket *UPFGTPTrafficGen::makePacket(int &port) {
+    const UPFUEMapRecord &ue = mUEs[random() % mUEs.size()];
+
+    Direction direction = DOWNLINK;
+    if (noutputs() > PLAIN && randomRatio() < mPlainRatio) {
+        direction = PLAIN;
+    } else if (randomRatio() < mUplinkRatio) {
+        direction = UPLINK;
+    }
+
+    // Traffic from the UE (for plain traffic, through the EPC)
+    const bool fromUE =
+        (direction == UPLINK) ||
+        (direction == PLAIN && randomRatio() < mUplinkRatio);
+
+    Flow flow;
+    uint32_t remote;
+    if (mMatchRatio > 0 && randomRatio() < mMatchRatio) {
+        flow = mMatchFlow;
+        remote = htonl(mMatchBase | (random() & mMatchMask));
+    } else {
+        flow = mFlows[random() % mFlows.size()];
+        remote = htonl(mDstBase | (random() & mDstMask));
+    }
+
+    const uint32_t l4Length = (flow.protocol == IP_PROTO_TCP)   ? 20
+                              : (flow.protocol == IP_PROTO_UDP) ? 8
+                                                                : 0;
+    const uint32_t size =
+        std::max<uint32_t>(mSizes[random() % mSizes.size()], 20 + l4Length);
+    const uint32_t outerLength =
+        (direction == PLAIN) ? 0 : GTPU_OUTER_LENGTH;
+
+    WritablePacket *p = Packet::make(Packet::default_headroom,
+                                     (const unsigned char *)0,
+                                     outerLength + size, 0);
+    if (!p) {
+        return nullptr;
+    }
+
+    unsigned char *data = p->data();
+    memset(data, 0, outerLength + size);
+
+    // Inner packet
+    unsigned char *inner = data + outerLength;
+    writeIPv4Header(inner, size, flow.protocol,
+                    fromUE ? ue.ueAddress : remote,
+                    fromUE ? remote : ue.ueAddress);
+
+    const uint16_t ephemeralPort = 32768 + (random() & 0x7fff);
+
+    if (flow.protocol == IP_PROTO_UDP) {
+        click_udp *udp = reinterpret_cast<click_udp *>(inner + 20);
+        udp->uh_sport = htons(ephemeralPort);
+        udp->uh_dport = htons(flow.port);
+        udp->uh_ulen = htons(size - 20);
+    } else if (flow.protocol == IP_PROTO_TCP) {
+        click_tcp *tcp = reinterpret_cast<click_tcp *>(inner + 20);
+        tcp->th_sport = htons(ephemeralPort);
+        tcp->th_dport = htons(flow.port);
+        // Data offset: 5 words; flags: ACK; window: 65535
+        inner[20 + 12] = 5 << 4;
+        inner[20 + 13] = 0x10;
+        inner[20 + 14] = 0xff;
+        inner[20 + 15] = 0xff;
+    }
+
+    if (direction != PLAIN) {
+        // Outer IPv4/UDP/GTPv1-U headers
+        const bool uplink = (direction == UPLINK);
+        writeIPv4Header(data, outerLength + size, IP_PROTO_UDP,
+                        uplink ? ue.eNBAddress : ue.epcAddress,
+                        uplink ? ue.epcAddress : ue.eNBAddress);
+
+        click_udp *udp = reinterpret_cast<click_udp *>(data + 20);
+        udp->uh_sport = htons(GTPU_PORT);
+        udp->uh_dport = htons(GTPU_PORT);
+        udp->uh_ulen = htons(8 + 8 + size);
+
+        // GTPv1-U: version 1, PT 1, no optional fields, G-PDU
+        unsigned char *gtpu = data + 28;
+        gtpu[0] = 0x30;
+        gtpu[1] = 0xff;
+        gtpu[2] = size >> 8;
+        gtpu[3] = size & 0xff;
+        memcpy(gtpu + 4, uplink ? &ue.epcTeid : &ue.eNBTeid, 4);
+    }
+
+    port = direction;
+    return p;
+}
+
+bool UPFGTPTrafficGen::run_task(Task *) {
+    uint32_t count = 0;
+
+    while (count < mBurst) {
+        if (mLimit != 0 && mCount >= mLimit) {
+            if (mStop) {
+                router()->please_stop_driver();
+            }
+            return (count > 0);
+        }
+
+        if (mRate != 0) {
+            const Timestamp now = Timestamp::now_steady();
+
+            if (!mStart) {
+                mStart = now;
+            }
+
+            const Timestamp due =
+                mStart + Timestamp::make_nsec(mCount * 1000000000ULL / mRate);
+
+            if (now < due) {
+                if (due > now + Timestamp::make_usec(SPIN_WAIT_USEC)) {
+                    // mTimer reschedules the task
+                    mTimer.schedule_at_steady(due);
+                    return (count > 0);
+                }
+                break;
+            }
+        }
+
+        int port;
+        WritablePacket *p = makePacket(port);
+
+        if (!p) {
+            break;
+        }
+
+        ++mCount;
+        ++count;
+        output(port).push(p);
+    }
+
+    mTask.fast_reschedule();
+    return (count > 0);
+}
+
+String UPFGTPTrafficGen::rh_count(void *) {
+    return String(static_cast<unsigned long long>(mCount));
+}
+
+void UPFGTPTrafficGen::add_handlers() {
+    add_read_handler("count", read_handler_count);
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(UPFUEMapFile)
+EXPORT_ELEMENT(UPFGTPTrafficGen)
+// clang-format on
@@ -0,0 +1,175 @@
+#ifndef CLICK_UPFGTPTRAFFICGEN_HH
+#define CLICK_UPFGTPTRAFFICGEN_HH
+
+// clang-format off
+#include <click/element.hh>
+#include <click/task.hh>
+#include <click/timer.hh>
+CLICK_DECLS
+// clang-format on
+
+#include "upfuemapfile.hh"
+
+#include <cstdint>
+#include <vector>
+
+class UPFRouter;
+
+/*
+ * =c
+ * UPFGTPTrafficGen([UES N] [UEPREFIX PREFIX] [ENBS N] [ENBPREFIX PREFIX]
+ *                  [EPC ADDR] [DSTPREFIX PREFIX] [SIZES "S1 S2 ..."]
+ *                  [PROTOCOLS "PROTO-PORT ..."] [MATCH RULE]
+ *                  [MATCHRATIO R] [UPLINK R] [PLAIN R] [RATE N]
+ *                  [BURST N] [LIMIT N] [STOP {true|false}]
+ *                  [ROUTER ELEMENT] [UEMAPFILE FILE])
+ * =s debugging
+ *
+ * =d
+ *
+ * Generate synthetic traffic for N UEs (default: 1000), to load test
+ * UPFRouter without capture files.
+ *
+ * UE addresses are taken in order from UEPREFIX (default:
+ * 45.45.0.0/16), and UEs are spread over ENBS eNodeBs (default: 1),
+ * whose addresses are taken from ENBPREFIX (default: 192.168.0.0/24);
+ * the EPC address is EPC (default: 192.168.1.1). The eNodeB (EPC) TEID
+ * of UE i is 0x01000000 + i (0x02000000 + i).
+ *
+ * Instead of S1AP signalling, the UEs are made known to UPFRouter
+ * directly: either by giving the UPFRouter element as ROUTER (its
+ * UEMap is seeded at initialization time), or by saving them into the
+ * UEMap snapshot UEMAPFILE (see upfuemapfile.hh), to be loaded with
+ * UPFRouter's 'uemapfile' keyword or 'uemapload' handler.
+ *
+ * Output 0 emits downlink GTPv1-U traffic (from the EPC, for
+ * UPFRouter's input 0) and output 1 uplink GTPv1-U traffic (from the
+ * eNodeBs, for UPFRouter's input 1), UPLINK (default: 0.5) being the
+ * fraction of uplink traffic. If output 2 is connected, a fraction
+ * PLAIN (default: 0) of the packets is instead plain IPv4 traffic
+ * from/to a UE, as sent by VNFs to UPFRouter's input 2.
+ *
+ * The inner packets are RATE packets per second (default: 0, as fast
+ * as possible), BURST at a time (default: 32); after LIMIT packets
+ * (default: 0, no limit) the element stops, stopping the driver too
+ * if STOP is true (default: false). Their IPv4 total length is taken
+ * at random from SIZES (default: "64"), their protocol and destination
+ * port from PROTOCOLS (default: "17-5000"; protocols 6 and 17 get a
+ * TCP/UDP header), and the remote end is an address of DSTPREFIX
+ * (default: 10.200.0.0/16). A fraction MATCHRATIO (default: 0) of the
+ * packets instead matches the MatchMap rule MATCH (e.g.
+ * `6-10.0.0.0/8-80`): uplink ones are sent to its protocol, address
+ * range and port, downlink ones (whose inner destination is the UE)
+ * get its protocol and port.
+ *
+ * The 'count' read handler reports how many packets were generated.
+ */
+class UPFGTPTrafficGen : public Element {
+  public:
+    UPFGTPTrafficGen() : mTask(this), mTimer(&mTask) {}
+    ~UPFGTPTrafficGen() {}
+
+    // clang-format off
+    const char *class_name() const	{ return "UPFGTPTrafficGen"; }
+    const char *port_count() const      { return "0/2-3"; }
+    const char *processing() const      { return PUSH; }
+    // clang-format on
+
+    // Implement the Element interface
+    virtual int configure(Vector<String> &conf, ErrorHandler *errh) override;
+    virtual int initialize(ErrorHandler *errh) override;
+    virtual bool run_task(Task *) override;
+    virtual void add_handlers() override;
+
+  private:
+    /// @brief A protocol and a destination port (host byte order)
+    struct Flow {
+        uint8_t protocol;
+        uint16_t port;
+    };
+
+    /// @brief Direction of a generated packet (i.e. output port)
+    enum Direction { DOWNLINK = 0, UPLINK = 1, PLAIN = 2 };
+
+    Task mTask;
+
+    /// @brief Wakes mTask up when the next packet is due (RATE mode)
+    Timer mTimer;
+
+    /// @brief The UEs (addresses and TEIDs in network byte order)
+    std::vector<UPFUEMapRecord> mUEs;
+
+    uint32_t mNumUEs = 1000;
+    uint32_t mNumENBs = 1;
+    uint32_t mUEBase = 0;
+    uint32_t mENBBase = 0;
+    uint32_t mEPCAddress = 0;
+
+    /// @brief Remote ends: mDstBase + (random & mDstMask), host order
+    uint32_t mDstBase = 0;
+    uint32_t mDstMask = 0;
+
+    std::vector<uint32_t> mSizes;
+    std::vector<Flow> mFlows;
+
+    /// @brief MatchMap rule to match (host byte order)
+    Flow mMatchFlow = {0, 0};
+    uint32_t mMatchBase = 0;
+    uint32_t mMatchMask = 0;
+    double mMatchRatio = 0;
+
+    double mUplinkRatio = 0.5;
+    double mPlainRatio = 0;
+
+    uint32_t mRate = 0;
+    uint32_t mBurst = 32;
+    uint64_t mLimit = 0;
+    bool mStop = false;
+
+    UPFRouter *mUPFRouter = nullptr;
+    String mUEMapFile;
+
+    /// @brief Packets generated so far
+    uint64_t mCount = 0;
+
+    /// @brief Time the first packet was generated (RATE mode)
+    Timestamp mStart;
+
+    /// @brief Waits shorter than this spin instead of using mTimer
+    static const uint32_t SPIN_WAIT_USEC = 100;
+
+    /// @brief State of the xorshift64* pseudo-random generator
+    uint64_t mRandom = 0x9e3779b97f4a7c15ULL;
+
+    uint64_t random() {
+        mRandom ^= mRandom >> 12;
+        mRandom ^= mRandom << 25;
+        mRandom ^= mRandom >> 27;
+        return mRandom * 0x2545f4914f6cdd1dULL;
+    }
+
+    /// @brief Random number in [0, 1)
+    double randomRatio() { return (random() >> 11) * (1.0 / (1ULL << 53)); }
+
+    /// @brief Build the next packet, setting the port it goes out of
+    WritablePacket *makePacket(int &port);
+
+    /// @brief Write an IPv4 header (with its checksum)
+    static void writeIPv4Header(unsigned char *data, uint32_t length,
+                                uint8_t protocol, uint32_t src,
+                                uint32_t dst);
+
+    ///@brief Return the number of packets generated
+    String rh_count(void *vparam);
+
+    ///@brief Glue code
+    static String read_handler_count(Element *e, void *vparam) {
+        UPFGTPTrafficGen &self = *(static_cast<UPFGTPTrafficGen *>(e));
+        return self.rh_count(vparam);
+    }
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
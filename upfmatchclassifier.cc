@@ -0,0 +1,150 @@
+/*
+ * upfmatchclassifier.{cc,hh} -- compiled MatchMap for UPFRouter
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfmatchclassifier.hh"
+
+#include <click/args.hh>
+#include <click/ipaddress.hh>
+
+#include <algorithm>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+bool UPFMatchClassifier::parseRule(const String &rule, Rule &parsed) {
+    const String str = rule.trim_space();
+
+    // Format: <protocol>-<address>/<prefix length>-<port>
+    const int dash1 = str.find_left('-');
+    const int dash2 = (dash1 < 0) ? -1 : str.find_left('-', dash1 + 1);
+
+    if (dash2 < 0) {
+        return false;
+    }
+
+    int protocol;
+    int port;
+    IPAddress address;
+    IPAddress mask;
+
+    if (!IntArg().parse(str.substring(0, dash1), protocol) ||
+        !IPPrefixArg(true).parse(str.substring(dash1 + 1, dash2 - dash1 - 1),
+                                 address, mask) ||
+        !IntArg().parse(str.substring(dash2 + 1), port)) {
+        return false;
+    }
+
+    if (protocol < 0 || protocol > 0xff || port < 0 || port > 0xffff) {
+        return false;
+    }
+
+    const uint32_t hostMask = ntohl(mask.addr());
+    parsed.protocol = protocol;
+    parsed.port = port;
+    parsed.first = ntohl(address.addr()) & hostMask;
+    parsed.last = parsed.first | ~hostMask;
+
+    return true;
+}
+
+void UPFMatchClassifier::addRule(const Rule &rule) {
+    Range range;
+    range.first = rule.first;
+    range.last = rule.last;
+
+    mRanges[makeKey(rule.protocol, rule.port)].push_back(range);
+    ++mNumRules;
+}
+
+void UPFMatchClassifier::clear() {
+    mRanges.clear();
+    mNumRules = 0;
+}
+
+void UPFMatchClassifier::compile() {
+    for (auto &it : mRanges) {
+        std::vector<Range> &ranges = it.second;
+
+        std::sort(ranges.begin(), ranges.end(),
+                  [](const Range &a, const Range &b) {
+                      return a.first < b.first;
+                  });
+
+        // Merge overlapping/adjacent ranges, so they are disjoint and
+        // can be binary-searched.
+        std::size_t n = 0;
+        for (std::size_t i = 1; i < ranges.size(); ++i) {
+            if (ranges[n].last == 0xffffffff ||
+                ranges[i].first <= ranges[n].last + 1) {
+                ranges[n].last = std::max(ranges[n].last, ranges[i].last);
+            } else {
+                ranges[++n] = ranges[i];
+            }
+        }
+
+        if (!ranges.empty()) {
+            ranges.resize(n + 1);
+        }
+        ranges.shrink_to_fit();
+    }
+}
+
+bool UPFMatchClassifier::matchKey(uint32_t key, uint32_t address) const {
+    auto it = mRanges.find(key);
+
+    if (it == mRanges.end()) {
+        return false;
+    }
+
+    const std::vector<Range> &ranges = it->second;
+
+    // First range starting after 'address': the one before it is the
+    // only candidate.
+    auto r = std::upper_bound(
+        ranges.begin(), ranges.end(), address,
+        [](uint32_t a, const Range &range) { return a < range.first; });
+
+    return (r != ranges.begin() && address <= (r - 1)->last);
+}
+
+bool UPFMatchClassifier::match(const click_ip *ip, std::size_t length) const {
+    if (mRanges.empty()) {
+        return false;
+    }
+
+    const uint8_t protocol = ip->ip_p;
+    const std::size_t headerLength = ip->ip_hl << 2;
+    uint16_t port = 0;
+
+    // Destination port, for protocols having one (non-first fragments
+    // don't carry it).
+    if ((protocol == IP_PROTO_TCP || protocol == IP_PROTO_UDP ||
+         protocol == IP_PROTO_SCTP) &&
+        IP_FIRSTFRAG(ip) && length >= headerLength + 4) {
+        const unsigned char *l4 =
+            reinterpret_cast<const unsigned char *>(ip) + headerLength;
+        port = (l4[2] << 8) | l4[3];
+    }
+
+    const uint32_t address = ntohl(ip->ip_dst.s_addr);
+
+    if (matchKey(makeKey(protocol, port), address) ||
+        matchKey(makeKey(0, port), address)) {
+        return true;
+    }
+
+    return (port != 0 && (matchKey(makeKey(protocol, 0), address) ||
+                          matchKey(makeKey(0, 0), address)));
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_PROVIDES(UPFMatchClassifier)
+// clang-format on
@@ -0,0 +1,89 @@
+#ifndef CLICK_UPFMATCHCLASSIFIER_HH
+#define CLICK_UPFMATCHCLASSIFIER_HH
+
+// clang-format off
+#include <click/string.hh>
+#include <clicknet/ip.h>
+CLICK_DECLS
+// clang-format on
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Compiled form of the UPFRouter MatchMap.
+ *
+ * The MatchMap is a list of rules `proto-CIDR-port`, where a `0`
+ * protocol or port is a wildcard, and a packet matches the MatchMap if
+ * it matches any rule (so the order of the rules doesn't matter).
+ *
+ * Here rules are grouped by (protocol, port). For each group, the
+ * destination CIDRs are turned into a sorted list of disjoint address
+ * ranges, looked up with a binary search. A packet is then classified
+ * with at most four hash lookups -- (proto, port), (proto, 0),
+ * (0, port), (0, 0) -- whatever the number of rules.
+ */
+class UPFMatchClassifier {
+  public:
+    /// @brief A rule, as parsed from its human-readable form
+    struct Rule {
+        /// @brief Protocol (0 for any)
+        uint8_t protocol;
+
+        /// @brief Destination port (0 for any)
+        uint16_t port;
+
+        /// @brief Destination addresses (host byte order)
+        uint32_t first;
+        uint32_t last;
+    };
+
+    /// @brief Parse a rule in its human-readable form
+    ///        (e.g. `6-192.168.3.0/24-80`) into 'rule'
+    ///
+    /// @return false if the rule can't be parsed
+    static bool parseRule(const String &str, Rule &rule);
+
+    /// @brief Add a rule
+    void addRule(const Rule &rule);
+
+    /// @brief Remove all rules
+    void clear();
+
+    /// @brief Sort and merge the ranges added so far (must be called
+    ///        after adding rules and before matching).
+    void compile();
+
+    /// @brief True if the IPv4 datagram (starting with header 'ip' and
+    ///        'length' bytes long) matches some rule.
+    bool match(const click_ip *ip, std::size_t length) const;
+
+    /// @brief Number of rules added
+    std::size_t size() const { return mNumRules; }
+
+  private:
+    /// @brief A range of destination addresses (host byte order)
+    struct Range {
+        uint32_t first;
+        uint32_t last;
+    };
+
+    /// @brief Ranges of each (protocol, port) group, keyed by
+    ///        makeKey(protocol, port)
+    std::unordered_map<uint32_t, std::vector<Range>> mRanges;
+
+    std::size_t mNumRules = 0;
+
+    static uint32_t makeKey(uint8_t protocol, uint16_t port) {
+        return (static_cast<uint32_t>(protocol) << 16) | port;
+    }
+
+    /// @brief True if 'address' falls in some range of group 'key'
+    bool matchKey(uint32_t key, uint32_t address) const;
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,315 @@
+/*
+ * upfmicrobench.{cc,hh} -- Click element running the stages of the
+ * UPFRouter data path in isolation
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfmicrobench.hh"
+#include "upfrouter.hh"
+
+#include <click/args.hh>
+#include <click/error.hh>
+#include <click/router.hh>
+#include <clicknet/ip.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+/// @brief Keep the compiler from optimizing away what 'p' points to
+static inline void doNotOptimize(const void *p) {
+    asm volatile("" : : "r"(p) : "memory");
+}
+
+int UPFMicroBench::configure(Vector<String> &conf, ErrorHandler *errh) {
+    if (Args(conf, this, errh)
+            .read_mp("ROUTER", ElementCastArg("UPFRouter"), mUPFRouter)
+            .read("PACKETS", mNumPackets)
+            .read("ITERATIONS", mIterations)
+            .read("STOP", BoolArg(), mStop)
+            .complete() < 0) {
+        errh->error("Error while parsing arguments!");
+        return -1;
+    }
+
+    if (mNumPackets == 0 || mIterations == 0) {
+        errh->error("PACKETS and ITERATIONS must be at least 1");
+        return -1;
+    }
+
+    return 0;
+}
+
+int UPFMicroBench::initialize(ErrorHandler *) {
+    mSamples.reserve(mNumPackets);
+    mTask.initialize(this, false);
+    return 0;
+}
+
+void UPFMicroBench::cleanup(CleanupStage) {
+    for (const Sample &sample : mSamples) {
+        sample.packet->kill();
+    }
+    mSamples.clear();
+}
+
+void UPFMicroBench::push(int port, Packet *p) {
+    if (mDone || mSamples.size() >= mNumPackets) {
+        p->kill();
+        return;
+    }
+
+    mSamples.push_back({p, port});
+
+    if (mSamples.size() == mNumPackets) {
+        // Not while pushing: run the stages from our task
+        mTask.reschedule();
+    }
+}
+
+bool UPFMicroBench::run_task(Task *) {
+    if (mDone) {
+        return false;
+    }
+    mDone = true;
+
+    try {
+        runStages();
+    } catch (std::exception &e) {
+        click_chatter("%s: caught exception: %s", name().c_str(), e.what());
+    }
+
+    click_chatter("%s: %s", name().c_str(), rh_results(nullptr).c_str());
+
+    if (mStop) {
+        router()->please_stop_driver();
+    }
+
+    return true;
+}
+
+template <typename F>
+void UPFMicroBench::runStage(int stage, std::size_t count, F body) {
+    if (count == 0) {
+        return;
+    }
+
+    // Warm up caches and branch predictors
+    for (std::size_t i = 0; i < count; ++i) {
+        body(i);
+    }
+
+    UPFProfiler::Sample sample;
+    const Timestamp start = Timestamp::now_steady();
+    mProfiler.start(sample);
+
+    for (uint32_t iteration = 0; iteration < mIterations; ++iteration) {
+        for (std::size_t i = 0; i < count; ++i) {
+            body(i);
+        }
+    }
+
+    mProfiler.stop(stage, sample, static_cast<uint64_t>(mIterations) * count);
+    mElapsed[stage] = (Timestamp::now_steady() - start).nsecval();
+}
+
+void UPFMicroBench::runStages() {
+    UPFRouter &upfr = *mUPFRouter;
+
+    // A UPFlib router of our own, whose callbacks stop processing
+    // right away (recording the encapsulated datagrams, while getting
+    // ready).
+    UPFRouterLib::Router router;
+    std::vector<NetworkLib::BufferView> innerData;
+    bool recording = true;
+
+    router.onGTPv1U_IPv4([&](auto &context) -> bool {
+        if (recording) {
+            innerData.push_back(context.gtpv1uDecoder->getData());
+        }
+        return false;
+    });
+    router.onIPv4PostProcess([](auto &) -> bool { return false; });
+    router.onNonIPv4([](auto &) -> bool { return false; });
+    router.onFinalProcess([](auto &) -> bool { return false; });
+
+    // What the stages work on, prepared up front
+    std::vector<NetworkLib::BufferView> packets;
+    std::vector<NetworkLib::BufferView> plainPackets;
+
+    /// @brief Copy of the headers of an encapsulated datagram
+    struct InnerHeader {
+        alignas(8) unsigned char data[64];
+        std::size_t length;
+
+        /// @brief Address of the UE (network byte order)
+        uint32_t ueAddress;
+    };
+    std::vector<InnerHeader> innerHeaders;
+    std::vector<std::unique_ptr<NetworkLib::IPv4Decoder>> innerDecoders;
+
+    for (const Sample &sample : mSamples) {
+        const NetworkLib::BufferView packet =
+            NetworkLib::BufferView::makeNonOwningBufferView(
+                sample.packet->data(), sample.packet->length());
+        packets.push_back(packet);
+
+        if (sample.port == 2) {
+            plainPackets.push_back(packet);
+            continue;
+        }
+
+        NetworkLib::ContextUserData userData = {};
+        userData.intUserData = sample.port;
+
+        const std::size_t recorded = innerData.size();
+        router.consumeIPv4Packet(packet, userData);
+
+        if (innerData.size() == recorded) {
+            // Not GTPv1-U
+            continue;
+        }
+
+        const NetworkLib::BufferView &inner = innerData.back();
+        InnerHeader header = {};
+        header.length = std::min(inner.size(), sizeof(header.data));
+
+        if (header.length < sizeof(click_ip)) {
+            innerData.pop_back();
+            continue;
+        }
+        inner.copyTo(0, header.length, header.data);
+
+        // Uplink traffic (from an eNodeB) is from the UE, downlink
+        // traffic is to the UE
+        const click_ip *ip = reinterpret_cast<const click_ip *>(header.data);
+        header.ueAddress =
+            (sample.port == 1) ? ip->ip_src.s_addr : ip->ip_dst.s_addr;
+
+        innerHeaders.push_back(header);
+        innerDecoders.emplace_back(new NetworkLib::IPv4Decoder(inner));
+    }
+
+    recording = false;
+
+    runStage(UPF_STAGE_BUFFER_VIEW, mSamples.size(), [&](std::size_t i) {
+        const Packet *p = mSamples[i].packet;
+        const NetworkLib::BufferView packet =
+            NetworkLib::BufferView::makeNonOwningBufferView(p->data(),
+                                                            p->length());
+        doNotOptimize(&packet);
+    });
+
+    runStage(UPF_STAGE_DISPATCH, packets.size(), [&](std::size_t i) {
+        NetworkLib::ContextUserData userData = {};
+        userData.intUserData = mSamples[i].port;
+        router.consumeIPv4Packet(packets[i], userData);
+    });
+
+    runStage(UPF_STAGE_INNER_DECODE, innerData.size(), [&](std::size_t i) {
+        const NetworkLib::IPv4Decoder decoder(innerData[i]);
+        doNotOptimize(&decoder);
+    });
+
+    {
+        // Keep the current MatchMap snapshot alive meanwhile
+        UPFEpochDomain::Guard guard(upfr.mMatchMapEpochs, upfr.threadIndex());
+        const UPFRouter::MatchMapSnapshot *matchMap =
+            upfr.mMatchMap.load(std::memory_order_acquire);
+
+        if (matchMap->classifierValid) {
+            runStage(UPF_STAGE_CLASSIFY, innerHeaders.size(),
+                     [&](std::size_t i) {
+                         const InnerHeader &header = innerHeaders[i];
+                         mSink += matchMap->classifier.match(
+                             reinterpret_cast<const click_ip *>(header.data),
+                             header.length);
+                     });
+        }
+
+        runStage(UPF_STAGE_RULE_MATCH, innerDecoders.size(),
+                 [&](std::size_t i) {
+                     mSink += matchMap->ruleMatcher.match(*innerDecoders[i]);
+                 });
+    }
+
+    runStage(UPF_STAGE_UE_LOOKUP, innerHeaders.size(), [&](std::size_t i) {
+        UPFRouter::UETunnelEndPoints endPoints;
+        mSink += upfr.mUETunnels.lookup(innerHeaders[i].ueAddress, endPoints);
+    });
+
+    runStage(UPF_STAGE_MAKE_PACKET, innerData.size(), [&](std::size_t i) {
+        WritablePacket *p = UPFRouter::makeWritablePacket(innerData[i]);
+        if (p) {
+            p->kill();
+        }
+    });
+
+    NetworkLib::IPv4PacketTap ipv4Tap;
+    NetworkLib::BufferWritableView ipv4WriteBuffer =
+        NetworkLib::BufferWritableView::makeIPv4Buffer();
+    NetworkLib::IPv4IdentificationSource identificationSource;
+    UPFRouterLib::GTPv1UEncapSink encapSink(ipv4Tap, ipv4WriteBuffer,
+                                            upfr.mRouter,
+                                            identificationSource);
+
+    encapSink.enableUDPChecksum(upfr.mDoEnableUDPChecksum);
+    encapSink.onUnknownUE([](const NetworkLib::BufferView &) { return true; });
+
+    {
+        // The sink reads the UEMap of UPFRouter's S1AP router
+        auto lock = upfr.lockUEMap();
+
+        runStage(UPF_STAGE_ENCAP_SINK, plainPackets.size(),
+                 [&](std::size_t i) {
+                     NetworkLib::ContextUserData userData = {};
+                     encapSink.consumeIPv4Packet(plainPackets[i], userData);
+                     mSink += ipv4Tap.getLastIPv4Packet().size();
+                 });
+    }
+}
+
+String UPFMicroBench::rh_results(void *) {
+    std::ostringstream res;
+    res << std::fixed << std::setprecision(2);
+
+    // One line per stage run: <stage>,<runs>,<ns/run>,<TSC cycles/run>,
+    // <cycles/run>,<instructions/run>,<cache misses/run>
+    for (int stage = 0; stage < UPF_NUM_STAGES; ++stage) {
+        const UPFProfileCounters &counters = mProfiler.stage(stage);
+
+        if (counters.calls == 0) {
+            continue;
+        }
+
+        const double calls = counters.calls;
+        res << unparseUPFProfileStage(stage) << ',' << counters.calls << ','
+            << (mElapsed[stage] / calls) << ','
+            << (counters.tscCycles / calls);
+        for (int i = 0; i < UPFPerfCounters::NUM_COUNTERS; ++i) {
+            res << ',' << (counters.values[i] / calls);
+        }
+        res << '\n';
+    }
+
+    return String(res.str().c_str());
+}
+
+void UPFMicroBench::add_handlers() {
+    add_read_handler("results", read_handler_results);
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(userlevel UPFProfile)
+EXPORT_ELEMENT(UPFMicroBench)
+// clang-format on
@@ -0,0 +1,126 @@
+#ifndef CLICK_UPFMICROBENCH_HH
+#define CLICK_UPFMICROBENCH_HH
+
+// clang-format off
+#include <click/element.hh>
+#include <click/task.hh>
+CLICK_DECLS
+// clang-format on
+
+#include "upfprofile.hh"
+
+#include <cstdint>
+#include <vector>
+
+class UPFRouter;
+
+/*
+ * =c
+ * UPFMicroBench(ROUTER [, PACKETS N] [, ITERATIONS N] [, STOP {true|false}])
+ * =s debugging
+ *
+ * =d
+ *
+ * Microbenchmark of the stages of the UPFRouter data path: each stage
+ * is run in isolation, in a tight loop over preloaded packets, against
+ * the UEMap and MatchMap of the UPFRouter element ROUTER.
+ *
+ * Packets pushed to input 0 (1) are taken as GTPv1-U traffic from the
+ * EPC (from an eNodeB), packets pushed to input 2 as plain IPv4
+ * traffic from VNFs, just like UPFRouter's inputs (e.g. they can come
+ * from UPFGTPTrafficGen, or from a capture). Once PACKETS packets
+ * (default: 4096) have been collected, each stage is run ITERATIONS
+ * times (default: 100) over the packets it applies to; then the
+ * results are printed, and the driver is stopped if STOP is true
+ * (default: false). Further packets are dropped.
+ *
+ * The stages are those of UPFRouter's 'profile' handler (see
+ * upfprofile.hh), that is:
+ *
+ * - buffer_view: building a BufferView out of each packet;
+ * - dispatch: Router::consumeIPv4Packet() on each packet, through a
+ *   UPFlib router of our own whose callbacks do nothing (so this is
+ *   just decoding and dispatching);
+ * - inner_decode: IPv4Decoder on the datagram encapsulated in
+ *   GTPv1-U;
+ * - classify, rule_match: matching the encapsulated datagram against
+ *   the compiled MatchMap and through RuleMatcher::match();
+ * - ue_lookup: looking up the UE of the encapsulated datagram;
+ * - make_packet: copying the encapsulated datagram into a new Click
+ *   Packet (and freeing it);
+ * - encap_sink: encapsulating each packet from input 2 through a
+ *   GTPv1UEncapSink (it finds UEs seeded with UPFGTPTrafficGen only if
+ *   ROUTER has 'inplaceencap false').
+ *
+ * The 'results' read handler has one line per stage:
+ * `<stage>,<runs>,<ns/run>,<TSC cycles/run>,<cycles/run>,
+ * <instructions/run>,<cache misses/run>` (the last three are read
+ * through perf_event_open(2), and are 0 if that isn't allowed).
+ */
+class UPFMicroBench : public Element {
+  public:
+    UPFMicroBench() : mTask(this) {}
+    ~UPFMicroBench() {}
+
+    // clang-format off
+    const char *class_name() const	{ return "UPFMicroBench"; }
+    const char *port_count() const      { return "1-3/0"; }
+    const char *processing() const      { return PUSH; }
+    // clang-format on
+
+    // Implement the Element interface
+    virtual int configure(Vector<String> &conf, ErrorHandler *errh) override;
+    virtual int initialize(ErrorHandler *errh) override;
+    virtual void cleanup(CleanupStage stage) override;
+    virtual void push(int port, Packet *p) override;
+    virtual bool run_task(Task *) override;
+    virtual void add_handlers() override;
+
+  private:
+    /// @brief A preloaded packet, and the input port it came from
+    struct Sample {
+        Packet *packet;
+        int port;
+    };
+
+    Task mTask;
+
+    UPFRouter *mUPFRouter = nullptr;
+    uint32_t mNumPackets = 4096;
+    uint32_t mIterations = 100;
+    bool mStop = false;
+
+    std::vector<Sample> mSamples;
+
+    /// @brief True once the stages have been run
+    bool mDone = false;
+
+    UPFProfiler mProfiler;
+
+    /// @brief Time spent in each stage (ns)
+    uint64_t mElapsed[UPF_NUM_STAGES] = {};
+
+    /// @brief Keeps the compiler from optimizing stages away
+    uint64_t mSink = 0;
+
+    /// @brief Run all the stages
+    void runStages();
+
+    /// @brief Run 'body(i)' for i in [0, count), ITERATIONS times,
+    ///        charging it to 'stage' (after a warm-up run)
+    template <typename F> void runStage(int stage, std::size_t count, F body);
+
+    ///@brief Return the results
+    String rh_results(void *vparam);
+
+    ///@brief Glue code
+    static String read_handler_results(Element *e, void *vparam) {
+        UPFMicroBench &self = *(static_cast<UPFMicroBench *>(e));
+        return self.rh_results(vparam);
+    }
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
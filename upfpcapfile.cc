@@ -0,0 +1,157 @@
+/*
+ * upfpcapfile.{cc,hh} -- memory-mapped .pcap files
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfpcapfile.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+/// @brief Magic numbers of .pcap files (as read in host byte order)
+static const uint32_t PCAP_MAGIC_USEC = 0xa1b2c3d4;
+static const uint32_t PCAP_MAGIC_NSEC = 0xa1b23c4d;
+
+/// @brief Sizes of the file header and of the record headers
+static const std::size_t PCAP_FILE_HEADER_SIZE = 24;
+static const std::size_t PCAP_RECORD_HEADER_SIZE = 16;
+
+uint32_t UPFPcapFile::field(const unsigned char *p) const {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return mSwapped ? __builtin_bswap32(value) : value;
+}
+
+bool UPFPcapFile::open(const String &fileName, bool writable,
+                       ErrorHandler *errh) {
+    close();
+
+    const int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        errh->error("%s: %s", fileName.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        errh->error("%s: %s", fileName.c_str(), strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    const std::size_t fileSize = st.st_size;
+    if (fileSize < PCAP_FILE_HEADER_SIZE) {
+        errh->error("%s: not a .pcap file", fileName.c_str());
+        ::close(fd);
+        return false;
+    }
+
+    const int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void *map = mmap(nullptr, fileSize, prot, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (map == MAP_FAILED) {
+        errh->error("%s: %s", fileName.c_str(), strerror(errno));
+        return false;
+    }
+
+    const unsigned char *header = static_cast<const unsigned char *>(map);
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+        mSwapped = false;
+    } else if (__builtin_bswap32(magic) == PCAP_MAGIC_USEC ||
+               __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+        mSwapped = true;
+        magic = __builtin_bswap32(magic);
+    } else {
+        errh->error("%s: not a .pcap file", fileName.c_str());
+        munmap(map, fileSize);
+        return false;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(map, fileSize, MADV_SEQUENTIAL);
+#endif
+
+    mNanoseconds = (magic == PCAP_MAGIC_NSEC);
+    mSnapLen = field(header + 16);
+    mLinkType = field(header + 20);
+
+    mMapping = new Mapping();
+    mMapping->address = map;
+    mMapping->size = fileSize;
+    mMapping->refs = 1;
+
+    mBegin = header + PCAP_FILE_HEADER_SIZE;
+    mEnd = header + fileSize;
+    mNext = mBegin;
+    return true;
+}
+
+void UPFPcapFile::close() {
+    if (mMapping) {
+        release(mMapping);
+        mMapping = nullptr;
+        mBegin = mEnd = mNext = nullptr;
+    }
+}
+
+bool UPFPcapFile::next(UPFPcapRecord &record) {
+    if (static_cast<std::size_t>(mEnd - mNext) < PCAP_RECORD_HEADER_SIZE) {
+        return false;
+    }
+
+    const uint32_t seconds = field(mNext);
+    const uint32_t fraction = field(mNext + 4);
+    const uint32_t length = field(mNext + 8);
+
+    if (length > static_cast<std::size_t>(mEnd - mNext) -
+                     PCAP_RECORD_HEADER_SIZE) {
+        return false;
+    }
+
+    record.data = mNext + PCAP_RECORD_HEADER_SIZE;
+    record.length = length;
+    record.timestamp = static_cast<uint64_t>(seconds) * 1000000000 +
+                       (mNanoseconds ? fraction : fraction * 1000ULL);
+
+    mNext = record.data + length;
+    return true;
+}
+
+void UPFPcapFile::rewind() { mNext = mBegin; }
+
+void *UPFPcapFile::acquire() {
+    mMapping->refs.fetch_add(1, std::memory_order_relaxed);
+    return mMapping;
+}
+
+void UPFPcapFile::release(void *mapping) {
+    Mapping *m = static_cast<Mapping *>(mapping);
+
+    if (m->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        munmap(m->address, m->size);
+        delete m;
+    }
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(userlevel)
+ELEMENT_PROVIDES(UPFPcapFile)
+// clang-format on
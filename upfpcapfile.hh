@@ -0,0 +1,106 @@
+#ifndef CLICK_UPFPCAPFILE_HH
+#define CLICK_UPFPCAPFILE_HH
+
+// clang-format off
+#include <click/error.hh>
+#include <click/string.hh>
+CLICK_DECLS
+// clang-format on
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * A .pcap file mapped in memory, whose records are read in place.
+ *
+ * Both microsecond and nanosecond captures are supported, in either
+ * byte order. The mapping is reference-counted, so packets built on
+ * top of the records (see acquire()) may outlive the UPFPcapFile they
+ * come from.
+ */
+
+/// @brief pcap link types
+enum UPFPcapLinkType {
+    UPF_PCAP_LINKTYPE_ETHERNET = 1,
+    UPF_PCAP_LINKTYPE_RAW = 101,
+    UPF_PCAP_LINKTYPE_LINUX_SLL = 113
+};
+
+/// @brief A record of a mapped .pcap file
+struct UPFPcapRecord {
+    /// @brief Captured bytes, inside the mapping
+    const unsigned char *data;
+
+    /// @brief Number of captured bytes
+    uint32_t length;
+
+    /// @brief Capture time, in nanoseconds
+    uint64_t timestamp;
+};
+
+class UPFPcapFile {
+  public:
+    UPFPcapFile() {}
+    ~UPFPcapFile() { close(); }
+
+    UPFPcapFile(const UPFPcapFile &) = delete;
+    UPFPcapFile &operator=(const UPFPcapFile &) = delete;
+
+    /// @brief Map 'fileName' in memory. If 'writable', the mapping is
+    ///        private and may be written to (without changing the
+    ///        file: written pages are copied on first write).
+    ///
+    /// @return false (reporting to 'errh') if it can't be read or is
+    ///         not a .pcap file
+    bool open(const String &fileName, bool writable, ErrorHandler *errh);
+
+    /// @brief Drop our reference to the mapping
+    void close();
+
+    /// @brief Get the next record
+    ///
+    /// @return false at the end of the file (a truncated last record
+    ///         is ignored)
+    bool next(UPFPcapRecord &record);
+
+    /// @brief Go back to the first record
+    void rewind();
+
+    /// @brief Link type of the records
+    uint32_t linkType() const { return mLinkType; }
+
+    /// @brief Maximum length of a record
+    uint32_t snapLen() const { return mSnapLen; }
+
+    /// @brief Take a reference to the mapping, to be released with
+    ///        release() (e.g. from a packet buffer destructor)
+    void *acquire();
+
+    /// @brief Release a reference taken with acquire()
+    static void release(void *mapping);
+
+  private:
+    struct Mapping {
+        void *address;
+        std::size_t size;
+        std::atomic<unsigned> refs;
+    };
+
+    Mapping *mMapping = nullptr;
+    const unsigned char *mBegin = nullptr;
+    const unsigned char *mEnd = nullptr;
+    const unsigned char *mNext = nullptr;
+
+    bool mSwapped = false;
+    bool mNanoseconds = false;
+    uint32_t mLinkType = 0;
+    uint32_t mSnapLen = 0;
+
+    uint32_t field(const unsigned char *p) const;
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
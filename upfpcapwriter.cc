@@ -0,0 +1,388 @@
+/*
+ * upfpcapwriter.{cc,hh} -- block-buffered and asynchronous .pcap writers
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfpcapwriter.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+/// @brief Header of a .pcap file (microsecond timestamps)
+struct UPFPcapFileHeader {
+    uint32_t magic;
+    uint16_t versionMajor;
+    uint16_t versionMinor;
+    int32_t thisZone;
+    uint32_t sigFigs;
+    uint32_t snapLen;
+    uint32_t linkType;
+};
+
+/// @brief Header of a .pcap record
+struct UPFPcapRecordHeader {
+    uint32_t seconds;
+    uint32_t microseconds;
+    uint32_t length;
+    uint32_t origLength;
+};
+
+/// @brief Alignment of the block buffer (suits direct I/O too)
+static const std::size_t PCAP_BLOCK_ALIGNMENT = 4096;
+
+bool UPFPcapFileWriter::open(const String &fileName, uint32_t linkType,
+                             uint32_t snapLen, std::size_t blockSize,
+                             ErrorHandler *errh) {
+    close();
+
+    blockSize = (blockSize + PCAP_BLOCK_ALIGNMENT - 1) &
+                ~(PCAP_BLOCK_ALIGNMENT - 1);
+
+    void *block;
+    if (posix_memalign(&block, PCAP_BLOCK_ALIGNMENT, blockSize) != 0) {
+        errh->error("%s: can't allocate a %u bytes buffer", fileName.c_str(),
+                    static_cast<unsigned>(blockSize));
+        return false;
+    }
+
+    mBlock = static_cast<unsigned char *>(block);
+    mBlockSize = blockSize;
+    mBlockUsed = 0;
+    mLastError = 0;
+    mRotateError = 0;
+
+    mFileName = fileName;
+    mLinkType = linkType;
+    mSnapLen = snapLen;
+    mFileIndex = 0;
+
+    if (!openFile(fileName, errh)) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+bool UPFPcapFileWriter::openFile(const String &fileName,
+                                 ErrorHandler *errh) {
+    mFd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (mFd < 0) {
+        mLastError = errno;
+        errh->error("%s: %s", fileName.c_str(), strerror(errno));
+        return false;
+    }
+
+    return putFileHeader();
+}
+
+bool UPFPcapFileWriter::putFileHeader() {
+    const UPFPcapFileHeader header = {0xa1b2c3d4, 2, 4, 0, 0, mSnapLen,
+                                      mLinkType};
+    mFileSize = sizeof(header);
+    mFileStart = 0;
+    return put(&header, sizeof(header));
+}
+
+bool UPFPcapFileWriter::rotate() {
+    // Runs on the ASYNC writer thread too: no ErrorHandler here
+    const String fileName = mFileName + "." + String(mFileIndex + 1);
+    const int fd =
+        ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        // Keep on writing to the current file, and don't try again
+        // until open() is called
+        mRotateError.store(errno, std::memory_order_relaxed);
+        return true;
+    }
+
+    const bool ok = flush();
+    ::close(mFd);
+
+    mFd = fd;
+    ++mFileIndex;
+
+    return putFileHeader() && ok;
+}
+
+void UPFPcapFileWriter::close() {
+    if (mFd >= 0) {
+        flush();
+        ::close(mFd);
+        mFd = -1;
+    }
+
+    free(mBlock);
+    mBlock = nullptr;
+    mBlockSize = 0;
+    mBlockUsed = 0;
+}
+
+bool UPFPcapFileWriter::append(const unsigned char *header,
+                               uint32_t headerLength,
+                               const unsigned char *data, uint32_t length,
+                               uint32_t origLength, uint64_t timestamp) {
+    const uint64_t size =
+        sizeof(UPFPcapRecordHeader) + headerLength + length;
+
+    if (mFd < 0) {
+        return false;
+    }
+
+    bool ok = true;
+
+    // Don't rotate empty files, even if the record alone is too big
+    if (mFileStart != 0 && rotateError() == 0 &&
+        ((mRotateSize && mFileSize + size > mRotateSize) ||
+         (mRotateAge && timestamp - mFileStart >= mRotateAge))) {
+        ok = rotate();
+    }
+
+    if (mFileStart == 0) {
+        mFileStart = timestamp ? timestamp : 1;
+    }
+    mFileSize += size;
+
+    const UPFPcapRecordHeader recordHeader = {
+        static_cast<uint32_t>(timestamp / 1000000000),
+        static_cast<uint32_t>(timestamp % 1000000000 / 1000),
+        headerLength + length, origLength};
+
+    return put(&recordHeader, sizeof(recordHeader)) &&
+           put(header, headerLength) && put(data, length) && ok;
+}
+
+bool UPFPcapFileWriter::flush() {
+    if (mFd < 0) {
+        mBlockUsed = 0;
+        return false;
+    }
+
+    const bool ok = writeOut(mBlock, mBlockUsed);
+    mBlockUsed = 0;
+    return ok;
+}
+
+bool UPFPcapFileWriter::put(const void *data, std::size_t length) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    bool ok = true;
+
+    while (length > 0) {
+        const std::size_t n = std::min(length, mBlockSize - mBlockUsed);
+
+        memcpy(mBlock + mBlockUsed, bytes, n);
+        mBlockUsed += n;
+        bytes += n;
+        length -= n;
+
+        if (mBlockUsed == mBlockSize) {
+            ok = flush() && ok;
+        }
+    }
+
+    return ok;
+}
+
+bool UPFPcapFileWriter::writeOut(const unsigned char *data,
+                                 std::size_t length) {
+    while (length > 0) {
+        const ssize_t n = ::write(mFd, data, length);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            mLastError = errno;
+            return false;
+        }
+
+        data += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+bool UPFPcapAsyncWriter::start(UPFPcapFileWriter *file, std::size_t ringSize,
+                               ErrorHandler *errh) {
+    stop();
+
+    std::size_t size = 4096;
+    while (size < ringSize) {
+        size <<= 1;
+    }
+
+    mRing = static_cast<unsigned char *>(malloc(size));
+    if (!mRing) {
+        errh->error("Can't allocate a %u bytes ring",
+                    static_cast<unsigned>(size));
+        return false;
+    }
+
+    mRingMask = size - 1;
+    mHead = 0;
+    mTail = 0;
+    mStopping = false;
+    mFile = file;
+    mWriteErrors = 0;
+    mLastError = 0;
+
+    try {
+        mThread = std::thread(&UPFPcapAsyncWriter::run, this);
+    } catch (const std::exception &e) {
+        errh->error("Can't start the writer thread: %s", e.what());
+        free(mRing);
+        mRing = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+void UPFPcapAsyncWriter::stop() {
+    if (mThread.joinable()) {
+        mStopping.store(true, std::memory_order_release);
+        mThread.join();
+    }
+
+    free(mRing);
+    mRing = nullptr;
+}
+
+bool UPFPcapAsyncWriter::append(const unsigned char *header,
+                                uint32_t headerLength,
+                                const unsigned char *data, uint32_t length,
+                                uint32_t origLength, uint64_t timestamp,
+                                bool wait) {
+    const std::size_t ringSize = mRingMask + 1;
+    const uint32_t recordLength = headerLength + length;
+    const std::size_t size =
+        (sizeof(RecordHeader) + recordLength + ALIGNMENT - 1) &
+        ~(ALIGNMENT - 1);
+
+    if (size > ringSize / 2) {
+        // Would never fit
+        return false;
+    }
+
+    const uint64_t head = mHead.load(std::memory_order_relaxed);
+    const std::size_t pos = head & mRingMask;
+
+    // Records don't wrap around: if this one doesn't fit before the end
+    // of the ring, the end is skipped.
+    const std::size_t padding = (ringSize - pos < size) ? ringSize - pos : 0;
+
+    while (ringSize - (head - mTail.load(std::memory_order_acquire)) <
+           padding + size) {
+        if (!wait) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+
+    unsigned char *slot = mRing + pos;
+
+    if (padding) {
+        reinterpret_cast<RecordHeader *>(slot)->length = PADDING;
+        slot = mRing;
+    }
+
+    RecordHeader *recordHeader = reinterpret_cast<RecordHeader *>(slot);
+    recordHeader->length = recordLength;
+    recordHeader->origLength = origLength;
+    recordHeader->timestamp = timestamp;
+    if (headerLength > 0) {
+        memcpy(slot + sizeof(RecordHeader), header, headerLength);
+    }
+    memcpy(slot + sizeof(RecordHeader) + headerLength, data, length);
+
+    mHead.store(head + padding + size, std::memory_order_release);
+    return true;
+}
+
+void UPFPcapAsyncWriter::run() {
+    const std::size_t ringSize = mRingMask + 1;
+    uint64_t tail = mTail.load(std::memory_order_relaxed);
+    auto lastFlush = std::chrono::steady_clock::now();
+
+    for (;;) {
+        // Check before looking at the ring, so nothing appended before
+        // stop() is missed
+        const bool stopping = mStopping.load(std::memory_order_acquire);
+        const uint64_t head = mHead.load(std::memory_order_acquire);
+
+        if (tail == head) {
+            if (stopping) {
+                break;
+            }
+
+            // Idle: once in a while, make what we have visible in the
+            // file, then poll
+            const auto now = std::chrono::steady_clock::now();
+            if (now - lastFlush >= std::chrono::seconds(1)) {
+                if (mFile->isOpen() && !mFile->flush()) {
+                    writeFailed();
+                }
+                lastFlush = now;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        while (tail != head) {
+            const std::size_t pos = tail & mRingMask;
+            const RecordHeader *recordHeader =
+                reinterpret_cast<const RecordHeader *>(mRing + pos);
+
+            if (recordHeader->length == PADDING) {
+                tail += ringSize - pos;
+                continue;
+            }
+
+            if (!mFile->append(nullptr, 0,
+                               mRing + pos + sizeof(RecordHeader),
+                               recordHeader->length,
+                               recordHeader->origLength,
+                               recordHeader->timestamp)) {
+                writeFailed();
+            }
+
+            tail += (sizeof(RecordHeader) + recordHeader->length +
+                     ALIGNMENT - 1) &
+                    ~(ALIGNMENT - 1);
+        }
+
+        mTail.store(tail, std::memory_order_release);
+    }
+
+    if (mFile->isOpen() && !mFile->flush()) {
+        writeFailed();
+    }
+}
+
+void UPFPcapAsyncWriter::writeFailed() {
+    mLastError.store(mFile->lastError(), std::memory_order_relaxed);
+    mWriteErrors.fetch_add(1, std::memory_order_relaxed);
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(userlevel)
+ELEMENT_PROVIDES(UPFPcapFileWriter)
+// clang-format on
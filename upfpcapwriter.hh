@@ -0,0 +1,210 @@
+#ifndef CLICK_UPFPCAPWRITER_HH
+#define CLICK_UPFPCAPWRITER_HH
+
+// clang-format off
+#include <click/error.hh>
+#include <click/string.hh>
+CLICK_DECLS
+// clang-format on
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+/*
+ * Block-buffered .pcap file writer: records are gathered in an aligned
+ * buffer, written out to the file only when a whole block is full (or
+ * on flush()), so the file gets few large writes.
+ *
+ * Optionally, the capture is rotated: when the current file would grow
+ * beyond a given size, or when a record comes after a given time since
+ * the first record of the current file, the next file is started. Files
+ * are named after the first one, with a sequence number appended
+ * (FILE, FILE.1, FILE.2, ...).
+ */
+class UPFPcapFileWriter {
+  public:
+    UPFPcapFileWriter() {}
+    ~UPFPcapFileWriter() { close(); }
+
+    UPFPcapFileWriter(const UPFPcapFileWriter &) = delete;
+    UPFPcapFileWriter &operator=(const UPFPcapFileWriter &) = delete;
+
+    /// @brief Create 'fileName' and write the .pcap file header
+    ///        ('linkType' records, at most 'snapLen' bytes each),
+    ///        buffering 'blockSize' bytes at a time
+    ///
+    /// @return false (reporting to 'errh') on failure
+    bool open(const String &fileName, uint32_t linkType, uint32_t snapLen,
+              std::size_t blockSize, ErrorHandler *errh);
+
+    /// @brief Flush and close the file
+    void close();
+
+    /// @brief Start a new file before one gets bigger than 'maxSize'
+    ///        bytes, or when a record comes 'maxAge' ns or more after
+    ///        the first one of the file (0: no limit)
+    void setRotation(uint64_t maxSize, uint64_t maxAge) {
+        mRotateSize = maxSize;
+        mRotateAge = maxAge;
+    }
+
+    /// @brief Add a record made of 'headerLength' bytes of 'header'
+    ///        followed by 'length' bytes of 'data' ('origLength' bytes
+    ///        long before truncation), captured at 'timestamp' (ns)
+    ///
+    /// @return false if a write failed
+    bool append(const unsigned char *header, uint32_t headerLength,
+                const unsigned char *data, uint32_t length,
+                uint32_t origLength, uint64_t timestamp);
+
+    /// @brief Write out the buffered records
+    ///
+    /// @return false if a write failed
+    bool flush();
+
+    /// @brief True if the file is open
+    bool isOpen() const { return mFd >= 0; }
+
+    /// @brief errno of the last failed write (0 if none)
+    int lastError() const { return mLastError; }
+
+    /// @brief errno of the failed creation of the next file (0 if
+    ///        none). Once set, the capture goes on in the current file
+    ///        and is not rotated any more, until the next open().
+    ///        May be read from any thread.
+    int rotateError() const {
+        return mRotateError.load(std::memory_order_relaxed);
+    }
+
+  private:
+    int mFd = -1;
+    String mFileName;
+    uint32_t mLinkType = 0;
+    uint32_t mSnapLen = 0;
+
+    /// @brief Rotation limits (see setRotation())
+    uint64_t mRotateSize = 0;
+    uint64_t mRotateAge = 0;
+
+    /// @brief Size of the current file, and time of its first record
+    uint64_t mFileSize = 0;
+    uint64_t mFileStart = 0;
+
+    /// @brief Sequence number of the current file
+    unsigned mFileIndex = 0;
+
+    unsigned char *mBlock = nullptr;
+    std::size_t mBlockSize = 0;
+    std::size_t mBlockUsed = 0;
+    int mLastError = 0;
+    std::atomic<int> mRotateError = {0};
+
+    /// @brief Append 'length' bytes to the block, writing it out each
+    ///        time it is full
+    bool put(const void *data, std::size_t length);
+
+    bool writeOut(const unsigned char *data, std::size_t length);
+
+    /// @brief Create 'fileName' and write the file header
+    bool openFile(const String &fileName, ErrorHandler *errh);
+
+    /// @brief Write the file header to a new file
+    bool putFileHeader();
+
+    /// @brief Close the current file and start the next one (unless
+    ///        it can't be created, see rotateError())
+    ///
+    /// @return false if a write failed
+    bool rotate();
+};
+
+/*
+ * Hands records over to a dedicated thread, which writes them into a
+ * UPFPcapFileWriter, so the caller never waits for the filesystem.
+ *
+ * Records are copied into a lock-free single-producer/single-consumer
+ * ring of bytes: append() must not be called by several threads at
+ * once. When the ring is full, append() either fails (and the record
+ * is dropped) or waits for room.
+ */
+class UPFPcapAsyncWriter {
+  public:
+    UPFPcapAsyncWriter() {}
+    ~UPFPcapAsyncWriter() { stop(); }
+
+    UPFPcapAsyncWriter(const UPFPcapAsyncWriter &) = delete;
+    UPFPcapAsyncWriter &operator=(const UPFPcapAsyncWriter &) = delete;
+
+    /// @brief Start the writer thread, feeding 'file' through a ring
+    ///        of (at least) 'ringSize' bytes
+    ///
+    /// @return false (reporting to 'errh') on failure
+    bool start(UPFPcapFileWriter *file, std::size_t ringSize,
+               ErrorHandler *errh);
+
+    /// @brief Write the records still in the ring, then stop the
+    ///        writer thread
+    void stop();
+
+    /// @brief Queue a record (see UPFPcapFileWriter::append()). If the
+    ///        ring is full, wait for room if 'wait', otherwise fail.
+    ///
+    /// @return false if the record was dropped
+    bool append(const unsigned char *header, uint32_t headerLength,
+                const unsigned char *data, uint32_t length,
+                uint32_t origLength, uint64_t timestamp, bool wait);
+
+    /// @brief Number of records (or flushes) the writer thread failed
+    ///        to write out
+    uint64_t writeErrors() const {
+        return mWriteErrors.load(std::memory_order_relaxed);
+    }
+
+    /// @brief errno of the last failed write (0 if none)
+    int lastError() const {
+        return mLastError.load(std::memory_order_relaxed);
+    }
+
+  private:
+    /// @brief Header of a record in the ring
+    struct RecordHeader {
+        /// @brief Bytes of the record that follow, or PADDING for the
+        ///        unused end of the ring
+        uint32_t length;
+        uint32_t origLength;
+        uint64_t timestamp;
+    };
+
+    static const uint32_t PADDING = 0xffffffff;
+
+    /// @brief Records (and their headers) are aligned to this
+    static const std::size_t ALIGNMENT = sizeof(RecordHeader);
+
+    unsigned char *mRing = nullptr;
+    std::size_t mRingMask = 0;
+
+    /// @brief Bytes ever produced/consumed (their difference is the
+    ///        amount of data in the ring)
+    alignas(64) std::atomic<uint64_t> mHead = {0};
+    alignas(64) std::atomic<uint64_t> mTail = {0};
+
+    alignas(64) std::atomic<bool> mStopping = {false};
+    UPFPcapFileWriter *mFile = nullptr;
+    std::thread mThread;
+
+    /// @brief Write failures of the writer thread (see writeErrors())
+    std::atomic<uint64_t> mWriteErrors = {0};
+    std::atomic<int> mLastError = {0};
+
+    void run();
+
+    /// @brief Account for a failed write of mFile
+    void writeFailed();
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,137 @@
+/*
+ * upfprofile.{cc,hh} -- per-stage profiling with hardware counters
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfprofile.hh"
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+const char *unparseUPFProfileStage(int stage) {
+    static const char *const names[UPF_NUM_STAGES] = {
+        "buffer_view", "dispatch",  "inner_decode", "classify",
+        "rule_match",  "ue_lookup", "make_packet",  "encap_sink"};
+
+    return (stage >= 0 && stage < UPF_NUM_STAGES) ? names[stage] : "unknown";
+}
+
+bool UPFPerfCounters::open() {
+    static const uint64_t configs[NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES};
+
+    close();
+
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // This thread, on any CPU
+        mFds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (mFds[i] < 0) {
+            close();
+            return false;
+        }
+
+        // Map the counter page, to read the counter with rdpmc
+        void *page = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ,
+                          MAP_SHARED, mFds[i], 0);
+        mPages[i] = (page == MAP_FAILED)
+                        ? nullptr
+                        : static_cast<perf_event_mmap_page *>(page);
+    }
+
+    mOpen = true;
+    return true;
+}
+
+void UPFPerfCounters::close() {
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+        if (mPages[i]) {
+            munmap(mPages[i], sysconf(_SC_PAGESIZE));
+            mPages[i] = nullptr;
+        }
+        if (mFds[i] >= 0) {
+            ::close(mFds[i]);
+            mFds[i] = -1;
+        }
+    }
+
+    mOpen = false;
+}
+
+void UPFPerfCounters::read(uint64_t values[NUM_COUNTERS]) const {
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+        values[i] = mOpen ? readCounter(i) : 0;
+    }
+}
+
+uint64_t UPFPerfCounters::readCounter(int counter) const {
+#if defined(__x86_64__) || defined(__i386__)
+    const volatile perf_event_mmap_page *page = mPages[counter];
+
+    if (page) {
+        // See the description of perf_event_mmap_page in
+        // <linux/perf_event.h>
+        uint32_t seq;
+        uint64_t value;
+        bool usable;
+
+        do {
+            seq = page->lock;
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+            const uint32_t index = page->index;
+            usable = page->cap_user_rdpmc && index != 0;
+            value = page->offset;
+
+            if (usable) {
+                const unsigned shift = 64 - page->pmc_width;
+                int64_t count = __builtin_ia32_rdpmc(index - 1);
+
+                // Sign-extend the pmc_width bits of the counter
+                count = static_cast<int64_t>(static_cast<uint64_t>(count)
+                                             << shift) >>
+                        shift;
+                value += count;
+            }
+
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        } while (page->lock != seq);
+
+        if (usable) {
+            return value;
+        }
+    }
+#endif
+
+    uint64_t value = 0;
+    if (::read(mFds[counter], &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(userlevel)
+ELEMENT_PROVIDES(UPFProfile)
+// clang-format on
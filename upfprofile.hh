@@ -0,0 +1,192 @@
+#ifndef CLICK_UPFPROFILE_HH
+#define CLICK_UPFPROFILE_HH
+
+// clang-format off
+#include <click/glue.hh>
+CLICK_DECLS
+// clang-format on
+
+#include <cstddef>
+#include <cstdint>
+
+struct perf_event_mmap_page;
+
+/*
+ * Per-stage profiling of the UPFRouter data path.
+ *
+ * UPFPerfCounters reads hardware counters (CPU cycles, instructions,
+ * cache misses) of the calling thread through perf_event_open(2). When
+ * the kernel allows it, counters are read from user space with rdpmc,
+ * which costs a few tens of cycles; otherwise with read(2).
+ *
+ * UPFProfiler accumulates, for each stage of the data path, how many
+ * times it ran along with the TSC cycles and counter deltas spent in
+ * it. Stages may nest (e.g. 'dispatch' includes everything that
+ * happens in the UPFlib router), so their costs are inclusive.
+ *
+ * UPFRouter is instrumented only when the package is configured with
+ * `--enable-profile` (which defines UPF_PROFILE): the UPF_PROFILE_*()
+ * macros expand to nothing otherwise.
+ */
+
+/// @brief Stages of the data path
+enum UPFProfileStage {
+    /// @brief Building a BufferView out of a Click Packet
+    UPF_STAGE_BUFFER_VIEW,
+    /// @brief Router::consumeIPv4Packet() (decoding and dispatching)
+    UPF_STAGE_DISPATCH,
+    /// @brief IPv4Decoder on the encapsulated header
+    UPF_STAGE_INNER_DECODE,
+    /// @brief Matching against the compiled MatchMap
+    UPF_STAGE_CLASSIFY,
+    /// @brief RuleMatcher::match()
+    UPF_STAGE_RULE_MATCH,
+    /// @brief Looking up the UE
+    UPF_STAGE_UE_LOOKUP,
+    /// @brief Copying a BufferView into a new Click Packet
+    UPF_STAGE_MAKE_PACKET,
+    /// @brief GTPv1UEncapSink::consumeIPv4Packet()
+    UPF_STAGE_ENCAP_SINK,
+    UPF_NUM_STAGES
+};
+
+/// @brief Return the name of a stage (as in the 'profile' handler)
+const char *unparseUPFProfileStage(int stage);
+
+class UPFPerfCounters {
+  public:
+    enum Counter { CYCLES, INSTRUCTIONS, CACHE_MISSES, NUM_COUNTERS };
+
+    UPFPerfCounters() {}
+    ~UPFPerfCounters() { close(); }
+
+    UPFPerfCounters(const UPFPerfCounters &) = delete;
+    UPFPerfCounters &operator=(const UPFPerfCounters &) = delete;
+
+    /// @brief Start counting for the calling thread
+    ///
+    /// @return false if no counter is available (e.g. not allowed by
+    ///         perf_event_paranoid); the counters then read as 0
+    bool open();
+
+    void close();
+
+    bool isOpen() const { return mOpen; }
+
+    /// @brief Read the current value of all counters
+    void read(uint64_t values[NUM_COUNTERS]) const;
+
+  private:
+    bool mOpen = false;
+    int mFds[NUM_COUNTERS] = {-1, -1, -1};
+
+    /// @brief Mapped pages of the counters (for rdpmc), or null
+    perf_event_mmap_page *mPages[NUM_COUNTERS] = {};
+
+    uint64_t readCounter(int counter) const;
+};
+
+/// @brief What was spent in a stage
+struct UPFProfileCounters {
+    uint64_t calls;
+    uint64_t tscCycles;
+    uint64_t values[UPFPerfCounters::NUM_COUNTERS];
+};
+
+class UPFProfiler {
+  public:
+    /// @brief Counter values at the start of a stage
+    struct Sample {
+        click_cycles_t tscCycles;
+        uint64_t values[UPFPerfCounters::NUM_COUNTERS];
+    };
+
+    /// @brief Take the sample starting a stage (opening the counters
+    ///        on first use, so they belong to the calling thread)
+    void start(Sample &sample) {
+        if (unlikely(!mOpenTried)) {
+            mOpenTried = true;
+            mPerf.open();
+        }
+        mPerf.read(sample.values);
+        sample.tscCycles = click_get_cycles();
+    }
+
+    /// @brief Charge what was spent since 'sample' to 'stage', as
+    ///        'calls' runs of it
+    void stop(int stage, const Sample &sample, uint64_t calls = 1) {
+        const click_cycles_t tscCycles = click_get_cycles();
+        uint64_t values[UPFPerfCounters::NUM_COUNTERS];
+        mPerf.read(values);
+
+        UPFProfileCounters &counters = mStages[stage];
+        counters.calls += calls;
+        counters.tscCycles += tscCycles - sample.tscCycles;
+        for (int i = 0; i < UPFPerfCounters::NUM_COUNTERS; ++i) {
+            counters.values[i] += values[i] - sample.values[i];
+        }
+    }
+
+    const UPFProfileCounters &stage(int stage) const {
+        return mStages[stage];
+    }
+
+    /// @brief True if hardware counters are being read
+    bool hasPerfCounters() const { return mPerf.isOpen(); }
+
+  private:
+    UPFPerfCounters mPerf;
+    bool mOpenTried = false;
+    UPFProfileCounters mStages[UPF_NUM_STAGES] = {};
+};
+
+/// @brief Charge the lifetime of the object to a stage
+class UPFProfileScope {
+  public:
+    UPFProfileScope(UPFProfiler &profiler, int stage)
+        : mProfiler(profiler), mStage(stage) {
+        mProfiler.start(mSample);
+    }
+
+    ~UPFProfileScope() { mProfiler.stop(mStage, mSample); }
+
+  private:
+    UPFProfiler &mProfiler;
+    int mStage;
+    UPFProfiler::Sample mSample;
+};
+
+#ifdef UPF_PROFILE
+#define UPF_PROFILE_CONCAT_(a, b) a##b
+#define UPF_PROFILE_CONCAT(a, b) UPF_PROFILE_CONCAT_(a, b)
+
+/// @brief Charge the rest of the enclosing block to 'stage' of
+///        'profiler'
+#define UPF_PROFILE_SCOPE(profiler, stage)                                     \
+    UPFProfileScope UPF_PROFILE_CONCAT(upfProfileScope, __LINE__)(profiler,    \
+                                                                  stage)
+
+/// @brief Start charging to a stage: declares the sample 'sample'
+#define UPF_PROFILE_START(profiler, sample)                                    \
+    UPFProfiler::Sample sample;                                                \
+    (profiler).start(sample)
+
+/// @brief Charge to 'stage' what was spent since UPF_PROFILE_START()
+#define UPF_PROFILE_STOP(profiler, stage, sample)                              \
+    (profiler).stop(stage, sample)
+#else
+#define UPF_PROFILE_SCOPE(profiler, stage)                                     \
+    do {                                                                       \
+    } while (0)
+#define UPF_PROFILE_START(profiler, sample)                                    \
+    do {                                                                       \
+    } while (0)
+#define UPF_PROFILE_STOP(profiler, stage, sample)                              \
+    do {                                                                       \
+    } while (0)
+#endif
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -27,6 +27,10 @@
 #include <click/router.hh>
 #include <click/etheraddress.hh>
 #include <click/ipaddress.hh>
+#include <click/straccum.hh>
+#include <click/userutils.hh>
+#include <clicknet/ip.h>
+#include <clicknet/udp.h>
 
 // clang-format off
 CLICK_DECLS
@@ -37,6 +41,11 @@ CLICK_DECLS
 #include <upfs1aplib/s1aplib.hh>
 #include <upfdumperlib/dumper.hh>
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <sstream>
 
 //////////////////////////////////////////////////////////////////////
@@ -55,9 +64,9 @@ CLICK_DECLS
 //
 // * the BufferView shares ownership of the underlying PacketBuffer
 //   with others, therefore it can't give up ownership also for them.
-static WritablePacket *
-makeWritablePacket(const NetworkLib::BufferView &bufferView,
-                   std::size_t headroom = 0) {
+WritablePacket *
+UPFRouter::makeWritablePacket(const NetworkLib::BufferView &bufferView,
+                              std::size_t headroom) {
 
     WritablePacket *p =
         Packet::make(headroom, (const unsigned char *)0, bufferView.size(),
@@ -75,6 +84,181 @@ makeWritablePacket(const NetworkLib::BufferView &bufferView,
     return p;
 }
 
+/// @brief Size of the mandatory part of a GTPv1-U header
+static const std::size_t GTPV1U_MANDATORY_HEADER_LEN = 8;
+
+/// @brief UDP port of GTPv1-U
+static const uint16_t GTPV1U_UDP_PORT = 2152;
+
+/// @brief Size of the outer headers added by GTPv1-U encapsulation
+static const std::size_t GTPV1U_ENCAP_LEN =
+    sizeof(click_ip) + sizeof(click_udp) + GTPV1U_MANDATORY_HEADER_LEN;
+
+// Find the offset of the IPv4 datagram encapsulated in the GTPv1-U
+// traffic carried by a Click Packet ('innerLength' bytes long, as
+// found by the GTPv1-U decoder).
+//
+// The inner datagram sits contiguously inside the packet, at the end
+// of the GTPv1-U message (i.e. after any optional field and extension
+// header), so there's no need to parse GTPv1-U extension headers.
+//
+// Return -1 if the packet layout doesn't look like what we expect.
+static int innerIPv4Offset(const Packet *p, std::size_t innerLength) {
+    const std::size_t length = p->length();
+
+    if (length < sizeof(click_ip)) {
+        return -1;
+    }
+
+    const click_ip *outerIp = reinterpret_cast<const click_ip *>(p->data());
+    const std::size_t gtpOffset = (outerIp->ip_hl << 2) + sizeof(click_udp);
+
+    if (gtpOffset + GTPV1U_MANDATORY_HEADER_LEN > length) {
+        return -1;
+    }
+
+    // GTPv1-U length field (octets 3-4): size of the message after the
+    // mandatory header.
+    const unsigned char *gtp = p->data() + gtpOffset;
+    const std::size_t gtpEnd =
+        gtpOffset + GTPV1U_MANDATORY_HEADER_LEN + ((gtp[2] << 8) | gtp[3]);
+
+    if (gtpEnd > length || innerLength < sizeof(click_ip) ||
+        innerLength > gtpEnd - gtpOffset - GTPV1U_MANDATORY_HEADER_LEN) {
+        return -1;
+    }
+
+    return gtpEnd - innerLength;
+}
+
+// Get the TEID (in network byte order) of the GTPv1-U traffic carried
+// by a Click Packet (whose layout was already checked by
+// innerIPv4Offset()).
+static inline uint32_t rawGTPv1UTEID(const Packet *p) {
+    const click_ip *outerIp = reinterpret_cast<const click_ip *>(p->data());
+    uint32_t teid;
+
+    memcpy(&teid, p->data() + (outerIp->ip_hl << 2) + sizeof(click_udp) + 4,
+           sizeof(teid));
+    return teid;
+}
+
+// True if a Click Packet carries SCTP (so possibly S1AP) traffic
+static inline bool isSCTPPacket(const Packet *p) {
+    const click_ip *ip = reinterpret_cast<const click_ip *>(p->data());
+
+    return (p->length() >= sizeof(click_ip) && ip->ip_p == IP_PROTO_SCTP);
+}
+
+/// @brief Key of a GTPv1-U tunnel endpoint in the TEID indexes
+///        (address and TEID in network byte order). TEIDs are
+///        allocated by the receiving node, so the TEID alone is not
+///        enough.
+static inline uint64_t makeTEIDKey(uint32_t address, uint32_t teid) {
+    return (static_cast<uint64_t>(address) << 32) | teid;
+}
+
+// Strip in place the outer IPv4/UDP/GTPv1-U headers of a Click Packet
+// carrying GTPv1-U traffic, leaving only the encapsulated IPv4
+// datagram ('innerLength' bytes long).
+//
+// No data is copied and nothing is allocated: we just move the packet
+// boundaries around the inner datagram with Packet::pull() and
+// Packet::take().
+//
+// Return false (leaving the packet untouched) if the packet layout
+// doesn't look like what we expect.
+static bool decapsulateInPlace(Packet *p, std::size_t innerLength) {
+    const int offset = innerIPv4Offset(p, innerLength);
+
+    if (offset < 0) {
+        return false;
+    }
+
+    p->pull(offset);
+    p->take(p->length() - innerLength);
+
+    // Add IPv4 annotations
+    const click_ip *ip = reinterpret_cast<const click_ip *>(p->data());
+    p->set_ip_header(ip, ip->ip_hl << 2);
+
+    return true;
+}
+
+// Encapsulate in place a Click Packet carrying an IPv4 datagram into
+// GTPv1-U, by pushing the outer IPv4/UDP/GTPv1-U headers into the
+// packet headroom.
+//
+// Addresses and TEID are in network byte order. Packet::push()
+// reallocates the packet only if its headroom is too short (or if
+// the packet is shared), so normally nothing is copied.
+//
+// Return nullptr (and the packet is gone) on allocation failure.
+static WritablePacket *encapsulateInPlace(Packet *p, uint32_t srcAddress,
+                                          uint32_t dstAddress, uint32_t teid,
+                                          uint16_t identification,
+                                          bool doUDPChecksum) {
+    const uint32_t innerLength = p->length();
+    const uint8_t innerTos =
+        reinterpret_cast<const click_ip *>(p->data())->ip_tos;
+
+    WritablePacket *q = p->push(GTPV1U_ENCAP_LEN);
+
+    if (!q) {
+        return nullptr;
+    }
+
+    click_ip *ip = reinterpret_cast<click_ip *>(q->data());
+    click_udp *udp = reinterpret_cast<click_udp *>(ip + 1);
+    unsigned char *gtp = reinterpret_cast<unsigned char *>(udp + 1);
+
+    // GTPv1-U header: version 1, PT 1, no optional fields, G-PDU
+    gtp[0] = 0x30;
+    gtp[1] = 0xff;
+    gtp[2] = innerLength >> 8;
+    gtp[3] = innerLength & 0xff;
+    memcpy(gtp + 4, &teid, sizeof(teid));
+
+    // UDP header
+    const uint32_t udpLength =
+        sizeof(click_udp) + GTPV1U_MANDATORY_HEADER_LEN + innerLength;
+    udp->uh_sport = htons(GTPV1U_UDP_PORT);
+    udp->uh_dport = htons(GTPV1U_UDP_PORT);
+    udp->uh_ulen = htons(udpLength);
+    udp->uh_sum = 0;
+
+    // IPv4 header
+    ip->ip_v = 4;
+    ip->ip_hl = sizeof(click_ip) >> 2;
+    ip->ip_tos = innerTos;
+    ip->ip_len = htons(sizeof(click_ip) + udpLength);
+    ip->ip_id = htons(identification);
+    ip->ip_off = 0;
+    ip->ip_ttl = 64;
+    ip->ip_p = IP_PROTO_UDP;
+    ip->ip_sum = 0;
+    ip->ip_src.s_addr = srcAddress;
+    ip->ip_dst.s_addr = dstAddress;
+    ip->ip_sum = click_in_cksum(reinterpret_cast<unsigned char *>(ip),
+                                sizeof(click_ip));
+
+    if (doUDPChecksum) {
+        unsigned csum =
+            click_in_cksum(reinterpret_cast<unsigned char *>(udp), udpLength);
+        udp->uh_sum = click_in_cksum_pseudohdr(csum, ip, udpLength);
+
+        // A zero UDP checksum means "no checksum"
+        if (udp->uh_sum == 0) {
+            udp->uh_sum = 0xffff;
+        }
+    }
+
+    // Add IPv4 annotations
+    q->set_ip_header(ip, sizeof(click_ip));
+
+    return q;
+}
+
 // Hack to use click_chatter() as an std::ostream.
 // You can then use
 //
@@ -101,13 +285,33 @@ toMACAddress(const EtherAddress &clickEtherAddress) {
     const unsigned char *d = clickEtherAddress.data();
     return NetworkLib::MACAddress(d[0], d[1], d[2], d[3], d[4], d[5]);
 }
+#endif
 
 /// @brief Convert a Click's IPAddress to a NetworkLib::IPv4Address
 static NetworkLib::IPv4Address toIPv4Address(const IPAddress &clickIPAddress) {
     return NetworkLib::IPv4Address(
         NetworkLib::swapByteOrder(clickIPAddress.addr()));
 }
-#endif
+
+/// @brief Convert a NetworkLib::IPv4Address to a Click's IPAddress.
+///
+/// Note: this goes through the textual representation, so it must be
+///       used only when the UEMap changes, never per-packet.
+static IPAddress toClickIPAddress(const NetworkLib::IPv4Address &address) {
+    std::ostringstream s;
+    s << address;
+    return IPAddress(String(s.str().c_str()));
+}
+
+/// @brief Convert a NetworkLib::GTP_TEID to a TEID in network byte order.
+///
+/// Note: this goes through the textual representation, so it must be
+///       used only when the UEMap changes, never per-packet.
+static uint32_t toRawTEID(const NetworkLib::GTP_TEID &teid) {
+    std::ostringstream s;
+    s << NetworkLib::asHex32(teid);
+    return htonl(strtoul(s.str().c_str(), nullptr, 16));
+}
 
 /// @brief Get the Click input port number of the packet from the Context
 ///        (it's defined as a separate function just for clarity).
@@ -146,6 +350,7 @@ static const char *upf_skip_commavec_item(const char *s, const char *end) {
             // A comma or a newline ends the item
         case ',':
         case '\n':
+        case '\r':
             return s;
 
         default:
@@ -182,10 +387,11 @@ const char *upf_skip_comment(const char *s, const char *end) {
 
 /// @brief Similar to Click's configuration parsing function
 ///        `cp_skip_comment_space()`, but it searches for the first
-///        non-comma character.
+///        character that is neither a comma, an end-of-line nor a
+///        space.
 const char *upf_cp_skip_comment_comma(const char *begin, const char *end) {
     for (; begin < end; begin++) {
-        if (*begin == ',')
+        if (*begin == ',' || isspace((unsigned char)*begin))
             /* nada */;
         else if (*begin == '/' && begin + 1 < end &&
                  (begin[1] == '/' || begin[1] == '*'))
@@ -202,7 +408,7 @@ const char *upf_cp_skip_comment_comma(const char *begin, const char *end) {
 String upf_cp_shift_commavec(String &str) {
     const char *item = upf_cp_skip_comment_comma(str.begin(), str.end());
     const char *item_end = upf_skip_commavec_item(item, str.end());
-    String answer = str.substring(item, item_end);
+    String answer = str.substring(item, item_end).trim_space();
     item_end = upf_cp_skip_comment_comma(item_end, str.end());
     str = str.substring(item_end, str.end());
     return answer;
@@ -214,18 +420,137 @@ int UPFRouter::configure(Vector<String> &conf, ErrorHandler *errh) {
 
     bool doEnableUDPChecksum = true;
     bool doEnableUnknownTrafficDump = true;
+    bool doZeroCopyDecap = true;
+    bool doInPlaceEncap = true;
+    uint32_t ueMapCapacity = 65536;
+    bool doUseHugePages = false;
+    unsigned threads = 1;
+    bool doLatencyStats = false;
+    String ueMapFile;
+    uint32_t ueMapIdleTimeout = 0;
     String matchmap;
+    String logLevel;
+    String bypass;
+    bool doAsyncS1AP = false;
+    bool doS1APFilter = false;
 
     if (Args(conf, this, errh)
             .read("enableudpchecksum", BoolArg(), doEnableUDPChecksum)
             .read("enableunknowntrafficdump", BoolArg(),
                   doEnableUnknownTrafficDump)
             .read("matchmap", StringArg(), matchmap)
+            .read("zerocopydecap", BoolArg(), doZeroCopyDecap)
+            .read("inplaceencap", BoolArg(), doInPlaceEncap)
+            .read("uemapcapacity", IntArg(), ueMapCapacity)
+            .read("uemaphugepages", BoolArg(), doUseHugePages)
+            .read("uemapfile", FilenameArg(), ueMapFile)
+            .read("uemapidletimeout", SecondsArg(), ueMapIdleTimeout)
+            .read("loglevel", WordArg(), logLevel)
+            .read("threads", IntArg(), threads)
+            .read("latencystats", BoolArg(), doLatencyStats)
+            .read("bypass", StringArg(), bypass)
+            .read("s1apthread", BoolArg(), doAsyncS1AP)
+            .read("s1apfilter", BoolArg(), doS1APFilter)
             .complete() < 0) {
         errh->error("Error while parsing arguments!");
         return -1;
     }
 
+    if (threads == 0) {
+        errh->error("threads must be at least 1");
+        return -1;
+    }
+
+    // Just a switch: every Click thread gets a state anyway (see below)
+    mThreadSafe = (threads > 1);
+
+    if (!mThreadSafe && master()->nthreads() > 1) {
+        // One state shared by all threads: they must not push at once.
+        errh->warning("%d Click threads but threads 1: all ports must be "
+                      "driven by the same thread",
+                      master()->nthreads());
+    }
+
+    if (mThreadSafe && !doInPlaceEncap) {
+        // Per-thread encapsulation sinks don't see the UEMap.
+        errh->error("inplaceencap must be true when threads > 1");
+        return -1;
+    }
+
+#if !HAVE_MULTITHREAD
+    if (doAsyncS1AP) {
+        // The S1AP thread reschedules mUEMapUpdateTask, which only
+        // multithreaded builds allow from another thread.
+        errh->error("s1apthread requires Click built with "
+                    "--enable-multithread");
+        return -1;
+    }
+#endif
+
+    if (doAsyncS1AP && !doInPlaceEncap) {
+        // Neither do those of the data path, when S1AP is decoded
+        // elsewhere.
+        errh->error("inplaceencap must be true when s1apthread is true");
+        return -1;
+    }
+
+    mDoAsyncS1AP = doAsyncS1AP;
+
+    // One state per Click thread that may push packets (indexed by
+    // click_current_cpu_id(), so there must be one for each of them).
+    // In thread-safe mode (or when S1AP is decoded by the S1AP thread),
+    // every thread gets a router of its own for user traffic.
+    const unsigned nstates =
+        mThreadSafe ? std::max<unsigned>(threads, master()->nthreads()) : 1;
+
+    mThreadStates.clear();
+    mMatchMapEpochs.setReaders(nstates);
+    for (unsigned i = 0; i < nstates; ++i) {
+        mThreadStates.emplace_back(new ThreadState(
+            (mThreadSafe || mDoAsyncS1AP) ? nullptr : &mRouter));
+
+        if (mDoAsyncS1AP &&
+            !mThreadStates.back()->s1apQueue.reserve(S1AP_QUEUE_SIZE)) {
+            errh->error("Can't allocate the S1AP queues");
+            return -1;
+        }
+
+        // Spread IPv4 Identifications among threads
+        mThreadStates.back()->ipv4Identification = i * (0x10000 / nstates);
+    }
+
+    if (mDoAsyncS1AP && !mUEMapUpdates.reserve(UEMAP_UPDATE_QUEUE_SIZE)) {
+        errh->error("Can't allocate the UEMap update queue");
+        return -1;
+    }
+    mPendingUEMapUpdates.reserve(UEMAP_UPDATE_BUDGET);
+
+    // Allocate the UEMap up front, so it doesn't grow on the data path
+    if (!mUETunnels.reserve(ueMapCapacity, doUseHugePages) ||
+        !mEPCTEIDs.reserve(ueMapCapacity, doUseHugePages) ||
+        !mENBTEIDs.reserve(ueMapCapacity, doUseHugePages)) {
+        errh->error("Can't allocate a UEMap of %u entries", ueMapCapacity);
+        return -1;
+    }
+
+    // Readers don't lock the UEMap copy: keep it from moving under them.
+    mUETunnels.setFixedCapacity(mThreadSafe);
+    mEPCTEIDs.setFixedCapacity(mThreadSafe);
+    mENBTEIDs.setFixedCapacity(mThreadSafe);
+
+    if (doUseHugePages && !mUETunnels.usesHugePages()) {
+        errh->warning("No hugepages available for the UEMap, using normal "
+                      "pages");
+    }
+
+    if (!logLevel.empty()) {
+        int rc = wh_logLevel(logLevel, nullptr, errh);
+
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
     if (!matchmap.empty()) {
         int rc = wh_MatchMap_append(matchmap, nullptr, errh);
 
@@ -234,100 +559,235 @@ int UPFRouter::configure(Vector<String> &conf, ErrorHandler *errh) {
         }
     }
 
-    mGTPEncapSink.enableUDPChecksum(doEnableUDPChecksum);
+    Vector<String> bypassEntries;
+    cp_spacevec(bypass, bypassEntries);
+
+    mBypass.clear();
+    for (const String &entry : bypassEntries) {
+        if (!mBypass.addEntry(entry)) {
+            errh->error("Invalid bypass entry '%s'", entry.c_str());
+            return -1;
+        }
+    }
+    mBypass.compile();
+    mDoBypass = !mBypass.empty();
+
+    for (auto &ts : mThreadStates) {
+        ts->encapSink.enableUDPChecksum(doEnableUDPChecksum);
+    }
+    mDoEnableUDPChecksum = doEnableUDPChecksum;
     mDoEnableUnknownTrafficDump = doEnableUnknownTrafficDump;
+    mDoZeroCopyDecap = doZeroCopyDecap;
+    mDoInPlaceEncap = doInPlaceEncap;
+    mDoLatencyStats = doLatencyStats;
+    mDoS1APFilter = doS1APFilter;
+    mUEMapFile = ueMapFile;
+    mUEMapIdleTimeout = ueMapIdleTimeout;
     return 0;
 }
 
-int UPFRouter::initialize(ErrorHandler *) {
+int UPFRouter::initialize(ErrorHandler *errh) {
+    // Publish the MatchMap given in the configuration, and get ready
+    // to publish it again when it changes.
+    {
+        std::lock_guard<std::mutex> lock(mMatchMapMutex);
+
+        if (!mNextMatchMap) {
+            publishMatchMap();
+        }
+        installMatchMapSnapshot(mNextMatchMap.release());
+    }
+    mMatchMapTimer.initialize(this);
+
+    // Start the aging clock
+    mAgingStart = Timestamp::now_steady();
+    mAgingTimer.initialize(this);
+    if (mUEMapIdleTimeout != 0) {
+        mAgingTimer.schedule_after_sec(1);
+    }
+
+    // Warm restart: get back the UEs known in the previous run. Go on
+    // anyway if we can't, they'll be learnt again from S1AP.
+    if (!mUEMapFile.empty() && access(mUEMapFile.c_str(), F_OK) == 0 &&
+        loadUEMap(mUEMapFile, errh) < 0) {
+        errh->warning("Starting with an empty UEMap");
+    }
+
     /////////////////////////
     // Configure callbacks //
     /////////////////////////
 
-    mRouter.onGTPv1U_IPv4([this](auto &context) -> bool {
-        return this->handleInterceptedGTPv1UTraffic(context);
-    });
-
-    mGTPEncapSink.onUnknownUE([this](const NetworkLib::BufferView &ipv4Data) {
-        return this->handleIPv4UnknownUE(ipv4Data);
-    });
+    if (mDoAsyncS1AP) {
+        // Only S1AP goes through mRouter, on the S1AP thread: it just
+        // updates the UEMap, packets are forwarded by the data path.
+        mRouter.onGTPv1U_IPv4([](auto &) -> bool { return false; });
+        mRouter.onIPv4PostProcess([](auto &) -> bool { return false; });
+        mRouter.onNonIPv4([](auto &) -> bool { return false; });
+        mRouter.onFinalProcess([](auto &) -> bool { return false; });
+    } else {
+        setUpTrafficCallbacks(mRouter);
+    }
 
-    mRouter.onIPv4PostProcess([this](auto &context) -> bool {
-        return this->handleIPv4PostProcess(context);
-    });
+    for (auto &ts : mThreadStates) {
+        if (ts->ownRouter) {
+            setUpTrafficCallbacks(*ts->ownRouter);
+        }
 
-    mRouter.onNonIPv4(
-        [this](auto &context) -> bool { return this->handleNonIPv4(context); });
+        ts->encapSink.onUnknownUE(
+            [this](const NetworkLib::BufferView &ipv4Data) {
+                return this->handleIPv4UnknownUE(ipv4Data);
+            });
+    }
 
-    mRouter.onFinalProcess([this](auto &context) -> bool {
-        return this->handleCommonTraffic(context);
+    mRouter.onS1APRelevantTraffic([this]() {
+        UPF_TRACE_DEBUG_MSG(mTraceLevel, "CBK S1AP Traffic");
+        if (!this->mDoAsyncS1AP) {
+            this->threadState().s1apPacket = true;
+        }
     });
 
-    // DEBUG CODE
-    mRouter.onS1APRelevantTraffic([]() { click_chatter("CBK S1AP Traffic"); });
-
     // Optional callback to print out entries added to the UE map
     // as they are added/updated.
-    mRouter.beforeUEMapUpsert([](auto &pair) -> bool {
-        std::ostringstream s;
-        s << "*** Inserting UE IP: " << pair.first // UE IP address
-          << " --> (eNB <-> EPC) " << pair.second  // GTP tunnel endpoints
-          << '\n';
-        click_chatter("%s", s.str().c_str());
+    mRouter.beforeUEMapUpsert([this](auto &pair) -> bool {
+        if (UPF_TRACE_ENABLED(mTraceLevel, UPF_TRACE_INFO)) {
+            std::ostringstream s;
+            s << "*** Inserting UE IP: " << pair.first // UE IP address
+              << " --> (eNB <-> EPC) " << pair.second  // GTP tunnel endpoints
+              << '\n';
+            click_chatter("%s", s.str().c_str());
+        }
+
+        // Keep our raw copy of the tunnel endpoints up-to-date
+        if (this->mDoAsyncS1AP) {
+            // On the S1AP thread, with the UEMap locked: leave it to
+            // the data path, once unlocked
+            const UPFRouterLib::GTPv1UTunnelInfo &tunnelInfo = pair.second;
+
+            this->mPendingUEMapUpdates.push_back(
+                {{toClickIPAddress(pair.first).addr(),
+                  toClickIPAddress(tunnelInfo.eNBEndPoint.ipAddress).addr(),
+                  toRawTEID(tunnelInfo.eNBEndPoint.teid),
+                  toClickIPAddress(tunnelInfo.epcEndPoint.ipAddress).addr(),
+                  toRawTEID(tunnelInfo.epcEndPoint.teid)},
+                 false});
+        } else {
+            this->cacheUETunnel(pair.first, pair.second);
+        }
+
+        // Remember the E-RAB of the UE, to remove it on its release
+        if (this->mNumS1APMessages != 0) {
+            this->trackS1APBearer(
+                toClickIPAddress(pair.first).addr(),
+                toRawTEID(pair.second.eNBEndPoint.teid));
+        }
 
         // Add/update the entry into the UE map.
         return true;
     });
 
-#if 0
-    // DEBUG: initialize UEMap
-    auto &ueMap = mRouter.getUEMap();
+    // Optional callback to print out entries removed from the UE map
+    // on S1AP releases.
+    beforeUEMapErase([this](auto &pair) -> bool {
+        if (UPF_TRACE_ENABLED(mTraceLevel, UPF_TRACE_INFO)) {
+            std::ostringstream s;
+            s << "*** Removing UE IP: " << pair.first // UE IP address
+              << " --> (eNB <-> EPC) " << pair.second // GTP tunnel endpoints
+              << '\n';
+            click_chatter("%s", s.str().c_str());
+        }
 
-    {
-        UPFRouterLib::GTPv1UTunnelInfo ti;
+        // Keep our raw copy of the tunnel endpoints up-to-date
+        const uint32_t ueAddress = toClickIPAddress(pair.first).addr();
+
+        if (this->mDoAsyncS1AP) {
+            // On the S1AP thread, with the UEMap locked: leave it to
+            // the data path, once unlocked
+            this->mPendingUEMapUpdates.push_back(
+                {{ueAddress, 0, 0, 0, 0}, true});
+        } else {
+            this->eraseRawUETunnel(ueAddress);
+        }
 
-        // Test code
-    
-        ti.eNBEndPoint.ipAddress = NetworkLib::IPv4Address("192.168.0.177");
-        ti.eNBEndPoint.teid = NetworkLib::GTP_TEID::Number(0x00ee0003);
+        // Remove the entry from the UE map.
+        return true;
+    });
 
-        ti.epcEndPoint.ipAddress = NetworkLib::IPv4Address("192.168.0.167");
-        ti.epcEndPoint.teid = NetworkLib::GTP_TEID::Number(0x00000011);
+    if (mDoAsyncS1AP) {
+        mUEMapUpdateTask.initialize(this, false);
+        mS1APStopping = false;
+        mS1APThreadDone = false;
 
-        ueMap[NetworkLib::IPv4Address("45.45.0.10")] = ti;
+        try {
+            mS1APThread = std::thread(&UPFRouter::runS1APThread, this);
+        } catch (const std::exception &e) {
+            errh->error("Can't start the S1AP thread: %s", e.what());
+            return -1;
+        }
     }
 
-    {
-        UPFRouterLib::GTPv1UTunnelInfo ti;
+    return 0;
+}
 
-        // Test code 
-        ti.eNBEndPoint.ipAddress = NetworkLib::IPv4Address("192.168.0.177");
-        ti.eNBEndPoint.teid = NetworkLib::GTP_TEID::Number(0x00f70003);
+void UPFRouter::cleanup(CleanupStage stage) {
+    if (mDoAsyncS1AP) {
+        stopS1APThread();
 
-        ti.epcEndPoint.ipAddress = NetworkLib::IPv4Address("192.168.0.167");
-        ti.epcEndPoint.teid = NetworkLib::GTP_TEID::Number(0x00000013);
+        // Don't lose the last UEMap changes
+        while (applyUEMapUpdates(UEMAP_UPDATE_BUDGET, true) > 0) {
+        }
+    }
 
-        ueMap[NetworkLib::IPv4Address("45.45.0.11")] = ti;
+    // Save the UEMap for the next run (if this one actually started)
+    if (stage >= CLEANUP_ROUTER_INITIALIZED && !mUEMapFile.empty()) {
+        saveUEMap(mUEMapFile, ErrorHandler::default_handler());
     }
+}
 
-    // Print out the map
-    String s = rh_UEMap(nullptr);
-    click_chatter("%s",s.c_str());
-#endif
+void UPFRouter::setUpTrafficCallbacks(UPFRouterLib::Router &router) {
+    router.onGTPv1U_IPv4([this](auto &context) -> bool {
+        return this->handleInterceptedGTPv1UTraffic(context);
+    });
 
-    return 0;
+    router.onIPv4PostProcess([this](auto &context) -> bool {
+        return this->handleIPv4PostProcess(context);
+    });
+
+    router.onNonIPv4(
+        [this](auto &context) -> bool { return this->handleNonIPv4(context); });
+
+    router.onFinalProcess([this](auto &context) -> bool {
+        return this->handleCommonTraffic(context);
+    });
 }
 
 Packet *UPFRouter::simple_action_extended(Packet *p, int inputPort) {
 
-    click_chatter("got packet %p from port %d", p, inputPort);
+    UPF_TRACE_DEBUG_MSG(mTraceLevel, "got packet %p from port %d", p,
+                        inputPort);
+
+    // Transit traffic between eNodeBs and EPCs just goes to the other
+    // side, without building a context for the router.
+    if (mDoBypass && inputPort != 2 &&
+        mBypass.match(reinterpret_cast<const click_ip *>(p->data()),
+                      p->length())) {
+        countPath(PATH_BYPASSED, p->length());
+        outputPacket(1 - inputPort, p);
+        return nullptr;
+    }
+
+    ThreadState &ts = threadState();
+    const click_cycles_t startCycles = mDoLatencyStats ? click_get_cycles() : 0;
+
+    ts.s1apPacket = false;
 
     try {
         // Build a BufferView out of the Click Packet. We expect a
         // packet with IPv4 data.
+        UPF_PROFILE_START(ts.profiler, bufferViewSample);
         NetworkLib::BufferView buffer =
             NetworkLib::BufferView::makeNonOwningBufferView(p->data(),
                                                             p->length());
+        UPF_PROFILE_STOP(ts.profiler, UPF_STAGE_BUFFER_VIEW, bufferViewSample);
 
         NetworkLib::ContextUserData userData = {};
 
@@ -341,22 +801,101 @@ Packet *UPFRouter::simple_action_extended(Packet *p, int inputPort) {
         //
         // The router callbacks will then push the packet down to the
         // appropriate port.
-        mRouter.consumeIPv4Packet(buffer, userData);
+        if (mDoS1APFilter && inputPort != 2 && isSCTPPacket(p) &&
+            !mS1APFilter.mustDecode(
+                reinterpret_cast<const click_ip *>(p->data()),
+                p->length())) {
+            // Nothing for the UEMap: just forward it.
+            countPath(PATH_S1AP_FORWARDED, p->length());
+            outputPacket(1 - inputPort, p);
+        } else if (mDoAsyncS1AP && inputPort != 2 && isSCTPPacket(p)) {
+            // Possibly S1AP: don't wait for it to be decoded.
+            forwardS1APPacket(ts, p, inputPort);
+        } else if (!mDoAsyncS1AP && isSCTPPacket(p)) {
+            // Possibly S1AP, updating the UEMap: one thread at a time.
+            UPF_PROFILE_SCOPE(ts.profiler, UPF_STAGE_DISPATCH);
+            consumeS1APPacket(buffer, userData, p->data(), p->length());
+        } else {
+            UPF_PROFILE_SCOPE(ts.profiler, UPF_STAGE_DISPATCH);
+            ts.router.consumeIPv4Packet(buffer, userData);
+        }
 
     } catch (std::exception &e) {
-        click_chatter("*** UPFRouter::simple_action(Packet *): "
-                      "caught exception: %s",
-                      e.what());
+        UPF_TRACE(mTraceLevel, UPF_TRACE_ERROR,
+                  "*** UPFRouter::simple_action(Packet *): "
+                  "caught exception: %s",
+                  e.what());
+    }
+
+    if (mDoLatencyStats) {
+        const click_cycles_t cycles = click_get_cycles() - startCycles;
+        int bucket = cycles ? 64 - __builtin_clzll(cycles) : 0;
+
+        if (bucket >= NUM_LATENCY_BUCKETS) {
+            bucket = NUM_LATENCY_BUCKETS - 1;
+        }
+        ++ts.stats.latency[bucket];
     }
 
     // Note: packet killing will be done in our callbacks
     return nullptr;
 }
 
+#if HAVE_BATCH
+void UPFRouter::push_batch(int port, PacketBatch *batch) {
+    // Classify the whole batch: our callbacks queue packets in
+    // the pending batches of this thread instead of pushing them out
+    // one by one.
+    ThreadState &ts = threadState();
+    ts.inBatch = true;
+
+    FOR_EACH_PACKET_SAFE(batch, p) {
+        p->set_next(nullptr);
+        simple_action_extended(p, port);
+    }
+
+    ts.inBatch = false;
+
+    // Then push out one sub-batch per output port
+    for (int outputPort = 0; outputPort < MAX_OUTPUTS; ++outputPort) {
+        PendingBatch &pending = ts.pendingBatches[outputPort];
+
+        if (pending.count > 0) {
+            checked_output_push_batch(
+                outputPort, PacketBatch::make_from_simple_list(
+                                pending.head, pending.tail, pending.count));
+            pending = {};
+        }
+    }
+}
+#endif
+
+void UPFRouter::outputPacket(int port, Packet *p) {
+#if HAVE_BATCH
+    ThreadState &ts = threadState();
+
+    if (ts.inBatch && port >= 0 && port < MAX_OUTPUTS) {
+        PendingBatch &pending = ts.pendingBatches[port];
+
+        p->set_next(nullptr);
+        if (pending.count == 0) {
+            pending.head = p;
+        } else {
+            pending.tail->set_next(p);
+        }
+        pending.tail = p;
+        ++pending.count;
+        return;
+    }
+#endif
+
+    checked_output_push(port, p);
+}
+
 bool UPFRouter::handleInterceptedGTPv1UTraffic(
     NetworkLib::EthPacketProcessor::Context &context) {
 
-    click_chatter("in gtpv1utraffic");
+    UPF_TRACE_DEBUG_MSG(mTraceLevel, "in gtpv1utraffic");
 
     // Let's have a look at the IPv4 traffic encapsulated in GTPv1-U.
     //
@@ -369,161 +908,618 @@ bool UPFRouter::handleInterceptedGTPv1UTraffic(
     // The UE may be a known one, or an unknown one.
     const NetworkLib::BufferView encapIpv4Data =
         context.gtpv1uDecoder->getData();
-    const NetworkLib::IPv4Decoder ipv4DecoderEncap(encapIpv4Data);
 
-    bool rc;
-    UPFRouterLib::Router::UEMap_t::iterator it;
+    // Locate the encapsulated IPv4 header inside the Click Packet, so
+    // we can look up the UE by TEID or by its raw address.
+    const Packet *p =
+        reinterpret_cast<const Packet *>(context.userData.ptrUserData);
+    const int innerOffset = p ? innerIPv4Offset(p, encapIpv4Data.size()) : -1;
+
+    if (innerOffset < 0) {
+        // Can't make sense of it: forward it "as-is".
+        countPath(PATH_GTPU_MALFORMED, p ? p->length() : 0);
+        context.postProcessIPv4 = false;
+        return true;
+    }
 
-    if (packetCameFromENodeB(context) &&
-        ((std::tie(it, rc) = mRouter.isIPv4TrafficFromKnownUE(ipv4DecoderEncap),
-          rc))) {
+    const click_ip *outerIp = reinterpret_cast<const click_ip *>(p->data());
+    const click_ip *innerIp =
+        reinterpret_cast<const click_ip *>(p->data() + innerOffset);
+    const uint32_t teid = rawGTPv1UTEID(p);
+    bool knownUE = false;
 
-        // This is IPv4 traffic encapsulated in GTPv1-U actually
+    if (packetCameFromENodeB(context)) {
+        // Is this IPv4 traffic encapsulated in GTPv1-U actually
         // **from** a known UE and coming from Click port 1 (i.e. from
-        // an actual eNodeB).
+        // an actual eNodeB)?
+        knownUE = isTrafficOfKnownUE(context, innerIp->ip_src.s_addr,
+                                     outerIp->ip_dst.s_addr, teid, true);
+
+    } else if (packetCameFromEPC(context)) {
+        // Is this IPv4 traffic encapsulated in GTPv1-U **to** a known
+        // UE and coming from Click port 0 (i.e. from the EPC)?
+        knownUE = isTrafficOfKnownUE(context, innerIp->ip_dst.s_addr,
+                                     outerIp->ip_dst.s_addr, teid, false);
+    }
 
-        {
-            // Workaround for changing TEIDs: extract the TEID
-            // and update UEmap if it is not the same
-            auto newTeid = context.gtpv1uDecoder->getTEID();
+    // If the encapsulated traffic of a known UE also matches some rule
+    // in MatchMap, the encapsulated IPv4 traffic should be
+    // decapsulated and redirected (unchanged) to some VNF through
+    // Click port 2.
+
+    if (knownUE && matchesMatchMap(innerIp, encapIpv4Data)) {
+        // Decapsulate and send down Click's output port 2 (for
+        // local processing)
+        countPath(PATH_GTPU_DIVERTED, p->length());
+        pushDecapsulated(context, encapIpv4Data);
+
+        // Ensure it doesn't get post-processed (redundant, as we
+        // don't allow further processing by returning false).
+        context.postProcessIPv4 = false;
+        return false;
+    }
 
-            if (it->second.epcEndPoint.teid != newTeid) {
+    // Otherwise, this is GTPv1-U traffic from/to an unknown UE and/or not
+    // matching any entry in MatchMap. Forward "as-is" to its original
+    // destination.
 
-                std::ostringstream ostr;
-                ostr << "Updating EPC GTP TEID for UE "
-                     << ipv4DecoderEncap.getSrcAddress() << " from "
-                     << it->second.epcEndPoint.teid << " to " << newTeid;
-                click_chatter("%s", ostr.str().c_str());
+    // Ensure it doesn't get post-processed, but allow final
+    // processing so it is forwarded "as-is".
+    countPath(PATH_GTPU_FORWARDED, p->length());
+    context.postProcessIPv4 = false;
+    return true;
+}
 
-                it->second.epcEndPoint.teid = newTeid;
-            }
-        }
+void UPFRouter::pushDecapsulated(
+    NetworkLib::EthPacketProcessor::Context &context,
+    const NetworkLib::BufferView &encapIpv4Data) {
 
-        // If the encapsulated traffic also matches some rule in
-        // MatchMap, the encapsulated IPv4 traffic should be
-        // decapsulated and redirected (unchanged) to some VNF through
-        // Click port 2.
-
-        if (mRuleMatcher.match(ipv4DecoderEncap)) {
-            // Make a (new) Click Packet out of the (now decapsulated)
-            // IPv4 data...
-            Packet *p1 = makeWritablePacket(encapIpv4Data);
-
-            if (p1) {
-                // Take the original packet (GTPv1-U) and kill it.
-                Packet *p =
-                    reinterpret_cast<Packet *>(context.userData.ptrUserData);
-                if (p) {
-                    click_chatter("Killing packet 1");
-                    p->kill();
-                    context.userData.ptrUserData = nullptr;
-                }
+    // Take the original packet (GTPv1-U)...
+    Packet *p = reinterpret_cast<Packet *>(context.userData.ptrUserData);
 
-                // ... and push the new Packet down Click's output
-                // port 2 (for local processing)
-                checked_output_push(2, p1);
-            }
+    if (mDoZeroCopyDecap && p && decapsulateInPlace(p, encapIpv4Data.size())) {
+        // ... and push it down Click's output port 2, now that it
+        // holds just the encapsulated IPv4 datagram.
+        context.userData.ptrUserData = nullptr;
+        outputPacket(2, p);
+        return;
+    }
 
-            // Ensure it doesn't get post-processed (redundant, as we
-            // don't allow further processing by returning false).
-            context.postProcessIPv4 = false;
-            return false;
+    // Otherwise make a (new) Click Packet out of the (now
+    // decapsulated) IPv4 data...
+    UPF_PROFILE_START(threadState().profiler, makePacketSample);
+    Packet *p1 = makeWritablePacket(encapIpv4Data);
+    UPF_PROFILE_STOP(threadState().profiler, UPF_STAGE_MAKE_PACKET,
+                     makePacketSample);
+
+    if (p1) {
+        // ... kill the original packet...
+        if (p) {
+            UPF_TRACE_DEBUG_MSG(mTraceLevel, "Killing packet %p", p);
+            p->kill();
+            context.userData.ptrUserData = nullptr;
         }
 
-    } else if (packetCameFromEPC(context) &&
-               (std::tie(it, rc) =
-                    mRouter.isIPv4TrafficToKnownUE(ipv4DecoderEncap),
-                rc)) {
+        // ... and push the new Packet down Click's output port 2
+        outputPacket(2, p1);
+    }
+}
 
-        // This is IPv4 traffic encapsulated in GTPv1-U **to** a known
-        // UE and coming from Click port 0 (i.e. from the EPC).
+bool UPFRouter::isTrafficOfKnownUE(
+    NetworkLib::EthPacketProcessor::Context &context, uint32_t ueAddress,
+    uint32_t tunnelAddress, uint32_t teid, bool epcEndPoint) {
 
-        {
-            // Workaround for changing TEIDs: extract the TEID
-            // and update UEmap if it is not the same
-            auto newTeid = context.gtpv1uDecoder->getTEID();
+    UPF_PROFILE_SCOPE(threadState().profiler, UPF_STAGE_UE_LOOKUP);
 
-            if (it->second.eNBEndPoint.teid != newTeid) {
+    // Common case: the tunnel (destination address and TEID) tells
+    // the UE, we just check the traffic is really from/to it.
+    UEIndexEntry indexEntry;
 
-                std::ostringstream ostr;
-                ostr << "Updating eNodeB GTP TEID for UE "
-                     << ipv4DecoderEncap.getDstAddress() << " from "
-                     << it->second.eNBEndPoint.teid << " to " << newTeid;
-                click_chatter("%s", ostr.str().c_str());
+    if (likely(lookupAndTouchUE(
+                   epcEndPoint ? mEPCTEIDs : mENBTEIDs,
+                   makeTEIDKey(tunnelAddress, teid), indexEntry,
+                   [ueAddress](const UEIndexEntry &entry) {
+                       return entry.ueAddress == ueAddress;
+                   }) &&
+               indexEntry.ueAddress == ueAddress)) {
+        return true;
+    }
 
-                it->second.eNBEndPoint.teid = newTeid;
-            }
-        }
+    // Otherwise, look up the UE by address
+    UETunnelEndPoints endPoints;
 
-        if (mRuleMatcher.match(ipv4DecoderEncap)) {
+    if (!lookupAndTouchUE(mUETunnels, ueAddress, endPoints)) {
+        return false;
+    }
 
-            // Make a (new) Click Packet out of the (now decapsulated)
-            // IPv4 data...
-            Packet *p1 = makeWritablePacket(encapIpv4Data);
+    // Workaround for changing TEIDs: update UEmap if the TEID is not
+    // the same
+    if ((epcEndPoint ? endPoints.epcTeid : endPoints.eNBTeid) != teid) {
+        updateUETEID(ueAddress, epcEndPoint, teid);
+    }
 
-            if (p1) {
-                // Take the original packet (GTPv1-U) and kill it.
-                Packet *p =
-                    reinterpret_cast<Packet *>(context.userData.ptrUserData);
-                if (p) {
-                    click_chatter("Killing packet 2");
-                    p->kill();
-                    context.userData.ptrUserData = nullptr;
-                }
+    return true;
+}
 
-                // ... and push the new Packet down Click output port
-                // 2 (for local processing)
-                checked_output_push(2, p1);
-            }
+bool UPFRouter::matchesMatchMap(const click_ip *innerIp,
+                                const NetworkLib::BufferView &encapIpv4Data) {
 
-            // Ensure it doesn't get post-processed (redundant, as we
-            // don't allow further processing by returning false).
-            context.postProcessIPv4 = false;
-            return false;
-        }
+    // The snapshot we get stays valid as long as the guard lives.
+    UPFEpochDomain::Guard guard(mMatchMapEpochs, threadIndex());
+    const MatchMapSnapshot *matchMap =
+        mMatchMap.load(std::memory_order_acquire);
+
+    if (matchMap->classifierValid) {
+        UPF_PROFILE_SCOPE(threadState().profiler, UPF_STAGE_CLASSIFY);
+        return matchMap->classifier.match(innerIp, encapIpv4Data.size());
     }
 
-    // Otherwise, this is GTPv1-U traffic from/to an unknown UE and/or not
-    // matching any entry in MatchMap. Forward "as-is" to its original
-    // destination.
+    UPF_PROFILE_START(threadState().profiler, innerDecodeSample);
+    const NetworkLib::IPv4Decoder ipv4DecoderEncap(encapIpv4Data);
+    UPF_PROFILE_STOP(threadState().profiler, UPF_STAGE_INNER_DECODE,
+                     innerDecodeSample);
 
-    // Ensure it doesn't get post-processed, but allow final
-    // processing so it is forwarded "as-is".
-    context.postProcessIPv4 = false;
-    return true;
+    UPF_PROFILE_SCOPE(threadState().profiler, UPF_STAGE_RULE_MATCH);
+    return matchMap->ruleMatcher.match(ipv4DecoderEncap);
 }
 
-bool UPFRouter::handleIPv4PostProcess(
-    NetworkLib::EthPacketProcessor::Context &context) {
+void UPFRouter::publishMatchMap() {
+    scheduleMatchMapSwap(buildMatchMapSnapshot(mRuleMatcher, mClassifierRules));
+}
 
-    click_chatter("in ipv4postprocess");
+void UPFRouter::scheduleMatchMapSwap(MatchMapSnapshot *matchMap) {
+    // Replaces any snapshot not swapped in yet, which nobody has seen.
+    // Before initialize(), it's swapped in there.
+    mNextMatchMap.reset(matchMap);
 
-    // This is called on plain IPv4 traffic that wasn't processed
-    // before:
-    //
-    // * S1AP traffic explicitly skips this processing by setting
-    //   'context.postProcessIPv4' to false;
-    //
-    // * GTPv1-U traffic from/to an unknown UE skips this processing
-    //   by setting 'context.postProcessIPv4' to false as well.
-    //
-    // Therefore: this is either:
-    //
-    // * plain IPv4 traffic phisically coming from some VNF, but
-    //   figuring as destined either to a known UE or to the EPC of a
-    //   known UE (actually, we look at the source address in this
-    //   latter case, checking if it comes from a known UE);
+    if (mMatchMapTimer.initialized()) {
+        mMatchMapTimer.schedule_now();
+    }
+}
+
+UPFRouter::ClassifierRule
+UPFRouter::parseClassifierRule(const String &rule) {
+    ClassifierRule parsed;
+
+    parsed.valid = UPFMatchClassifier::parseRule(rule, parsed.rule);
+    return parsed;
+}
+
+UPFRouter::MatchMapSnapshot *UPFRouter::buildMatchMapSnapshot(
+    const UPFRouterLib::RuleMatcher &rules,
+    const std::vector<ClassifierRule> &classifierRules) const {
+    std::unique_ptr<MatchMapSnapshot> matchMap(new MatchMapSnapshot());
+    std::size_t i = 0;
+
+    for (auto const &it : rules.getRules()) {
+        matchMap->ruleMatcher.addRule(it,
+                                      UPFRouterLib::RuleMatcher::endPosition);
+        ++i;
+    }
+
+    // Scan the rules instead of compiling them if any can't be
+    // compiled, so the match semantics are preserved.
+    matchMap->classifierValid = (i == classifierRules.size());
+
+    for (i = 0; i < classifierRules.size() && matchMap->classifierValid; ++i) {
+        if (!classifierRules[i].valid) {
+            UPF_TRACE(mTraceLevel, UPF_TRACE_WARNING,
+                      "Can't compile MatchMap rule #%u, scanning rules "
+                      "instead",
+                      static_cast<unsigned>(i + 1));
+            matchMap->classifierValid = false;
+            break;
+        }
+
+        matchMap->classifier.addRule(classifierRules[i].rule);
+    }
+
+    if (matchMap->classifierValid) {
+        matchMap->classifier.compile();
+
+        UPF_TRACE(mTraceLevel, UPF_TRACE_INFO, "MatchMap compiled (%u rules)",
+                  static_cast<unsigned>(matchMap->classifier.size()));
+    } else {
+        matchMap->classifier.clear();
+    }
+
+    return matchMap.release();
+}
+
+void UPFRouter::installMatchMapSnapshot(MatchMapSnapshot *matchMap) {
+    // Swap it in: readers still holding the old one keep using it
+    // until they are done.
+    const MatchMapSnapshot *oldMatchMap = mMatchMap.exchange(matchMap);
+    if (oldMatchMap) {
+        mMatchMapEpochs.retire([oldMatchMap]() { delete oldMatchMap; });
+    }
+}
+
+void UPFRouter::run_timer(Timer *timer) {
+    if (timer == &mMatchMapTimer) {
+        // A write handler may be building a snapshot meanwhile: don't
+        // hold up this thread, try again later.
+        std::unique_lock<std::mutex> lock(mMatchMapMutex, std::try_to_lock);
+
+        if (!lock.owns_lock()) {
+            mMatchMapTimer.schedule_after_msec(MATCHMAP_RECLAIM_INTERVAL_MS);
+            return;
+        }
+
+        if (mNextMatchMap) {
+            installMatchMapSnapshot(mNextMatchMap.release());
+        }
+
+        // Retry until no reader can see the old snapshots anymore
+        if (mMatchMapEpochs.reclaim() > 0) {
+            mMatchMapTimer.schedule_after_msec(MATCHMAP_RECLAIM_INTERVAL_MS);
+        }
+    } else if (timer == &mAgingTimer) {
+        runUEMapAging();
+    }
+}
+
+bool UPFRouter::run_task(Task *) {
+    // If the UEMap is busy, try again on the next round
+    const std::size_t applied = applyUEMapUpdates(UEMAP_UPDATE_BUDGET, false);
+
+    if (!mUEMapUpdates.empty()) {
+        mUEMapUpdateTask.fast_reschedule();
+    }
+
+    return applied > 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+// S1AP thread
+
+void UPFRouter::forwardS1APPacket(ThreadState &ts, Packet *p, int inputPort) {
+    // Copy the bytes: Click packets (even clones) must not be handled
+    // by the S1AP thread, which is not a Click thread.
+    unsigned char *slot =
+        ts.s1apQueue.prepare(sizeof(S1APPacket) + p->length());
+
+    if (slot) {
+        reinterpret_cast<S1APPacket *>(slot)->port = inputPort;
+        memcpy(slot + sizeof(S1APPacket), p->data(), p->length());
+        ts.s1apQueue.commit();
+    } else {
+        // The S1AP thread is lagging behind: the UEMap will miss this
+        // one.
+        countPath(PATH_S1AP_OVERFLOW, p->length());
+    }
+
+    countPath(PATH_S1AP_FORWARDED, p->length());
+    outputPacket(1 - inputPort, p);
+}
+
+void UPFRouter::runS1APThread() {
+    for (;;) {
+        // Check before looking at the queues, so nothing queued before
+        // stopS1APThread() is missed
+        const bool stopping = mS1APStopping.load(std::memory_order_acquire);
+        bool idle = true;
+
+        for (auto &ts : mThreadStates) {
+            const unsigned char *record;
+            uint32_t length;
+
+            while ((record = ts->s1apQueue.front(length)) != nullptr) {
+                const unsigned char *data = record + sizeof(S1APPacket);
+                const uint32_t dataLength = length - sizeof(S1APPacket);
+                NetworkLib::ContextUserData userData = {};
+
+                // No packet to push out: mRouter just updates the
+                // UEMap.
+                userData.intUserData =
+                    reinterpret_cast<const S1APPacket *>(record)->port;
+
+                try {
+                    consumeS1APPacket(
+                        NetworkLib::BufferView::makeNonOwningBufferView(
+                            data, dataLength),
+                        userData, data, dataLength);
+                } catch (std::exception &e) {
+                    UPF_TRACE(mTraceLevel, UPF_TRACE_ERROR,
+                              "*** UPFRouter::runS1APThread(): "
+                              "caught exception: %s",
+                              e.what());
+                }
+
+                // Now that the UEMap is unlocked: the data path may
+                // need it to make room for them.
+                publishPendingUEMapUpdates();
+
+                ts->s1apQueue.pop();
+                idle = false;
+            }
+        }
+
+        if (idle) {
+            if (stopping) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    mS1APThreadDone.store(true, std::memory_order_release);
+}
+
+void UPFRouter::stopS1APThread() {
+    if (mS1APThread.joinable()) {
+        mS1APStopping.store(true, std::memory_order_release);
+
+        // mUEMapUpdateTask no longer runs: make room for the last
+        // UEMap changes ourselves, meanwhile.
+        while (!mS1APThreadDone.load(std::memory_order_acquire)) {
+            if (applyUEMapUpdates(UEMAP_UPDATE_BUDGET, true) == 0) {
+                std::this_thread::yield();
+            }
+        }
+
+        mS1APThread.join();
+    }
+}
+
+void UPFRouter::publishUEMapUpdate(const UEMapUpdate &update) {
+    // Rather wait than lose a UE. Task::reschedule() may be called from
+    // any thread in multithreaded builds (see configure()).
+    while (!mUEMapUpdates.push(update)) {
+        mUEMapUpdateTask.reschedule();
+        std::this_thread::yield();
+    }
+
+    mUEMapUpdateTask.reschedule();
+}
+
+void UPFRouter::publishPendingUEMapUpdates() {
+    for (const UEMapUpdate &update : mPendingUEMapUpdates) {
+        publishUEMapUpdate(update);
+    }
+    mPendingUEMapUpdates.clear();
+}
+
+std::size_t UPFRouter::applyUEMapUpdates(std::size_t budget, bool wait) {
+    UEMapUpdate update;
+    std::size_t applied = 0;
+
+    // The S1AP thread never publishes with the UEMap locked, so holding
+    // it while dequeueing doesn't keep it from making room.
+    std::unique_lock<std::mutex> lock;
+
+    if (wait) {
+        lock = lockUEMap();
+    } else if (!tryLockUEMap(lock)) {
+        return 0;
+    }
+
+    while (applied < budget && mUEMapUpdates.pop(update)) {
+        const UPFUEMapRecord &record = update.record;
+        ++applied;
+
+        if (update.erase) {
+            eraseRawUETunnel(record.ueAddress);
+            continue;
+        }
+
+        UETunnelEndPoints endPoints = {};
+
+        endPoints.eNBAddress = record.eNBAddress;
+        endPoints.eNBTeid = record.eNBTeid;
+        endPoints.epcAddress = record.epcAddress;
+        endPoints.epcTeid = record.epcTeid;
+
+        if (!cacheRawUETunnel(record.ueAddress, endPoints)) {
+            UPF_TRACE(mTraceLevel, UPF_TRACE_ERROR,
+                      "UPFRouter::applyUEMapUpdates(): can't grow the "
+                      "UEMap (%u entries)!",
+                      static_cast<unsigned>(mUETunnels.size()));
+        }
+    }
+
+    return applied;
+}
+
+void UPFRouter::consumeS1APPacket(const NetworkLib::BufferView &buffer,
+                                  NetworkLib::ContextUserData &userData,
+                                  const unsigned char *data,
+                                  uint32_t length) {
+    auto lock = lockUEMap();
+
+    // The UPFlib router tells neither which UE association its upserts
+    // belong to, nor what is released: see for ourselves.
+    const std::size_t numMessages = upfPeekS1APMessages(
+        reinterpret_cast<const click_ip *>(data), length, mS1APMessages,
+        MAX_S1AP_MESSAGES);
+    mNumS1APMessages = numMessages;
+
+    try {
+        mRouter.consumeIPv4Packet(buffer, userData);
+    } catch (...) {
+        mNumS1APMessages = 0;
+        throw;
+    }
+    mNumS1APMessages = 0;
+
+    for (std::size_t i = 0; i < numMessages; ++i) {
+        const UPFS1APMessage &message = mS1APMessages[i];
+
+        if (message.isUEContextRelease() || message.isERABRelease()) {
+            releaseS1APBearers(message);
+        }
+    }
+}
+
+void UPFRouter::trackS1APBearer(uint32_t ueAddress, uint32_t eNBTeid) {
+    const UPFS1APMessage *association = nullptr;
+    int eRABId = -1;
+
+    // The E-RAB set up with this eNodeB TEID or else, not knowing
+    // which E-RAB it is, the first UE association setting up any.
+    for (std::size_t i = 0; i < mNumS1APMessages && eRABId < 0; ++i) {
+        const UPFS1APMessage &message = mS1APMessages[i];
+
+        if (!message.isSetup() || !message.hasMMEUEId) {
+            continue;
+        }
+        if (!association) {
+            association = &message;
+        }
+
+        for (unsigned j = 0; j < message.numERABs; ++j) {
+            if (message.eRABs[j].hasENBTeid &&
+                message.eRABs[j].eNBTeid == eNBTeid) {
+                association = &message;
+                eRABId = message.eRABs[j].id;
+                break;
+            }
+        }
+    }
+
+    if (!association) {
+        return;
+    }
+
+    const uint64_t key =
+        makeS1APUEKey(association->mmeAddress, association->mmeUEId);
+    auto known = mS1APUEKeys.find(ueAddress);
+
+    if (known != mS1APUEKeys.end() && known->second == key) {
+        // Same UE association (e.g. after a path switch, or a dedicated
+        // bearer being set up): keep the E-RAB first seen, i.e. the
+        // default one, unless unknown.
+        auto range = mS1APBearers.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.ueAddress == ueAddress) {
+                if (it->second.eRABId < 0) {
+                    it->second.eRABId = eRABId;
+                }
+                break;
+            }
+        }
+        return;
+    }
+
+    forgetS1APBearer(ueAddress);
+    mS1APBearers.insert({key, {ueAddress, eRABId}});
+    mS1APUEKeys[ueAddress] = key;
+}
+
+void UPFRouter::forgetS1APBearer(uint32_t ueAddress) {
+    auto known = mS1APUEKeys.find(ueAddress);
+
+    if (known == mS1APUEKeys.end()) {
+        return;
+    }
+
+    auto range = mS1APBearers.equal_range(known->second);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second.ueAddress == ueAddress) {
+            mS1APBearers.erase(it);
+            break;
+        }
+    }
+
+    mS1APUEKeys.erase(known);
+}
+
+void UPFRouter::releaseS1APBearers(const UPFS1APMessage &message) {
+    if (!message.hasMMEUEId) {
+        return;
+    }
+
+    auto range = mS1APBearers.equal_range(
+        makeS1APUEKey(message.mmeAddress, message.mmeUEId));
+
+    for (auto it = range.first; it != range.second;) {
+        // All the UEs of a released UE context, or those whose E-RAB
+        // is released
+        bool released = message.isUEContextRelease();
+
+        for (unsigned j = 0; j < message.numERABs && !released; ++j) {
+            released = (message.eRABs[j].id == it->second.eRABId);
+        }
+
+        if (!released) {
+            ++it;
+            continue;
+        }
+
+        const uint32_t ueAddress = it->second.ueAddress;
+        mS1APUEKeys.erase(ueAddress);
+        it = mS1APBearers.erase(it);
+
+        eraseUE(ueAddress);
+    }
+}
+
+void UPFRouter::eraseUE(uint32_t ueAddress) {
+    auto &ueMap = mRouter.getUEMap();
+    auto entry = ueMap.find(toIPv4Address(IPAddress(ueAddress)));
+
+    // Possibly gone already (e.g. for being idle)
+    if (entry == ueMap.end()) {
+        return;
+    }
+
+    if (mBeforeUEMapErase && !mBeforeUEMapErase(*entry)) {
+        return;
+    }
+
+    ueMap.erase(entry);
+    mUEMapReleases.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool UPFRouter::handleIPv4PostProcess(
+    NetworkLib::EthPacketProcessor::Context &context) {
+
+    UPF_TRACE_DEBUG_MSG(mTraceLevel, "in ipv4postprocess");
+
+    // This is called on plain IPv4 traffic that wasn't processed
+    // before:
+    //
+    // * S1AP traffic explicitly skips this processing by setting
+    //   'context.postProcessIPv4' to false;
+    //
+    // * GTPv1-U traffic from/to an unknown UE skips this processing
+    //   by setting 'context.postProcessIPv4' to false as well.
+    //
+    // Therefore: this is either:
+    //
+    // * plain IPv4 traffic phisically coming from some VNF, but
+    //   figuring as destined either to a known UE or to the EPC of a
+    //   known UE (actually, we look at the source address in this
+    //   latter case, checking if it comes from a known UE);
     //
     // * other IPv4 traffic.
 
+    if (mDoInPlaceEncap) {
+        Packet *p = reinterpret_cast<Packet *>(context.userData.ptrUserData);
+
+        if (p && pushEncapsulated(p)) {
+            context.userData.ptrUserData = nullptr;
+            return false;
+        }
+
+        // Unknown UE: go on as usual, so the encapsulation sink deals
+        // with it.
+    }
+
+    ThreadState &ts = threadState();
+    const NetworkLib::BufferView ipv4Data =
+        context.ipv4Decoder->getIPv4Packet();
     NetworkLib::ContextUserData outputUserData;
-    mGTPEncapSink.consumeIPv4Packet(context.ipv4Decoder->getIPv4Packet(),
-                                    outputUserData);
+    UPF_PROFILE_START(ts.profiler, encapSinkSample);
+    ts.encapSink.consumeIPv4Packet(ipv4Data, outputUserData);
+    UPF_PROFILE_STOP(ts.profiler, UPF_STAGE_ENCAP_SINK, encapSinkSample);
 
-    // Note: the last packet written out by mGTPEncapSink can be empty
-    //       because we instructed it to write out empty packets on
-    //       unknown UEs, via the onUnknownUE callback returning true.
-    NetworkLib::BufferView ipv4Packet = mIPv4Tap.getLastIPv4Packet();
+    // Note: the last packet written out by the encapsulation sink can
+    //       be empty because we instructed it to write out empty
+    //       packets on unknown UEs, via the onUnknownUE callback
+    //       returning true.
+    NetworkLib::BufferView ipv4Packet = ts.ipv4Tap.getLastIPv4Packet();
 
     if (ipv4Packet.empty()) {
         // Unknown UE? This is other IPv4 traffic (not encapsulated in
@@ -532,6 +1528,7 @@ bool UPFRouter::handleIPv4PostProcess(
 
         if (packetCameFromEPC(context) || packetCameFromENodeB(context)) {
             // Do nothing and forward it as it is.
+            countPath(PATH_PLAIN_FORWARDED, ipv4Data.size());
             return true;
         } else {
 
@@ -544,7 +1541,8 @@ bool UPFRouter::handleIPv4PostProcess(
                 reinterpret_cast<Packet *>(context.userData.ptrUserData);
             if (p) {
                 // checked_output_push(3, p);
-                click_chatter("again, shoulnt be here...");
+                UPF_TRACE(mTraceLevel, UPF_TRACE_WARNING,
+                          "again, shoulnt be here...");
 
                 // In any case, the Packet will be killed by somebody
                 // else.
@@ -552,6 +1550,7 @@ bool UPFRouter::handleIPv4PostProcess(
             }
 
             // In any case, stop processing here.
+            countPath(PATH_PLAIN_DROPPED, ipv4Data.size());
             return false;
         }
     }
@@ -560,13 +1559,15 @@ bool UPFRouter::handleIPv4PostProcess(
     // encapsulated in GTPv1-U.
 
     // Make a (new) Click Packet out of the given BufferView...
+    UPF_PROFILE_START(ts.profiler, makePacketSample);
     Packet *p1 = makeWritablePacket(ipv4Packet);
+    UPF_PROFILE_STOP(ts.profiler, UPF_STAGE_MAKE_PACKET, makePacketSample);
 
     if (p1) {
         // Take the original packet and kill it.
         Packet *p = reinterpret_cast<Packet *>(context.userData.ptrUserData);
         if (p) {
-            click_chatter("Killing packet 3");
+            UPF_TRACE_DEBUG_MSG(mTraceLevel, "Killing packet 3");
             p->kill();
             context.userData.ptrUserData = nullptr;
         }
@@ -577,9 +1578,13 @@ bool UPFRouter::handleIPv4PostProcess(
         int outputPort = outputUserData.intUserData;
 
         // ... and push the new Packet down Click
-        checked_output_push(outputPort, p1);
+        countPath(outputPort == 0 ? PATH_ENCAP_TO_EPC : PATH_ENCAP_TO_ENB,
+                  ipv4Data.size());
+        outputPacket(outputPort, p1);
     } else {
-        click_chatter(
+        countPath(PATH_ENCAP_FAILED, ipv4Data.size());
+        UPF_TRACE(
+            mTraceLevel, UPF_TRACE_ERROR,
             "UPFRouter::handleIPv4PostProcess(NetworkLib::"
             "EthPacketProcessor::Context &): can't make a new WritablePacket!");
     }
@@ -587,10 +1592,407 @@ bool UPFRouter::handleIPv4PostProcess(
     return false;
 }
 
+void UPFRouter::cacheUETunnel(
+    const NetworkLib::IPv4Address &ueAddress,
+    const UPFRouterLib::GTPv1UTunnelInfo &tunnelInfo) {
+
+    // Note: this is the only writer of mUETunnels and its indexes
+    //       (called with mUEMapMutex held in thread-safe mode), but
+    //       the data path may be reading them meanwhile.
+    UETunnelEndPoints endPoints;
+
+    endPoints.eNBAddress =
+        toClickIPAddress(tunnelInfo.eNBEndPoint.ipAddress).addr();
+    endPoints.eNBTeid = toRawTEID(tunnelInfo.eNBEndPoint.teid);
+    endPoints.epcAddress =
+        toClickIPAddress(tunnelInfo.epcEndPoint.ipAddress).addr();
+    endPoints.epcTeid = toRawTEID(tunnelInfo.epcEndPoint.teid);
+
+    if (!cacheRawUETunnel(toClickIPAddress(ueAddress).addr(), endPoints)) {
+        UPF_TRACE(mTraceLevel, UPF_TRACE_ERROR,
+                  "UPFRouter::cacheUETunnel(): can't grow the UEMap "
+                  "(%u entries)!",
+                  static_cast<unsigned>(mUETunnels.size()));
+    }
+}
+
+// Remove the entry 'key' of a TEID index, if it still refers to the
+// UE 'ueAddress' (another UE may have been given the same tunnel
+// since).
+template <typename Index>
+static void eraseIndexEntry(Index &index, uint64_t key, uint32_t ueAddress) {
+    const auto *entry = index.find(key);
+
+    if (entry && entry->ueAddress == ueAddress) {
+        index.writeBegin();
+        index.erase(key);
+        index.writeEnd();
+    }
+}
+
+// Make the entry 'key' of a TEID index refer to the UE 'ueAddress'
+template <typename Index>
+static void setIndexEntry(Index &index, uint64_t key, uint32_t ueAddress,
+                          uint32_t now) {
+    index.writeBegin();
+    auto *entry = index.insert(key);
+    if (entry) {
+        entry->ueAddress = ueAddress;
+        entry->lastSeen = now;
+    }
+    index.writeEnd();
+}
+
+bool UPFRouter::cacheRawUETunnel(uint32_t rawUEAddress,
+                                 const UETunnelEndPoints &endPoints) {
+    const uint32_t now = mAgingNow.load(std::memory_order_relaxed);
+    const UETunnelEndPoints *oldEndPoints = mUETunnels.find(rawUEAddress);
+    const bool isNewUE = (oldEndPoints == nullptr);
+
+    if (oldEndPoints) {
+        // Its tunnels may change: drop them from the TEID indexes.
+        eraseIndexEntry(
+            mEPCTEIDs,
+            makeTEIDKey(oldEndPoints->epcAddress, oldEndPoints->epcTeid),
+            rawUEAddress);
+        eraseIndexEntry(
+            mENBTEIDs,
+            makeTEIDKey(oldEndPoints->eNBAddress, oldEndPoints->eNBTeid),
+            rawUEAddress);
+    }
+
+    mUETunnels.writeBegin();
+    UETunnelEndPoints *newEndPoints = mUETunnels.insert(rawUEAddress);
+    if (newEndPoints) {
+        newEndPoints->eNBAddress = endPoints.eNBAddress;
+        newEndPoints->eNBTeid = endPoints.eNBTeid;
+        newEndPoints->epcAddress = endPoints.epcAddress;
+        newEndPoints->epcTeid = endPoints.epcTeid;
+
+        if (isNewUE) {
+            newEndPoints->lastSeen = now;
+            newEndPoints->agingExpiry = now + mUEMapIdleTimeout;
+        }
+    }
+    mUETunnels.writeEnd();
+
+    if (!newEndPoints) {
+        return false;
+    }
+
+    if (isNewUE && mUEMapIdleTimeout != 0) {
+        mAgingWheel.schedule(rawUEAddress, newEndPoints->agingExpiry);
+    }
+
+    // Index the UE by its tunnels
+    setIndexEntry(mEPCTEIDs,
+                  makeTEIDKey(endPoints.epcAddress, endPoints.epcTeid),
+                  rawUEAddress, now);
+    setIndexEntry(mENBTEIDs,
+                  makeTEIDKey(endPoints.eNBAddress, endPoints.eNBTeid),
+                  rawUEAddress, now);
+
+    return true;
+}
+
+void UPFRouter::eraseRawUETunnel(uint32_t rawUEAddress) {
+    const UETunnelEndPoints *endPoints = mUETunnels.find(rawUEAddress);
+
+    if (!endPoints) {
+        return;
+    }
+
+    eraseIndexEntry(mEPCTEIDs,
+                    makeTEIDKey(endPoints->epcAddress, endPoints->epcTeid),
+                    rawUEAddress);
+    eraseIndexEntry(mENBTEIDs,
+                    makeTEIDKey(endPoints->eNBAddress, endPoints->eNBTeid),
+                    rawUEAddress);
+
+    mUETunnels.writeBegin();
+    mUETunnels.erase(rawUEAddress);
+    mUETunnels.writeEnd();
+}
+
+// The later of two aging ticks
+static inline uint32_t laterTick(uint32_t a, uint32_t b) {
+    return (static_cast<int32_t>(a - b) > 0) ? a : b;
+}
+
+void UPFRouter::runUEMapAging() {
+    const uint32_t now = (Timestamp::now_steady() - mAgingStart).sec() + 1;
+    mAgingNow.store(now, std::memory_order_relaxed);
+
+    bool morePending;
+
+    {
+        // Don't hold up this thread while the S1AP thread (or another
+        // Click thread) decodes S1AP: try again soon.
+        std::unique_lock<std::mutex> lock;
+
+        if (!tryLockUEMap(lock)) {
+            mAgingTimer.schedule_after_msec(UEMAP_AGING_RETRY_MS);
+            return;
+        }
+
+        morePending = mAgingWheel.expire(
+            now, UEMAP_AGING_BUDGET,
+            [this, now](uint32_t ueAddress, uint32_t expiry) {
+                this->ageUE(ueAddress, expiry, now);
+            });
+    }
+
+    // Go on with the rest soon, letting packets through meanwhile.
+    if (morePending) {
+        mAgingTimer.schedule_now();
+    } else {
+        mAgingTimer.schedule_after_sec(1);
+    }
+}
+
+void UPFRouter::ageUE(uint32_t ueAddress, uint32_t expiry, uint32_t now) {
+    UETunnelEndPoints *endPoints = mUETunnels.find(ueAddress);
+
+    // Gone, or checked again later: nothing to do now.
+    if (!endPoints || endPoints->agingExpiry != expiry) {
+        return;
+    }
+
+    // The data path may be storing these meanwhile
+    uint32_t lastSeen = __atomic_load_n(&endPoints->lastSeen, __ATOMIC_RELAXED);
+    const UEIndexEntry *entry;
+
+    if ((entry = mEPCTEIDs.find(
+             makeTEIDKey(endPoints->epcAddress, endPoints->epcTeid))) &&
+        entry->ueAddress == ueAddress) {
+        lastSeen = laterTick(
+            lastSeen, __atomic_load_n(&entry->lastSeen, __ATOMIC_RELAXED));
+    }
+
+    if ((entry = mENBTEIDs.find(
+             makeTEIDKey(endPoints->eNBAddress, endPoints->eNBTeid))) &&
+        entry->ueAddress == ueAddress) {
+        lastSeen = laterTick(
+            lastSeen, __atomic_load_n(&entry->lastSeen, __ATOMIC_RELAXED));
+    }
+
+    if (static_cast<int32_t>(lastSeen + mUEMapIdleTimeout - now) > 0) {
+        // Seen meanwhile: check again when it may be idle long enough.
+        mUETunnels.writeBegin();
+        endPoints->agingExpiry = lastSeen + mUEMapIdleTimeout;
+        mUETunnels.writeEnd();
+
+        mAgingWheel.schedule(ueAddress, endPoints->agingExpiry);
+        return;
+    }
+
+    UPF_TRACE(mTraceLevel, UPF_TRACE_INFO, "Removing idle UE %s",
+              IPAddress(ueAddress).unparse().c_str());
+
+    mRouter.getUEMap().erase(toIPv4Address(IPAddress(ueAddress)));
+    eraseRawUETunnel(ueAddress);
+    forgetS1APBearer(ueAddress);
+    mUEMapEvictions.fetch_add(1, std::memory_order_relaxed);
+}
+
+int UPFRouter::saveUEMap(const String &fileName, ErrorHandler *errh) {
+    // Our copy already holds everything in network byte order.
+    std::vector<UPFUEMapRecord> records;
+
+    {
+        auto lock = lockUEMap();
+
+        records.reserve(mUETunnels.size());
+        mUETunnels.forEach(
+            [&records](uint32_t ueAddress, const UETunnelEndPoints &e) {
+                records.push_back({ueAddress, e.eNBAddress, e.eNBTeid,
+                                   e.epcAddress, e.epcTeid});
+            });
+    }
+
+    if (!UPFUEMapFile::save(fileName, records.data(), records.size(),
+                            errh)) {
+        return -1;
+    }
+
+    UPF_TRACE(mTraceLevel, UPF_TRACE_INFO, "Saved %u UEs into %s",
+              static_cast<unsigned>(records.size()), fileName.c_str());
+    return 0;
+}
+
+int UPFRouter::loadUEMap(const String &fileName, ErrorHandler *errh) {
+    UPFUEMapFile file;
+
+    if (!file.open(fileName, errh)) {
+        return -1;
+    }
+
+    std::size_t invalid;
+    const std::size_t dropped = addUEs(file.records(), file.size(), invalid);
+
+    if (invalid > 0) {
+        errh->warning("%s: %u invalid UEs (with address 0.0.0.0) skipped",
+                      fileName.c_str(), static_cast<unsigned>(invalid));
+    }
+
+    if (dropped > 0) {
+        errh->warning("%s: %u UEs don't fit in the UEMap (see uemapcapacity)",
+                      fileName.c_str(), static_cast<unsigned>(dropped));
+    }
+
+    UPF_TRACE(mTraceLevel, UPF_TRACE_INFO, "Loaded %u UEs from %s",
+              static_cast<unsigned>(file.size() - invalid - dropped),
+              fileName.c_str());
+    return 0;
+}
+
+std::size_t UPFRouter::addUEs(const UPFUEMapRecord *records,
+                              std::size_t count, std::size_t &invalid) {
+    auto lock = lockUEMap();
+    auto &ueMap = mRouter.getUEMap();
+    std::size_t dropped = 0;
+
+    // Only the encapsulation sink needs UEs in the reference copy: fill
+    // just our own (no allocation per UE) when traffic from port 2 is
+    // encapsulated in place.
+    const bool fillUEMap = !mDoInPlaceEncap;
+
+    if (fillUEMap) {
+        ueMap.reserve(ueMap.size() + count);
+    }
+
+    invalid = 0;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        const UPFUEMapRecord &record = records[i];
+        UETunnelEndPoints endPoints = {};
+
+        if (record.ueAddress == 0) {
+            ++invalid;
+            continue;
+        }
+
+        endPoints.eNBAddress = record.eNBAddress;
+        endPoints.eNBTeid = record.eNBTeid;
+        endPoints.epcAddress = record.epcAddress;
+        endPoints.epcTeid = record.epcTeid;
+
+        if (!cacheRawUETunnel(record.ueAddress, endPoints)) {
+            ++dropped;
+            continue;
+        }
+
+        if (!fillUEMap) {
+            continue;
+        }
+
+        UPFRouterLib::GTPv1UTunnelInfo &tunnelInfo =
+            ueMap[toIPv4Address(IPAddress(record.ueAddress))];
+
+        tunnelInfo.eNBEndPoint.ipAddress =
+            toIPv4Address(IPAddress(record.eNBAddress));
+        tunnelInfo.eNBEndPoint.teid =
+            NetworkLib::GTP_TEID::Number(ntohl(record.eNBTeid));
+        tunnelInfo.epcEndPoint.ipAddress =
+            toIPv4Address(IPAddress(record.epcAddress));
+        tunnelInfo.epcEndPoint.teid =
+            NetworkLib::GTP_TEID::Number(ntohl(record.epcTeid));
+    }
+
+    return dropped;
+}
+
+void UPFRouter::updateUETEID(uint32_t ueAddress, bool epcEndPoint,
+                             uint32_t teid) {
+
+    // We are on the data path: in thread-safe mode (or with the S1AP
+    // thread), serialize with S1AP updates of the UEMap, but never wait
+    // for them. The next packet of the UE will try again.
+    std::unique_lock<std::mutex> lock;
+
+    if (!tryLockUEMap(lock)) {
+        return;
+    }
+
+    const UETunnelEndPoints *oldEndPoints = mUETunnels.find(ueAddress);
+
+    if (!oldEndPoints) {
+        return;
+    }
+
+    UETunnelEndPoints endPoints = *oldEndPoints;
+    uint32_t &endPointTeid =
+        epcEndPoint ? endPoints.epcTeid : endPoints.eNBTeid;
+
+    UPF_TRACE(mTraceLevel, UPF_TRACE_INFO,
+              "Updating %s GTP TEID for UE %s from 0x%08x to 0x%08x",
+              epcEndPoint ? "EPC" : "eNodeB",
+              IPAddress(ueAddress).unparse().c_str(), ntohl(endPointTeid),
+              ntohl(teid));
+
+    endPointTeid = teid;
+
+    // Keep the reference copy in sync (UEs loaded from a snapshot may
+    // not be there)
+    auto &ueMap = mRouter.getUEMap();
+    auto it = ueMap.find(toIPv4Address(IPAddress(ueAddress)));
+
+    if (it != ueMap.end()) {
+        (epcEndPoint ? it->second.epcEndPoint : it->second.eNBEndPoint).teid =
+            NetworkLib::GTP_TEID::Number(ntohl(teid));
+    }
+
+    cacheRawUETunnel(ueAddress, endPoints);
+}
+
+bool UPFRouter::pushEncapsulated(Packet *p) {
+    const click_ip *ip = reinterpret_cast<const click_ip *>(p->data());
+
+    // Just like GTPv1UEncapSink: traffic from a known UE goes to its
+    // EPC (port 0), traffic to a known UE goes to its eNodeB (port 1).
+    int outputPort;
+    uint32_t srcAddress, dstAddress, teid;
+
+    UETunnelEndPoints endPoints;
+
+    if (lookupAndTouchUE(mUETunnels, ip->ip_src.s_addr, endPoints)) {
+        outputPort = 0;
+        srcAddress = endPoints.eNBAddress;
+        dstAddress = endPoints.epcAddress;
+        teid = endPoints.epcTeid;
+    } else if (lookupAndTouchUE(mUETunnels, ip->ip_dst.s_addr, endPoints)) {
+        outputPort = 1;
+        srcAddress = endPoints.epcAddress;
+        dstAddress = endPoints.eNBAddress;
+        teid = endPoints.eNBTeid;
+    } else {
+        return false;
+    }
+
+    const std::size_t length = p->length();
+    WritablePacket *q = encapsulateInPlace(
+        p, srcAddress, dstAddress, teid, threadState().ipv4Identification++,
+        mDoEnableUDPChecksum);
+
+    if (q) {
+        countPath(outputPort == 0 ? PATH_ENCAP_TO_EPC : PATH_ENCAP_TO_ENB,
+                  length);
+        outputPacket(outputPort, q);
+    } else {
+        countPath(PATH_ENCAP_FAILED, length);
+        UPF_TRACE(mTraceLevel, UPF_TRACE_ERROR,
+                  "UPFRouter::pushEncapsulated(Packet *): can't push "
+                  "GTPv1-U headers!");
+    }
+
+    // In any case, the original packet is gone.
+    return true;
+}
+
 bool UPFRouter::handleNonIPv4(
     NetworkLib::EthPacketProcessor::Context &context) {
 
-    click_chatter("in nonipv4");
+    UPF_TRACE_DEBUG_MSG(mTraceLevel, "in nonipv4");
 
     // This is not IPv4 traffic.
     //
@@ -602,8 +2004,9 @@ bool UPFRouter::handleNonIPv4(
     // connected, the traffic is just dropped (and the Click's
     // Packet is killed).
     Packet *p = reinterpret_cast<Packet *>(context.userData.ptrUserData);
+    countPath(PATH_NON_IPV4, p ? p->length() : 0);
     if (p) {
-        click_chatter("shouldnt be here...");
+        UPF_TRACE(mTraceLevel, UPF_TRACE_WARNING, "shouldnt be here...");
         // checked_output_push(3, p);
 
         // In any case, the Packet will be killed by somebody
@@ -617,10 +2020,12 @@ bool UPFRouter::handleNonIPv4(
 
 bool UPFRouter::handleIPv4UnknownUE(const NetworkLib::BufferView &ipv4Data) {
 
-    click_chatter("in unknownue");
+    UPF_TRACE_DEBUG_MSG(mTraceLevel, "in unknownue");
 
-    if (mDoEnableUnknownTrafficDump) {
-        click_chatter("myedit");
+    countPath(PATH_UNKNOWN_UE, ipv4Data.size());
+
+    if (mDoEnableUnknownTrafficDump &&
+        UPF_TRACE_ENABLED(mTraceLevel, UPF_TRACE_INFO)) {
         click_chatter("*** Plain IPv4 traffic to/from unknown UE");
         DumperLib::IPv4Dumper dumper(ipv4Data);
         std::ostringstream s;
@@ -628,7 +2033,7 @@ bool UPFRouter::handleIPv4UnknownUE(const NetworkLib::BufferView &ipv4Data) {
         click_chatter("%s", s.str().c_str());
     }
 
-    // Return true so mGTPEncapSink sends down an empty packet to
+    // Return true so the encapsulation sink sends down an empty packet to
     // destination (this is intercepted later).
     return true;
 }
@@ -637,20 +2042,24 @@ bool UPFRouter::handleCommonTraffic(
 
     NetworkLib::EthPacketProcessor::Context &context) {
 
-    click_chatter("in commontraffic");
+    UPF_TRACE_DEBUG_MSG(mTraceLevel, "in commontraffic");
 
     // If it came from Click port 1, it goes to port 0 and vice-versa.
     int outputPort = 1 - getClickInputPortFromContext(context);
-    click_chatter("out port is %d", outputPort);
+    UPF_TRACE_DEBUG_MSG(mTraceLevel, "out port is %d", outputPort);
 
     // Take the original Click Packet we received from the context...
     Packet *p = reinterpret_cast<Packet *>(context.userData.ptrUserData);
     if (p) {
+        countPath(threadState().s1apPacket ? PATH_S1AP_FORWARDED
+                                           : PATH_FORWARDED,
+                  p->length());
+
         // ... and push it out on the matching port
-        checked_output_push(outputPort, p);
+        outputPacket(outputPort, p);
     }
 
-    click_chatter("exiting commontraffic");
+    UPF_TRACE_DEBUG_MSG(mTraceLevel, "exiting commontraffic");
 
     return false;
 }
@@ -658,34 +2067,182 @@ bool UPFRouter::handleCommonTraffic(
 //////////////////////////////////////////////////////////////////////
 
 void UPFRouter::add_handlers() {
-    add_read_handler("uemap", read_handler_UEMap);
+    set_handler("uemap", Handler::f_read | Handler::f_read_param,
+                read_handler_UEMap);
     add_read_handler("matchmap", read_handler_MatchMap);
+    add_write_handler("uemapsave", write_handler_UEMap_save);
+    add_write_handler("uemapload", write_handler_UEMap_load);
+    add_read_handler("uemapevictions", read_handler_UEMapEvictions);
+    add_read_handler("uemapreleases", read_handler_UEMapReleases);
 
     add_write_handler("matchmapinsert", write_handler_MatchMap_insert);
     add_write_handler("matchmapappend", write_handler_MatchMap_append);
     add_write_handler("matchmapdelete", write_handler_MatchMap_delete);
     add_write_handler("matchmapclear", write_handler_MatchMap_clear);
+    add_write_handler("matchmapreplace", write_handler_MatchMap_replace);
     add_write_handler("enableudpchecksum", write_handler_enableUDPChecksum);
     add_write_handler("enableunknowntrafficdump",
                       write_handler_enableUknownTrafficDump);
+    add_read_handler("loglevel", read_handler_logLevel);
+    add_write_handler("loglevel", write_handler_logLevel);
+    add_read_handler("stats", read_handler_stats);
+    add_read_handler("latency", read_handler_latency);
+    add_read_handler("s1apfilter", read_handler_s1apFilter);
+#ifdef UPF_PROFILE
+    add_read_handler("profile", read_handler_profile);
+#endif
+    add_write_handler("resetstats", write_handler_resetStats);
 }
 
-String UPFRouter::rh_UEMap(void *) {
-    std::ostringstream res;
+int UPFRouter::rh_UEMap(String &data, ErrorHandler *errh) {
+    Vector<String> conf;
+    uint64_t cursor = 0;
+    uint32_t count = UEMAP_PAGE_SIZE;
+    IPAddress ueAddress;
+    IPAddress subnetAddress;
+    IPAddress subnetMask;
+    bool binary = false;
 
-    for (auto const &it : mRouter.getUEMap()) {
+    cp_argvec(data, conf);
 
-        res << it.first << ',' << it.second.eNBEndPoint.ipAddress << ','
-            << NetworkLib::asHex32(it.second.eNBEndPoint.teid) << ','
-            << it.second.epcEndPoint.ipAddress << ','
-            << NetworkLib::asHex32(it.second.epcEndPoint.teid) << '\n';
+    if (Args(conf, this, errh)
+            .read("cursor", cursor)
+            .read("count", count)
+            .read("ue", IPAddressArg(), ueAddress)
+            .read("subnet", IPPrefixArg(true), subnetAddress, subnetMask)
+            .read("binary", BoolArg(), binary)
+            .complete() < 0) {
+        return -1;
     }
 
-    return String(res.str().c_str());
+    if (count == 0) {
+        // There would be no way to tell where the next page starts
+        errh->error("count must be at least 1");
+        return -1;
+    }
+
+    // Walk our raw copy of the UEMap (no conversions, no copies of
+    // the whole content), formatting straight into the result.
+    StringAccum sa;
+
+    auto append = [&sa, binary](uint32_t ue, const UETunnelEndPoints &e) {
+        if (binary) {
+            const UPFUEMapRecord record = {ue, e.eNBAddress, e.eNBTeid,
+                                           e.epcAddress, e.epcTeid};
+            sa.append(reinterpret_cast<const char *>(&record),
+                      sizeof(record));
+            return;
+        }
+
+        sa << IPAddress(ue) << ',' << IPAddress(e.eNBAddress) << ',';
+        sa.snprintf(16, "0x%08x", ntohl(e.eNBTeid));
+        sa << ',' << IPAddress(e.epcAddress) << ',';
+        sa.snprintf(16, "0x%08x", ntohl(e.epcTeid));
+        sa << '\n';
+    };
+
+    auto lock = lockUEMap();
+    uint64_t nextCursor = 0;
+
+    if (ueAddress) {
+        const UETunnelEndPoints *endPoints = mUETunnels.find(ueAddress.addr());
+
+        if (endPoints) {
+            append(ueAddress.addr(), *endPoints);
+        }
+    } else {
+        // Resume the walk at the slot the previous page stopped at,
+        // unless the UEMap copy grew since: its entries all moved.
+        const uint32_t generation = mUETunnels.generation();
+
+        if (cursor != 0 && (cursor >> 32) != generation) {
+            errh->error("Stale cursor (the UEMap grew meanwhile): start "
+                        "over without cursor");
+            return -1;
+        }
+
+        // However few entries match, don't walk too far
+        const std::size_t start = cursor & 0xffffffff;
+        uint32_t appended = 0;
+        const std::size_t next = mUETunnels.forEachWhile(
+            start, start + UEMAP_PAGE_SLOTS,
+            [&](uint32_t ue, const UETunnelEndPoints &e) {
+                if (appended == count) {
+                    return false;
+                }
+
+                if (IPAddress(ue).matches_prefix(subnetAddress, subnetMask)) {
+                    append(ue, e);
+                    ++appended;
+                }
+
+                return true;
+            });
+
+        // More to come: tell where the next page starts (never 0, as
+        // the walk always moves on)
+        if (next < mUETunnels.slots()) {
+            nextCursor = (static_cast<uint64_t>(generation) << 32) | next;
+        }
+    }
+
+    if (binary) {
+        // A record of UE 0 ends the page, with the cursor (or 0)
+        const UPFUEMapRecord trailer = {
+            0, static_cast<uint32_t>(nextCursor >> 32),
+            static_cast<uint32_t>(nextCursor), 0, 0};
+        sa.append(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+    } else if (nextCursor != 0) {
+        sa << "next " << static_cast<unsigned long long>(nextCursor) << '\n';
+    }
+
+    data = sa.take_string();
+    return 0;
+}
+
+int UPFRouter::wh_UEMap_save(const String &str, void *, ErrorHandler *errh) {
+    String fileName = str.trim_space();
+
+    if (fileName.empty()) {
+        fileName = mUEMapFile;
+    }
+
+    if (fileName.empty()) {
+        errh->error("No UEMap file given (and no uemapfile configured)");
+        return -1;
+    }
+
+    return saveUEMap(fileName, errh);
+}
+
+int UPFRouter::wh_UEMap_load(const String &str, void *, ErrorHandler *errh) {
+    String fileName = str.trim_space();
+
+    if (fileName.empty()) {
+        fileName = mUEMapFile;
+    }
+
+    if (fileName.empty()) {
+        errh->error("No UEMap file given (and no uemapfile configured)");
+        return -1;
+    }
+
+    return loadUEMap(fileName, errh);
+}
+
+String UPFRouter::rh_UEMapEvictions(void *) {
+    return String(static_cast<unsigned long long>(
+        mUEMapEvictions.load(std::memory_order_relaxed)));
+}
+
+String UPFRouter::rh_UEMapReleases(void *) {
+    return String(static_cast<unsigned long long>(
+        mUEMapReleases.load(std::memory_order_relaxed)));
 }
 
 String UPFRouter::rh_MatchMap(void *) {
     std::ostringstream res;
+    std::lock_guard<std::mutex> lock(mMatchMapMutex);
 
     int i = 0;
     for (auto const &it : mRuleMatcher.getRules()) {
@@ -724,7 +2281,13 @@ int UPFRouter::wh_MatchMap_insert(const String &str, void *,
     try {
         UPFRouterLib::MatchingRule newRule(std::string(nextWord.c_str()));
         rule = newRule;
+        std::lock_guard<std::mutex> lock(mMatchMapMutex);
         mRuleMatcher.addRule(rule, static_cast<std::size_t>(position));
+        mClassifierRules.insert(
+            mClassifierRules.begin() +
+                std::min<std::size_t>(position, mClassifierRules.size()),
+            parseClassifierRule(nextWord));
+        publishMatchMap();
 
     } catch (const std::exception &e) {
         errh->error("Error while parsing MatchMap: |%s| is not a valid rule",
@@ -742,12 +2305,23 @@ int UPFRouter::wh_MatchMap_append(const String &str, void *vparam,
 
     (void)vparam;
 
+    std::lock_guard<std::mutex> lock(mMatchMapMutex);
+    std::size_t added = 0;
+    int rc = 0;
+
     while (true) {
 
+        if (upf_cp_skip_comment_comma(entry.begin(), entry.end()) ==
+            entry.end()) {
+            // No next word
+            break;
+        }
+
         nextWord = upf_cp_shift_commavec(entry);
 
         if (nextWord.length() == 0) {
-            // No next word
+            errh->error("Error while parsing MatchMap: empty rule");
+            rc = -1;
             break;
         }
 
@@ -757,16 +2331,25 @@ int UPFRouter::wh_MatchMap_append(const String &str, void *vparam,
             UPFRouterLib::MatchingRule newRule(std::string(nextWord.c_str()));
             rule = newRule;
             mRuleMatcher.addRule(rule, UPFRouterLib::RuleMatcher::endPosition);
+            mClassifierRules.push_back(parseClassifierRule(nextWord));
+            ++added;
 
         } catch (const std::exception &e) {
             errh->error(
                 "Error while parsing MatchMap: |%s| is not a valid rule",
                 nextWord.c_str());
-            return -1;
+            rc = -1;
+            break;
         }
     }
 
-    return 0;
+    // One snapshot for all the rules added (the ones before a bad rule
+    // stay in)
+    if (added > 0) {
+        publishMatchMap();
+    }
+
+    return rc;
 }
 
 int UPFRouter::wh_MatchMap_delete(const String &str, void *vparam,
@@ -794,7 +2377,12 @@ int UPFRouter::wh_MatchMap_delete(const String &str, void *vparam,
     }
 
     try {
+        std::lock_guard<std::mutex> lock(mMatchMapMutex);
         mRuleMatcher.delRule(static_cast<std::size_t>(position));
+        if (static_cast<std::size_t>(position) < mClassifierRules.size()) {
+            mClassifierRules.erase(mClassifierRules.begin() + position);
+        }
+        publishMatchMap();
 
     } catch (const std::exception &e) {
         errh->error(
@@ -808,7 +2396,10 @@ int UPFRouter::wh_MatchMap_delete(const String &str, void *vparam,
 
 int UPFRouter::wh_MatchMap_clear(const String &, void *, ErrorHandler *errh) {
     try {
+        std::lock_guard<std::mutex> lock(mMatchMapMutex);
         mRuleMatcher.clearRules();
+        mClassifierRules.clear();
+        publishMatchMap();
 
     } catch (const std::exception &e) {
         errh->error("Error while clearning MatchMap");
@@ -818,6 +2409,69 @@ int UPFRouter::wh_MatchMap_clear(const String &, void *, ErrorHandler *errh) {
     return 0;
 }
 
+int UPFRouter::wh_MatchMap_replace(const String &str, void *,
+                                   ErrorHandler *errh) {
+    String entry = str.trim_space();
+    String nextWord;
+
+    // 'file FILENAME': rules separated by comma or end-of-line
+    if (entry.starts_with("file ") || entry.starts_with("file\t")) {
+        const String fileName = entry.substring(5).trim_space();
+        const int nerrors = errh->nerrors();
+
+        entry = file_string(fileName, errh);
+        if (errh->nerrors() != nerrors) {
+            return -1;
+        }
+    }
+
+    // Parse and compile all the rules aside, without holding the
+    // MatchMap lock: a bad rule leaves the current MatchMap untouched.
+    UPFRouterLib::RuleMatcher rules;
+    std::vector<ClassifierRule> classifierRules;
+
+    while (true) {
+
+        if (upf_cp_skip_comment_comma(entry.begin(), entry.end()) ==
+            entry.end()) {
+            // No next word
+            break;
+        }
+
+        nextWord = upf_cp_shift_commavec(entry);
+
+        if (nextWord.length() == 0) {
+            errh->error("Error while parsing MatchMap: empty rule");
+            return -1;
+        }
+
+        try {
+            UPFRouterLib::MatchingRule rule(std::string(nextWord.c_str()));
+            rules.addRule(rule, UPFRouterLib::RuleMatcher::endPosition);
+            classifierRules.push_back(parseClassifierRule(nextWord));
+
+        } catch (const std::exception &e) {
+            errh->error(
+                "Error while parsing MatchMap: |%s| is not a valid rule",
+                nextWord.c_str());
+            return -1;
+        }
+    }
+
+    std::unique_ptr<MatchMapSnapshot> matchMap(
+        buildMatchMapSnapshot(rules, classifierRules));
+
+    // Install both the rules and their snapshot in one go (the timer
+    // swaps in the snapshot).
+    std::lock_guard<std::mutex> lock(mMatchMapMutex);
+
+    std::swap(mRuleMatcher, rules);
+    std::swap(mClassifierRules, classifierRules);
+    scheduleMatchMapSwap(matchMap.release());
+
+    return 0;
+}
+
 int UPFRouter::wh_enableUPDChecksum(const String &str, void *,
                                     ErrorHandler *errh) {
 
@@ -830,7 +2484,10 @@ int UPFRouter::wh_enableUPDChecksum(const String &str, void *,
         return -1;
     }
 
-    mGTPEncapSink.enableUDPChecksum(doEnableUDPChecksum);
+    for (auto &ts : mThreadStates) {
+        ts->encapSink.enableUDPChecksum(doEnableUDPChecksum);
+    }
+    mDoEnableUDPChecksum = doEnableUDPChecksum;
     return 0;
 }
 
@@ -846,11 +2503,190 @@ int UPFRouter::wh_enableUnknownTrafficDump(const String &str, void *,
         return -1;
     }
 
-    mGTPEncapSink.enableUDPChecksum(doEnableUnknownTrafficDump);
+    mDoEnableUnknownTrafficDump = doEnableUnknownTrafficDump;
+    return 0;
+}
+
+String UPFRouter::rh_logLevel(void *) {
+    return String(unparseUPFTraceLevel(mTraceLevel));
+}
+
+int UPFRouter::wh_logLevel(const String &str, void *, ErrorHandler *errh) {
+
+    int traceLevel;
+
+    if (!parseUPFTraceLevel(str, traceLevel)) {
+        errh->error("Error while parsing loglevel: |%s| is not one of "
+                    "none, error, warning, info, debug (or 0-4)",
+                    str.c_str());
+        return -1;
+    }
+
+    mTraceLevel = traceLevel;
+    return 0;
+}
+
+UPFRouter::Stats UPFRouter::sumStats() const {
+    Stats total = {};
+
+    for (auto const &ts : mThreadStates) {
+        const Stats &stats = ts->stats;
+
+        for (int i = 0; i < NUM_PATHS; ++i) {
+            total.packets[i] += stats.packets[i];
+            total.bytes[i] += stats.bytes[i];
+        }
+
+        for (int i = 0; i < NUM_LATENCY_BUCKETS; ++i) {
+            total.latency[i] += stats.latency[i];
+        }
+    }
+
+    return total;
+}
+
+String UPFRouter::rh_stats(void *) {
+    // Same order as enum Path
+    static const char *const pathNames[NUM_PATHS] = {
+        "s1ap_forwarded",  // PATH_S1AP_FORWARDED
+        "forwarded",       // PATH_FORWARDED
+        "gtpu_diverted",   // PATH_GTPU_DIVERTED
+        "gtpu_forwarded",  // PATH_GTPU_FORWARDED
+        "gtpu_malformed",  // PATH_GTPU_MALFORMED
+        "encap_to_epc",    // PATH_ENCAP_TO_EPC
+        "encap_to_enb",    // PATH_ENCAP_TO_ENB
+        "encap_failed",    // PATH_ENCAP_FAILED
+        "unknown_ue",      // PATH_UNKNOWN_UE
+        "plain_forwarded", // PATH_PLAIN_FORWARDED
+        "plain_dropped",   // PATH_PLAIN_DROPPED
+        "non_ipv4",        // PATH_NON_IPV4
+        "bypassed",        // PATH_BYPASSED
+        "s1ap_overflow"};  // PATH_S1AP_OVERFLOW
+
+    const Stats total = sumStats();
+    std::ostringstream res;
+
+    // One line per path: <path>,<packets>,<bytes>
+    for (int i = 0; i < NUM_PATHS; ++i) {
+        res << pathNames[i] << ','
+            << (total.packets[i] - mStatsBaseline.packets[i]) << ','
+            << (total.bytes[i] - mStatsBaseline.bytes[i]) << '\n';
+    }
+
+    return String(res.str().c_str());
+}
+
+String UPFRouter::rh_s1apFilter(void *) {
+    UPFS1APFilter::Counters total;
+    mS1APFilter.read(total);
+
+    std::ostringstream res;
+    uint64_t totalDecoded = 0;
+    uint64_t totalSkipped = 0;
+
+    // One line per procedure seen: <procedure>,<decoded>,<skipped>
+    for (int i = 0; i < UPFS1APFilter::NUM_PROCEDURES; ++i) {
+        const uint64_t decoded =
+            total.decoded[i] - mS1APFilterBaseline.decoded[i];
+        const uint64_t skipped =
+            total.skipped[i] - mS1APFilterBaseline.skipped[i];
+
+        if (decoded > 0 || skipped > 0) {
+            res << UPFS1APFilter::unparseProcedure(i).c_str() << ','
+                << decoded << ',' << skipped << '\n';
+            totalDecoded += decoded;
+            totalSkipped += skipped;
+        }
+    }
+    res << "total," << totalDecoded << ',' << totalSkipped << '\n';
+
+    return String(res.str().c_str());
+}
+
+String UPFRouter::rh_latency(void *) {
+    const Stats total = sumStats();
+    std::ostringstream res;
+
+    // One line per non-empty bucket: <min cycles>,<max cycles>,<packets>
+    // (the last bucket also counts anything longer: its max is 'inf')
+    for (int i = 0; i < NUM_LATENCY_BUCKETS; ++i) {
+        const uint64_t count = total.latency[i] - mStatsBaseline.latency[i];
+
+        if (count > 0) {
+            const uint64_t min = i ? (uint64_t(1) << (i - 1)) : 0;
+
+            res << min << ',';
+            if (i == NUM_LATENCY_BUCKETS - 1) {
+                res << "inf";
+            } else {
+                res << ((uint64_t(1) << i) - 1);
+            }
+            res << ',' << count << '\n';
+        }
+    }
+
+    return String(res.str().c_str());
+}
+
+#ifdef UPF_PROFILE
+UPFProfileCounters UPFRouter::sumProfile(int stage) const {
+    UPFProfileCounters total = {};
+
+    for (auto const &ts : mThreadStates) {
+        const UPFProfileCounters &counters = ts->profiler.stage(stage);
+
+        total.calls += counters.calls;
+        total.tscCycles += counters.tscCycles;
+        for (int i = 0; i < UPFPerfCounters::NUM_COUNTERS; ++i) {
+            total.values[i] += counters.values[i];
+        }
+    }
+
+    return total;
+}
+
+String UPFRouter::rh_profile(void *) {
+    std::ostringstream res;
+
+    // One line per stage: <stage>,<calls>,<TSC cycles>,<cycles>,
+    // <instructions>,<cache misses> (the last three are 0 without
+    // hardware counters)
+    for (int stage = 0; stage < UPF_NUM_STAGES; ++stage) {
+        const UPFProfileCounters total = sumProfile(stage);
+        const UPFProfileCounters &baseline = mProfileBaseline[stage];
+
+        res << unparseUPFProfileStage(stage) << ','
+            << (total.calls - baseline.calls) << ','
+            << (total.tscCycles - baseline.tscCycles);
+        for (int i = 0; i < UPFPerfCounters::NUM_COUNTERS; ++i) {
+            res << ',' << (total.values[i] - baseline.values[i]);
+        }
+        res << '\n';
+    }
+
+    return String(res.str().c_str());
+}
+#endif
+
+int UPFRouter::wh_resetStats(const String &, void *, ErrorHandler *) {
+    // Data path counters are only written by their threads: just take
+    // note of where they are now.
+    mStatsBaseline = sumStats();
+    mS1APFilter.read(mS1APFilterBaseline);
+
+#ifdef UPF_PROFILE
+    for (int stage = 0; stage < UPF_NUM_STAGES; ++stage) {
+        mProfileBaseline[stage] = sumProfile(stage);
+    }
+#endif
+
     return 0;
 }
 
 // clang-format off
 CLICK_ENDDECLS
+ELEMENT_REQUIRES(UPFMatchClassifier UPFFlatHashTable)
+ELEMENT_REQUIRES(UPFEpochDomain UPFUEMapFile UPFTimerWheel UPFProfile)
+ELEMENT_REQUIRES(UPFTransitClassifier UPFS1APFilter UPFS1APPeek)
 EXPORT_ELEMENT(UPFRouter)
 // clang-format on
@@ -3,21 +3,56 @@
 
 // clang-format off
 #include <click/element.hh>
+#include <click/task.hh>
+#include <click/timer.hh>
+#if HAVE_BATCH
+#include <click/batchelement.hh>
+#endif
 CLICK_DECLS
 // clang-format on
 
 #include <upfnetworklib/networklib.hh>
 #include <upfrouterlib/upfrouterlib.hh>
 
+#include "upfepoch.hh"
+#include "upfflathashtable.hh"
+#include "upfmatchclassifier.hh"
+#include "upfprofile.hh"
+#include "upfs1apfilter.hh"
+#include "upfs1appeek.hh"
+#include "upfspscqueue.hh"
+#include "upftimerwheel.hh"
+#include "upftrace.hh"
+#include "upftransitclassifier.hh"
+#include "upfuemapfile.hh"
+
+#include <atomic>
+#include <functional>
 // For std::unique_ptr<T>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 using namespace UPF;
 
 /*
  * =c
  * UPFRouter([enableudpchecksum {true|false}]
- *           [enableunknowntrafficdump * {true|false}])
+ *           [enableunknowntrafficdump * {true|false}]
+ *           [loglevel {none|error|warning|info|debug}]
+ *           [zerocopydecap {true|false}]
+ *           [inplaceencap {true|false}]
+ *           [uemapcapacity N]
+ *           [uemaphugepages {true|false}]
+ *           [uemapfile FILE]
+ *           [uemapidletimeout SECONDS]
+ *           [threads N]
+ *           [latencystats {true|false}]
+ *           [bypass ENTRIES]
+ *           [s1apthread {true|false}]
+ *           [s1apfilter {true|false}])
  *
  * =s general
  * In a 4G network, route network traffic between eNodeB's and EPCs,
@@ -47,12 +82,164 @@ using namespace UPF;
  *    traffic is ecapsulated in the appropriate GTPv1-U tunnel and
  *    sent either to the appropriate eNodeB or EPC through output port
  *    0 or 1.
+ *
+ * When 'zerocopydecap' is true (the default), traffic diverted to port 2
+ * is decapsulated in place, by stripping the outer IPv4/UDP/GTPv1-U
+ * headers from the original packet, without copying it.
+ *
+ * When 'inplaceencap' is true (the default), traffic from port 2 to/from
+ * a known UE is encapsulated in GTPv1-U in place, by pushing the outer
+ * IPv4/UDP/GTPv1-U headers into the packet headroom (the packet is
+ * reallocated only if its headroom is too short).
+ *
+ * When 'bypass' is given (default: none), transit traffic between
+ * eNodeBs and EPCs (e.g. OAM or X2 traffic) is told apart from its
+ * headers only, and sent straight to the other side without going
+ * through the UPFlib router (so it's never encapsulated, even if it's
+ * from/to a known UE). ENTRIES is a space-separated list of `proto`,
+ * `proto-port` or `all` entries (see upftransitclassifier.hh); GTPv1-U
+ * and S1AP traffic always go through the router. Such packets are
+ * counted as the 'bypassed' path.
+ *
+ * When built against FastClick (HAVE_BATCH), the element also accepts
+ * packet batches: a whole batch is classified first, then the packets
+ * are pushed out as one sub-batch per output port.
+ *
+ * On the data path, known UEs are looked up in an open-addressing copy
+ * of the UEMap (see upfflathashtable.hh), allocated up front for
+ * 'uemapcapacity' UEs (default: 65536), optionally on hugepages. GTPv1-U
+ * traffic is matched to its UE by tunnel (destination address and
+ * TEID) first, falling back to the UE address only when the TEID
+ * isn't known yet.
+ *
+ * The 'uemap' read handler returns a page of the UEMap: 'count M'
+ * (M > 0, default: 1000) returns at most M entries (in no particular
+ * order) followed, if there are more, by a 'next CURSOR' line, and
+ * 'cursor CURSOR' resumes from there. A read walks at most 65536 slots
+ * of the UEMap copy, so it may return fewer entries (even none) and a
+ * 'next' line. A cursor tells the slot of the UEMap copy where the
+ * walk stopped, so each page costs only what it walks. A walk is not
+ * a snapshot: adding UEs between pages doesn't move the other entries,
+ * but each removal (idle aging, S1AP release) may move back an entry
+ * of its cluster, past the cursor, so the walk can miss UEs present
+ * all along ('uemapsave' writes a consistent copy). If the UEMap copy
+ * grows beyond 'uemapcapacity' (only when 'threads' is 1), all its
+ * entries move: cursors from before are rejected as stale, and the
+ * walk must start over. 'ue ADDR' returns just the entry of a UE,
+ * 'subnet PREFIX' only the UEs in that subnet, and 'binary true'
+ * returns snapshot records (see upfuemapfile.hh) instead of text
+ * lines, always ended by a record of UE 0.0.0.0 whose eNodeB address
+ * and TEID fields hold the upper and lower halves of the next cursor
+ * (in host byte order; 0 if there are no more entries).
+ *
+ * When 'uemapidletimeout' is not 0 (the default), UEs without any
+ * GTPv1-U traffic (or traffic from/to port 2) for that long are
+ * removed from the UEMap, so it doesn't grow without bound as UEs
+ * come and go. The data path just stores a coarse timestamp into the
+ * entry it looked up; a timer checks idle UEs through a hierarchical
+ * timer wheel (see upftimerwheel.hh), a bounded number at a time. The
+ * 'uemapevictions' read handler reports how many UEs were removed.
+ *
+ * UEs are also removed as soon as S1AP releases them: on UE Context
+ * Release Complete (all the UEs of that UE association) and on E-RAB
+ * Release Response or Indication (the UEs whose E-RAB is released).
+ * The UPFlib router doesn't handle releases, so the S1AP messages that
+ * set up and release E-RABs are peeked at on the side (see
+ * upfs1appeek.hh) to tell which UE association and E-RAB each UE
+ * belongs to. The callback set with beforeUEMapErase() runs before
+ * each removal, like UPFRouterLib::Router::beforeUEMapUpsert() before
+ * each addition. The 'uemapreleases' read handler reports how many
+ * UEs were removed this way. Release messages only tell the UE
+ * association (MME UE S1AP ID) and E-RABs, not the UE address or
+ * TEIDs, so UEs not set up through S1AP since the start (restored from
+ * 'uemapfile', loaded with 'uemapload' or added with addUEs()) are
+ * never removed on release: only idle aging removes them.
+ *
+ * When 'uemapfile' is given, the UEMap is restored from that snapshot
+ * file (if it exists) at initialization time, and saved into it when
+ * the router is stopped, so known UEs survive a restart. The
+ * 'uemapsave' and 'uemapload' write handlers save/restore a snapshot
+ * at any time, into/from the file given as argument ('uemapfile' by
+ * default). See upfuemapfile.hh for the snapshot format. Loaded UEs
+ * only go into the data path copy of the UEMap (unless 'inplaceencap'
+ * is false), without an allocation per UE.
+ *
+ * The MatchMap is compiled into a protocol/port hash of destination
+ * address ranges (see upfmatchclassifier.hh). The data path reads it
+ * through an immutable snapshot, without locking: after the MatchMap
+ * write handlers change the rules, they build a new snapshot, a timer
+ * swaps it in, and old snapshots are released once no thread can be
+ * reading them anymore (see upfepoch.hh). The timer never waits for
+ * the handlers, so forwarding threads neither build snapshots nor
+ * wait for them to be built. The 'matchmapreplace' write
+ * handler replaces the whole MatchMap at once: the new rules are parsed
+ * and compiled aside, then swapped in with a single snapshot, so
+ * traffic never sees a partial rule set.
+ *
+ * When 'threads' is greater than 1 (default: 1), the element can be
+ * pushed to from any number of Click threads at once (e.g. with ports
+ * 0, 1 and 2 driven by different threads): N is just a switch, not a
+ * limit, as every Click thread gets a state. Each thread then gets its
+ * own scratch buffers, GTPv1-U encapsulation sink and router for user
+ * traffic, while S1AP traffic (i.e. SCTP) goes through a single router
+ * under a lock, so it's the only writer of the UEMap. The data path
+ * reads the UEMap copy without locking, which then can't grow beyond
+ * 'uemapcapacity'. In this mode, 'inplaceencap' must be true.
+ *
+ * With 'threads' 1, all ports must be driven by the same Click
+ * thread: the element warns if Click runs more than one.
+ *
+ * When 's1apthread' is true (default: false), S1AP traffic is never
+ * decoded on the data path: SCTP packets from port 0 or 1 are
+ * forwarded right away, while a copy of their bytes goes through a
+ * lock-free ring (one per Click thread) to a dedicated S1AP thread.
+ * That thread alone decodes S1AP (owning the UEMap, under the UEMap
+ * lock), and publishes UEMap changes to the data path through another
+ * lock-free queue, applied to the data path copy by a Click task. The
+ * data path then never waits for ASN.1 decoding, e.g. during attach
+ * storms: neither that task, nor the idle UE aging timer, waits for the
+ * UEMap lock while the S1AP thread holds it, they try again later. If
+ * the S1AP thread lags behind, packets that don't fit in its ring
+ * aren't decoded (counted as the 's1ap_overflow' path). In this mode,
+ * every SCTP packet from port 0 or 1 is counted as
+ * 's1ap_forwarded', 'inplaceencap' must be true, and Click must be
+ * built with multithreading support (the S1AP thread reschedules a
+ * Click task).
+ *
+ * When 's1apfilter' is true (default: false), SCTP packets from port
+ * 0 or 1 are peeked at before being decoded: S1AP messages of
+ * procedures that never change tunnels (e.g. Paging, NAS transport,
+ * Reset) are forwarded right away, without ASN.1 decoding (see
+ * upfs1apfilter.hh). The 's1apfilter' read handler reports how many
+ * packets were decoded and skipped, per S1AP procedure code.
+ *
+ * The 'stats' read handler reports packets and bytes through each
+ * path of the element (see below), as counted by every thread. When
+ * 'latencystats' is true (default: false), the CPU cycles spent on each
+ * packet are also recorded in a log2 histogram, reported by the
+ * 'latency' read handler (without batching, they include the time
+ * spent pushing the packet downstream). Writing 'resetstats' restarts
+ * both from 0.
+ *
+ * When the package is configured with `--enable-profile`, the data
+ * path is instrumented: the TSC cycles and hardware counters (see
+ * upfprofile.hh) spent in each of its stages are reported by the
+ * 'profile' read handler, and restarted from 0 by 'resetstats' too.
+ *
+ * Messages printed on the console are filtered by 'loglevel' (default:
+ * info). Per-packet debug messages are compiled in only when the
+ * package is configured with `--enable-debug-trace`.
  */
 
+#if HAVE_BATCH
+class UPFRouter : public BatchElement {
+#else
 class UPFRouter : public Element {
+#endif
   public:
-    UPFRouter(){};
-    ~UPFRouter(){};
+    UPFRouter()
+        : mUEMapUpdateTask(this), mMatchMapTimer(this), mAgingTimer(this){};
+    ~UPFRouter() { delete mMatchMap.load(); };
 
     // clang-format off
     const char *class_name() const { return "UPFRouter"; }
@@ -63,6 +250,9 @@ class UPFRouter : public Element {
     // Implement the Element interface
     virtual int configure(Vector<String> &conf, ErrorHandler *errh) override;
     virtual int initialize(ErrorHandler *errh) override;
+    virtual void cleanup(CleanupStage stage) override;
+    virtual void run_timer(Timer *timer) override;
+    virtual bool run_task(Task *task) override;
 
     // Note: overriding Click's Element::simple_action() is not
     //       enough, as we also need to know the source port of the
@@ -86,32 +276,627 @@ class UPFRouter : public Element {
         return p;
     }
 
+#if HAVE_BATCH
+    // Note: classify all the packets of the batch first, then push
+    //       them out grouped by output port.
+    virtual void push_batch(int port, PacketBatch *batch) override;
+#endif
+
     // Note: this is just like Click's Element::simple_action(), but
     //       is passed also the input port of the packet.
     Packet *simple_action_extended(Packet *p, int inputPort);
 
+    /// @brief Add 'count' UEs to the UEMap, as if they had been seen
+    ///        in S1AP traffic (e.g. to seed it for load testing, see
+    ///        UPFGTPTrafficGen). Unless 'inplaceencap' is false, they
+    ///        go only into the data path copy (see mUETunnels).
+    ///
+    /// @return the number of UEs that don't fit in the UEMap ('invalid'
+    ///         is set to the number of those skipped for having
+    ///         address 0)
+    std::size_t addUEs(const UPFUEMapRecord *records, std::size_t count,
+                       std::size_t &invalid);
+
+    /// @brief Callback run on a UEMap entry about to be removed
+    ///        because S1AP released it: returns false to keep it
+    using UEMapEraseCallback = std::function<bool(
+        std::pair<const NetworkLib::IPv4Address,
+                  UPFRouterLib::GTPv1UTunnelInfo> &)>;
+
+    /// @brief Set the callback run before removing an entry of the
+    ///        UEMap on S1AP releases (like
+    ///        UPFRouterLib::Router::beforeUEMapUpsert())
+    void beforeUEMapErase(UEMapEraseCallback callback) {
+        mBeforeUEMapErase = std::move(callback);
+    }
+
     void add_handlers();
 
   private:
+    /// @brief Runs the stages of the data path in isolation
+    friend class UPFMicroBench;
+
+    /// @brief The router handling S1AP traffic, and thus owning the
+    ///        UEMap (in thread-safe mode, it's guarded by mUEMapMutex)
     UPFRouterLib::Router mRouter;
 
+    /// @brief Maximum number of output ports
+    static const int MAX_OUTPUTS = 4;
+
+#if HAVE_BATCH
+    /// @brief Packets of the batch being classified, waiting to be
+    ///        pushed down an output port (as a simple list).
+    struct PendingBatch {
+        Packet *head;
+        Packet *tail;
+        unsigned count;
+    };
+#endif
+
+    /// @brief Paths through the element, counted separately (a packet
+    ///        can take more than one, e.g. GTPU_FORWARDED then
+    ///        FORWARDED)
+    enum Path {
+        /// @brief S1AP traffic, forwarded to the other side
+        PATH_S1AP_FORWARDED,
+        /// @brief Other traffic, forwarded to the other side
+        PATH_FORWARDED,
+        /// @brief GTPv1-U traffic diverted to port 2
+        PATH_GTPU_DIVERTED,
+        /// @brief GTPv1-U traffic of unknown UEs or not in the MatchMap
+        PATH_GTPU_FORWARDED,
+        /// @brief GTPv1-U traffic with unexpected headers
+        PATH_GTPU_MALFORMED,
+        /// @brief Traffic from port 2 encapsulated towards the EPC
+        PATH_ENCAP_TO_EPC,
+        /// @brief Traffic from port 2 encapsulated towards an eNodeB
+        PATH_ENCAP_TO_ENB,
+        /// @brief Traffic that failed encapsulation (dropped)
+        PATH_ENCAP_FAILED,
+        /// @brief Plain IPv4 traffic of an unknown UE
+        PATH_UNKNOWN_UE,
+        /// @brief Plain IPv4 traffic of unknown UEs from port 0 or 1,
+        ///        forwarded
+        PATH_PLAIN_FORWARDED,
+        /// @brief Plain IPv4 traffic of unknown UEs from port 2,
+        ///        dropped
+        PATH_PLAIN_DROPPED,
+        /// @brief Non-IPv4 traffic (dropped)
+        PATH_NON_IPV4,
+        /// @brief Transit traffic from port 0 or 1 that skipped the
+        ///        router, forwarded
+        PATH_BYPASSED,
+        /// @brief SCTP traffic forwarded without being decoded, as
+        ///        the queue of the S1AP thread was full
+        PATH_S1AP_OVERFLOW,
+        NUM_PATHS
+    };
+
+    /// @brief Number of buckets of the latency histograms: bucket i
+    ///        counts packets taking [2^(i-1), 2^i) cycles, but the
+    ///        last one counts those taking 2^(i-1) cycles or more
+    static const int NUM_LATENCY_BUCKETS = 40;
+
+    /// @brief Header of an SCTP packet queued for the S1AP thread (its
+    ///        bytes follow)
+    struct alignas(8) S1APPacket {
+        /// @brief The input port it came from
+        int port;
+    };
+
+    /// @brief Counters of a thread (only written by that thread)
+    struct Stats {
+        uint64_t packets[NUM_PATHS];
+        uint64_t bytes[NUM_PATHS];
+        uint64_t latency[NUM_LATENCY_BUCKETS];
+    };
+
+    /// @brief State private to each Click thread pushing packets
+    struct ThreadState {
+        /// @brief Use 'sharedRouter', or a router of our own if null
+        explicit ThreadState(UPFRouterLib::Router *sharedRouter)
+            : ownRouter(sharedRouter ? nullptr : new UPFRouterLib::Router()),
+              router(sharedRouter ? *sharedRouter : *ownRouter),
+              encapSink(ipv4Tap, ipv4WriteBuffer, router,
+                        identificationSource) {}
+
+        std::unique_ptr<UPFRouterLib::Router> ownRouter;
+
+        /// @brief Router for non-S1AP traffic
+        UPFRouterLib::Router &router;
+
+        NetworkLib::BufferWritableView ipv4WriteBuffer = {
+            NetworkLib::BufferWritableView::makeIPv4Buffer()};
+        NetworkLib::IPv4PacketTap ipv4Tap;
+
+        NetworkLib::IPv4IdentificationSource identificationSource;
+
+        UPFRouterLib::GTPv1UEncapSink encapSink;
+
+        /// @brief IPv4 Identification of the next packet encapsulated
+        ///        in place
+        uint16_t ipv4Identification = 0;
+
+#if HAVE_BATCH
+        /// @brief True while classifying the packets of a batch
+        bool inBatch = false;
+
+        PendingBatch pendingBatches[MAX_OUTPUTS] = {};
+#endif
+
+        /// @brief True if the packet being processed is S1AP traffic
+        bool s1apPacket = false;
+
+        /// @brief Copies of SCTP packets, for the S1AP thread
+        UPFSPSCByteRing s1apQueue;
+
+        Stats stats = {};
+
+#ifdef UPF_PROFILE
+        UPFProfiler profiler;
+#endif
+    };
+
+    /// @brief State of each Click thread (just one, unless mThreadSafe)
+    std::vector<std::unique_ptr<ThreadState>> mThreadStates;
+
+    /// @brief True if more than one Click thread may push packets
+    bool mThreadSafe = false;
+
+    /// @brief Serializes the writers of the UEMap in thread-safe mode
+    ///        or with the S1AP thread
+    std::mutex mUEMapMutex;
+
+    /// @brief Return the index of the state of the current Click
+    ///        thread
+    unsigned threadIndex() const {
+        return mThreadSafe ? click_current_cpu_id() : 0;
+    }
+
+    /// @brief Return the state of the current Click thread
+    ThreadState &threadState() { return *mThreadStates[threadIndex()]; }
+
+    /// @brief Lock mUEMapMutex (in thread-safe mode or with the S1AP
+    ///        thread only)
+    std::unique_lock<std::mutex> lockUEMap() {
+        return (mThreadSafe || mDoAsyncS1AP)
+                   ? std::unique_lock<std::mutex>(mUEMapMutex)
+                   : std::unique_lock<std::mutex>();
+    }
+
+    /// @brief Like lockUEMap(), but don't wait for it, e.g. while the
+    ///        S1AP thread decodes a packet: on a Click thread, rather
+    ///        try again later
+    ///
+    /// @return false if the UEMap is locked by someone else
+    bool tryLockUEMap(std::unique_lock<std::mutex> &lock) {
+        if (mThreadSafe || mDoAsyncS1AP) {
+            lock = std::unique_lock<std::mutex>(mUEMapMutex, std::try_to_lock);
+            return lock.owns_lock();
+        }
+        return true;
+    }
+
+    /// @brief Set up the callbacks handling traffic in 'router'
+    void setUpTrafficCallbacks(UPFRouterLib::Router &router);
+
+    /// @name S1AP thread
+    ///
+    ///@{
+
+    /// @brief Decode S1AP traffic on the S1AP thread
+    bool mDoAsyncS1AP = false;
+
+    std::thread mS1APThread;
+
+    /// @brief Tells the S1AP thread to stop (once its queues are
+    ///        empty)
+    std::atomic<bool> mS1APStopping = {false};
+
+    /// @brief Set by the S1AP thread when it's about to return
+    std::atomic<bool> mS1APThreadDone = {false};
+
+    /// @brief A UEMap change for the data path copy
+    struct UEMapUpdate {
+        /// @brief The entry added/updated (just its UE, if erase)
+        UPFUEMapRecord record;
+
+        /// @brief True if the entry was removed
+        bool erase;
+    };
+
+    /// @brief UEMap changes made by the S1AP thread, for the data path
+    ///        copy
+    UPFSPSCQueue<UEMapUpdate> mUEMapUpdates;
+
+    /// @brief UEMap changes made by the S1AP thread with the UEMap
+    ///        locked, published once it's unlocked
+    std::vector<UEMapUpdate> mPendingUEMapUpdates;
+
+    /// @brief Task applying mUEMapUpdates
+    Task mUEMapUpdateTask;
+
+    /// @brief Capacity of the S1AP queue of each Click thread (bytes)
+    static const std::size_t S1AP_QUEUE_SIZE = 1 << 20;
+
+    /// @brief Capacity of mUEMapUpdates
+    static const std::size_t UEMAP_UPDATE_QUEUE_SIZE = 4096;
+
+    /// @brief Maximum number of UEMap changes applied per task run
+    static const std::size_t UEMAP_UPDATE_BUDGET = 256;
+
+    /// @brief Forward an SCTP packet to the other side, queueing a
+    ///        copy of it for the S1AP thread
+    void forwardS1APPacket(ThreadState &ts, Packet *p, int inputPort);
+
+    /// @brief Body of the S1AP thread
+    void runS1APThread();
+
+    /// @brief Stop the S1AP thread (if running), waiting for it
+    void stopS1APThread();
+
+    /// @brief Queue a UEMap change for the data path copy (S1AP thread
+    ///        only, never with the UEMap locked), waiting for room if
+    ///        needed
+    void publishUEMapUpdate(const UEMapUpdate &update);
+
+    /// @brief Publish mPendingUEMapUpdates (S1AP thread only, never
+    ///        with the UEMap locked)
+    void publishPendingUEMapUpdates();
+
+    /// @brief Apply up to 'budget' queued UEMap changes, with the UEMap
+    ///        locked. If it's locked by someone else, return right
+    ///        away, unless 'wait'.
+    ///
+    /// @return the number of changes applied
+    std::size_t applyUEMapUpdates(std::size_t budget, bool wait);
+
+    ///@}
+
+    /// @brief Record CPU cycles spent per packet
+    bool mDoLatencyStats = false;
+
+    /// @brief Counters at the last 'resetstats' (summed over threads)
+    Stats mStatsBaseline = {};
+
+    /// @brief Count a packet of 'bytes' bytes through 'path'
+    void countPath(Path path, std::size_t bytes) {
+        Stats &stats = threadState().stats;
+        ++stats.packets[path];
+        stats.bytes[path] += bytes;
+    }
+
+    /// @brief Sum the counters of all threads (since the start, i.e.
+    ///        ignoring mStatsBaseline)
+    Stats sumStats() const;
+
+    /// @brief Push a packet down an output port (or queue it, if a
+    ///        batch is being classified).
+    void outputPacket(int port, Packet *p);
+
+    /// @brief Make a new Click Packet (with IPv4 annotations) out of
+    ///        the content of a BufferView, by copying data
+    static WritablePacket *
+    makeWritablePacket(const NetworkLib::BufferView &bufferView,
+                       std::size_t headroom = 0);
+
+    /// @brief MatchMap rules, as changed by the write handlers (the
+    ///        data path uses mMatchMap instead)
     UPFRouterLib::RuleMatcher mRuleMatcher;
 
-    NetworkLib::BufferWritableView mIPv4WriteBuffer = {
-        NetworkLib::BufferWritableView::makeIPv4Buffer()};
-    NetworkLib::IPv4PacketTap mIPv4Tap;
+    /// @brief A MatchMap rule, as parsed for UPFMatchClassifier
+    struct ClassifierRule {
+        UPFMatchClassifier::Rule rule;
+
+        /// @brief False if UPFMatchClassifier can't parse the rule
+        bool valid;
+    };
+
+    /// @brief Parse a MatchMap rule for UPFMatchClassifier
+    static ClassifierRule parseClassifierRule(const String &rule);
+
+    /// @brief The rules of mRuleMatcher (in the same order), parsed by
+    ///        the write handlers along with them
+    std::vector<ClassifierRule> mClassifierRules;
+
+    /// @brief Guards mRuleMatcher, mClassifierRules, mNextMatchMap
+    ///        and the retired MatchMap snapshots
+    std::mutex mMatchMapMutex;
+
+    /// @brief A MatchMap snapshot, never changed once published
+    struct MatchMapSnapshot {
+        UPFRouterLib::RuleMatcher ruleMatcher;
+
+        /// @brief Compiled form of ruleMatcher
+        UPFMatchClassifier classifier;
+
+        /// @brief False if some rule can't be compiled (ruleMatcher is
+        ///        scanned instead)
+        bool classifierValid = false;
+    };
+
+    /// @brief Current MatchMap snapshot, used on the data path
+    std::atomic<const MatchMapSnapshot *> mMatchMap = {nullptr};
+
+    /// @brief Snapshot built by the write handlers, waiting for
+    ///        mMatchMapTimer to swap it in
+    std::unique_ptr<MatchMapSnapshot> mNextMatchMap;
+
+    /// @brief Readers of mMatchMap (one per thread state)
+    UPFEpochDomain mMatchMapEpochs;
 
-    NetworkLib::IPv4IdentificationSource mIdentificationSource;
+    /// @brief Timer swapping in mNextMatchMap, then releasing the old
+    ///        snapshots (it never waits for mMatchMapMutex)
+    Timer mMatchMapTimer;
 
-    UPFRouterLib::GTPv1UEncapSink mGTPEncapSink = {
-        mIPv4Tap, mIPv4WriteBuffer, mRouter, mIdentificationSource};
+    /// @brief Interval between attempts to release old snapshots (or
+    ///        to lock mMatchMapMutex)
+    static const uint32_t MATCHMAP_RECLAIM_INTERVAL_MS = 10;
+
+    /// @brief Build a snapshot of mRuleMatcher, for mMatchMapTimer to
+    ///        swap in (mMatchMapMutex held)
+    void publishMatchMap();
+
+    /// @brief Have mMatchMapTimer swap in 'matchMap' (mMatchMapMutex
+    ///        held)
+    void scheduleMatchMapSwap(MatchMapSnapshot *matchMap);
+
+    /// @brief Build a snapshot of 'rules', compiling 'classifierRules'
+    ///        (their parsed form) into its classifier (no lock needed)
+    MatchMapSnapshot *buildMatchMapSnapshot(
+        const UPFRouterLib::RuleMatcher &rules,
+        const std::vector<ClassifierRule> &classifierRules) const;
+
+    /// @brief Swap in 'matchMap' as the current snapshot, retiring the
+    ///        old one (mMatchMapMutex held)
+    void installMatchMapSnapshot(MatchMapSnapshot *matchMap);
+
+    /// @brief True if the IPv4 traffic encapsulated in GTPv1-U (whose
+    ///        header is 'innerIp') matches some rule in the MatchMap
+    bool matchesMatchMap(const click_ip *innerIp,
+                         const NetworkLib::BufferView &encapIpv4Data);
+
+    /// @brief True if GTPv1-U traffic (through the tunnel to endpoint
+    ///        'tunnelAddress' with TEID 'teid', towards the EPC or
+    ///        not) is from/to the known UE 'ueAddress'. All values are
+    ///        in network byte order.
+    bool isTrafficOfKnownUE(NetworkLib::EthPacketProcessor::Context &context,
+                            uint32_t ueAddress, uint32_t tunnelAddress,
+                            uint32_t teid, bool epcEndPoint);
 
     bool mDoEnableUnknownTrafficDump = true;
 
+    /// @brief Decapsulate GTPv1-U traffic for port 2 in place
+    bool mDoZeroCopyDecap = true;
+
+    /// @brief Encapsulate traffic from port 2 in place
+    bool mDoInPlaceEncap = true;
+
+    /// @brief Transit traffic, forwarded without the router
+    UPFTransitClassifier mBypass;
+
+    /// @brief True if mBypass isn't empty
+    bool mDoBypass = false;
+
+    /// @brief Compute UDP checksums when encapsulating in place
+    bool mDoEnableUDPChecksum = true;
+
+    /// @brief GTPv1-U tunnel endpoints of a known UE, in network byte
+    ///        order (i.e. ready to be written into outer headers)
+    struct UETunnelEndPoints {
+        uint32_t eNBAddress;
+        uint32_t eNBTeid;
+        uint32_t epcAddress;
+        uint32_t epcTeid;
+
+        /// @brief Aging tick the UE was last seen at (from port 2)
+        uint32_t lastSeen;
+
+        /// @brief Aging tick the UE is scheduled to be checked at
+        uint32_t agingExpiry;
+    };
+
+    /// @brief Entry of the secondary indexes of mUETunnels
+    struct UEIndexEntry {
+        /// @brief UE address (network byte order)
+        uint32_t ueAddress;
+
+        /// @brief Aging tick the UE was last seen at (through this
+        ///        tunnel)
+        uint32_t lastSeen;
+    };
+
+    /// @brief Copy of the UEMap keyed by UE address (in network byte
+    ///        order), kept up-to-date along with the UEMap. The data
+    ///        path looks up UEs here (with lookup(), so it doesn't
+    ///        race with the UEMap writer); mRouter.getUEMap() stays
+    ///        the reference copy, but for UEs added by addUEs() (e.g.
+    ///        from a snapshot), which are only here until S1AP sets
+    ///        them up again.
+    UPFFlatHashTable<uint32_t, UETunnelEndPoints> mUETunnels;
+
+    ///@name Secondary indexes of mUETunnels by GTPv1-U tunnel, keyed by
+    ///      makeTEIDKey(endpoint address, TEID)
+    ///
+    ///@{
+
+    /// @brief UEs by EPC endpoint (uplink traffic)
+    UPFFlatHashTable<uint64_t, UEIndexEntry> mEPCTEIDs;
+
+    /// @brief UEs by eNodeB endpoint (downlink traffic)
+    UPFFlatHashTable<uint64_t, UEIndexEntry> mENBTEIDs;
+
+    ///@}
+
+    ///@name Idle UE aging
+    ///
+    ///@{
+
+    /// @brief Idle time after which UEs are removed (in aging ticks,
+    ///        i.e. seconds; 0 to never remove them)
+    uint32_t mUEMapIdleTimeout = 0;
+
+    /// @brief Current aging tick (seconds since initialize(), from 1),
+    ///        read by the data path
+    std::atomic<uint32_t> mAgingNow = {1};
+
+    /// @brief Time of aging tick 0
+    Timestamp mAgingStart;
+
+    /// @brief Timer advancing the aging tick and checking idle UEs
+    Timer mAgingTimer;
+
+    /// @brief UEs (by address) to check for idleness, by aging tick
+    UPFTimerWheel mAgingWheel;
+
+    /// @brief Number of UEs removed for being idle
+    std::atomic<uint64_t> mUEMapEvictions = {0};
+
+    /// @brief Maximum number of UEs checked per timer run
+    static const std::size_t UEMAP_AGING_BUDGET = 1024;
+
+    /// @brief Delay before checking idle UEs again, when the UEMap was
+    ///        locked by someone else
+    static const uint32_t UEMAP_AGING_RETRY_MS = 10;
+
+    /// @brief Look up 'key' in 'table' (mUETunnels or one of its
+    ///        indexes), recording that its UE was just seen into the
+    ///        'lastSeen' field of the entry if touchIf(entry). A stamp
+    ///        that hits another UE, moved into the slot meanwhile, at
+    ///        worst postpones its removal by one idle timeout.
+    template <typename Table, typename Key, typename Entry, typename P>
+    bool lookupAndTouchUE(Table &table, Key key, Entry &entry, P touchIf) {
+        if (mUEMapIdleTimeout == 0) {
+            return table.lookup(key, entry);
+        }
+
+        return table.lookupAndStamp(
+            key, entry, &Entry::lastSeen,
+            mAgingNow.load(std::memory_order_relaxed), touchIf);
+    }
+
+    /// @brief lookupAndTouchUE() of the UE of any entry found
+    template <typename Table, typename Key, typename Entry>
+    bool lookupAndTouchUE(Table &table, Key key, Entry &entry) {
+        return lookupAndTouchUE(table, key, entry,
+                                [](const Entry &) { return true; });
+    }
+
+    /// @brief Advance the aging tick and check (some) idle UEs
+    void runUEMapAging();
+
+    /// @brief Check whether the UE scheduled to be checked at tick
+    ///        'expiry' has been idle too long, and remove it if so
+    void ageUE(uint32_t ueAddress, uint32_t expiry, uint32_t now);
+
+    ///@}
+
+    ///@name UEMap entries removed on S1AP releases
+    ///
+    ///@{
+
+    /// @brief An E-RAB set up through S1AP, carrying the traffic of a
+    ///        UE (address)
+    struct S1APBearer {
+        /// @brief Address of the UE (network byte order)
+        uint32_t ueAddress;
+
+        /// @brief E-RAB ID, or -1 if unknown
+        int eRABId;
+    };
+
+    /// @brief Return the key of a UE association in mS1APBearers
+    static uint64_t makeS1APUEKey(uint32_t mmeAddress, uint32_t mmeUEId) {
+        return (static_cast<uint64_t>(mmeAddress) << 32) | mmeUEId;
+    }
+
+    /// @brief E-RABs of each UE association (keyed by makeS1APUEKey()
+    ///        of MME address and MME UE S1AP ID), one per UE address
+    std::unordered_multimap<uint64_t, S1APBearer> mS1APBearers;
+
+    /// @brief Key in mS1APBearers of each UE address
+    std::unordered_map<uint32_t, uint64_t> mS1APUEKeys;
+
+    /// @brief Maximum number of S1AP messages peeked at per packet
+    static const std::size_t MAX_S1AP_MESSAGES = 8;
+
+    /// @brief S1AP messages of the packet being decoded by mRouter
+    UPFS1APMessage mS1APMessages[MAX_S1AP_MESSAGES];
+    std::size_t mNumS1APMessages = 0;
+
+    UEMapEraseCallback mBeforeUEMapErase;
+
+    /// @brief Number of UEs removed on S1AP releases (counted by the
+    ///        S1AP thread, if any)
+    std::atomic<uint64_t> mUEMapReleases = {0};
+
+    /// @brief Decode an S1AP packet through mRouter (with the UEMap
+    ///        locked), then remove the UEs it releases
+    void consumeS1APPacket(const NetworkLib::BufferView &buffer,
+                           NetworkLib::ContextUserData &userData,
+                           const unsigned char *data, uint32_t length);
+
+    /// @brief Record which UE association and E-RAB the tunnel of a UE
+    ///        (just upserted, with eNodeB TEID 'eNBTeid') belongs to,
+    ///        according to the messages in mS1APMessages
+    void trackS1APBearer(uint32_t ueAddress, uint32_t eNBTeid);
+
+    /// @brief Stop tracking the E-RAB of a UE
+    void forgetS1APBearer(uint32_t ueAddress);
+
+    /// @brief Remove the UEs whose E-RABs 'message' releases
+    void releaseS1APBearers(const UPFS1APMessage &message);
+
+    /// @brief Remove a UE from the UEMap (through mBeforeUEMapErase)
+    void eraseUE(uint32_t ueAddress);
+
+    ///@}
+
+    /// @brief Remove an entry of mUETunnels (and of its indexes)
+    void eraseRawUETunnel(uint32_t ueAddress);
+
+    /// @brief Add/update an entry of mUETunnels (and of its indexes)
+    void cacheUETunnel(const NetworkLib::IPv4Address &ueAddress,
+                       const UPFRouterLib::GTPv1UTunnelInfo &tunnelInfo);
+
+    /// @brief Add/update an entry of mUETunnels (and of its indexes),
+    ///        given in network byte order
+    ///
+    /// @return false if mUETunnels is full
+    bool cacheRawUETunnel(uint32_t ueAddress,
+                          const UETunnelEndPoints &endPoints);
+
+    /// @brief Snapshot file the UEMap is restored from/saved into
+    String mUEMapFile;
+
+    /// @brief Save the UEMap into the snapshot 'fileName'
+    int saveUEMap(const String &fileName, ErrorHandler *errh);
+
+    /// @brief Add the entries of the snapshot 'fileName' to the UEMap
+    int loadUEMap(const String &fileName, ErrorHandler *errh);
+
+    /// @brief Workaround for changing TEIDs: update the EPC (or eNodeB)
+    ///        TEID of a UE in mUETunnels (and in the UEMap). Address
+    ///        and TEID are in network byte order.
+    void updateUETEID(uint32_t ueAddress, bool epcEndPoint, uint32_t teid);
+
+    /// @brief Current trace level (see upftrace.hh)
+    int mTraceLevel = UPF_TRACE_INFO;
+
     ///@brief Handles GTPv1-U traffic
     bool handleInterceptedGTPv1UTraffic(
         NetworkLib::EthPacketProcessor::Context &context);
 
+    ///@brief Decapsulate GTPv1-U traffic and push it down port 2
+    void pushDecapsulated(NetworkLib::EthPacketProcessor::Context &context,
+                          const NetworkLib::BufferView &encapIpv4Data);
+
+    ///@brief Encapsulate in place IPv4 traffic to/from a known UE and
+    ///       push it down port 0 or 1.
+    ///
+    ///@return false if the UE is unknown (the packet is untouched)
+    bool pushEncapsulated(Packet *p);
+
     ///@brief Handles plain IPv4 traffic
     bool
     handleIPv4PostProcess(NetworkLib::EthPacketProcessor::Context &context);
@@ -129,13 +914,81 @@ class UPFRouter : public Element {
     ///
     ///@{
 
-    ///@brief Return UEMap content
-    String rh_UEMap(void *vparam);
+    ///@brief Return UEMap content, or just the part selected by the
+    ///       handler parameters (passed in 'data', which is replaced
+    ///       by the content)
+    int rh_UEMap(String &data, ErrorHandler *errh);
+
+    /// @brief Entries returned by the 'uemap' handler without 'count'
+    static const uint32_t UEMAP_PAGE_SIZE = 1000;
+
+    /// @brief Slots of the UEMap copy walked per 'uemap' read at most,
+    ///        however few entries match, so one read can't hold the
+    ///        UEMap lock for long
+    static const std::size_t UEMAP_PAGE_SLOTS = 65536;
 
     ///@brief Glue code
-    static String read_handler_UEMap(Element *e, void *vparam) {
+    static int read_handler_UEMap(int, String &data, Element *e,
+                                  const Handler *, ErrorHandler *errh) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.rh_UEMap(data, errh);
+    }
+
+    ///@}
+
+    ///@name Click's write handlers for UEMap snapshots
+    ///
+    ///@{
+
+    /// @brief Save the UEMap into a snapshot file
+    int wh_UEMap_save(const String &str, void *vparam, ErrorHandler *errh);
+
+    /// @brief Glue code
+    static int write_handler_UEMap_save(const String &str, Element *e,
+                                        void *vparam, ErrorHandler *errh) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.wh_UEMap_save(str, vparam, errh);
+    }
+
+    /// @brief Add the entries of a snapshot file to the UEMap
+    int wh_UEMap_load(const String &str, void *vparam, ErrorHandler *errh);
+
+    /// @brief Glue code
+    static int write_handler_UEMap_load(const String &str, Element *e,
+                                        void *vparam, ErrorHandler *errh) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.wh_UEMap_load(str, vparam, errh);
+    }
+
+    ///@}
+
+    ///@name Click's read handler for the number of idle UEs removed
+    ///
+    ///@{
+
+    /// @brief Return the number of UEs removed for being idle
+    String rh_UEMapEvictions(void *vparam);
+
+    /// @brief Glue code
+    static String read_handler_UEMapEvictions(Element *e, void *vparam) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.rh_UEMapEvictions(vparam);
+    }
+
+    ///@}
+
+    ///@name Click's read handler for the number of UEs removed on S1AP
+    ///      releases
+    ///
+    ///@{
+
+    /// @brief Return the number of UEs removed on S1AP releases
+    String rh_UEMapReleases(void *vparam);
+
+    /// @brief Glue code
+    static String read_handler_UEMapReleases(Element *e, void *vparam) {
         UPFRouter &self = *(static_cast<UPFRouter *>(e));
-        return self.rh_UEMap(vparam);
+        return self.rh_UEMapReleases(vparam);
     }
 
     ///@}
@@ -189,7 +1042,7 @@ class UPFRouter : public Element {
         return self.wh_MatchMap_delete(str, vparam, errh);
     }
 
-    /// @brief Delete the rule at the given position
+    /// @brief Delete all the rules
     int wh_MatchMap_clear(const String &str, void *vparam, ErrorHandler *errh);
 
     /// @brief Glue code
@@ -199,6 +1052,19 @@ class UPFRouter : public Element {
         return self.wh_MatchMap_clear(str, vparam, errh);
     }
 
+    /// @brief Replace all the rules at once, with the ones given (or
+    ///        read from the file given after 'file')
+    int wh_MatchMap_replace(const String &str, void *vparam,
+                            ErrorHandler *errh);
+
+    /// @brief Glue code
+    static int write_handler_MatchMap_replace(const String &str, Element *e,
+                                              void *vparam,
+                                              ErrorHandler *errh) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.wh_MatchMap_replace(str, vparam, errh);
+    }
+
     ///@}
 
     ///@name Click's write handler for enabling/disabling UPD checksums
@@ -241,6 +1107,100 @@ class UPFRouter : public Element {
     }
 
     ///@}
+
+    ///@name Click's handlers for counters and latency histograms
+    ///
+    ///@{
+
+    /// @brief Return packets/bytes counters for each path
+    String rh_stats(void *vparam);
+
+    /// @brief Glue code
+    static String read_handler_stats(Element *e, void *vparam) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.rh_stats(vparam);
+    }
+
+    /// @brief Return the latency histogram
+    String rh_latency(void *vparam);
+
+    /// @brief Glue code
+    static String read_handler_latency(Element *e, void *vparam) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.rh_latency(vparam);
+    }
+
+#ifdef UPF_PROFILE
+    /// @brief Profile counters at the last 'resetstats' (summed over
+    ///        threads)
+    UPFProfileCounters mProfileBaseline[UPF_NUM_STAGES] = {};
+
+    /// @brief Sum the profile counters of 'stage' over all threads
+    UPFProfileCounters sumProfile(int stage) const;
+
+    /// @brief Return the cost of each stage of the data path
+    String rh_profile(void *vparam);
+
+    /// @brief Glue code
+    static String read_handler_profile(Element *e, void *vparam) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.rh_profile(vparam);
+    }
+#endif
+
+    /// @brief Peek at S1AP traffic before decoding it
+    bool mDoS1APFilter = false;
+
+    UPFS1APFilter mS1APFilter;
+
+    /// @brief S1AP filter counters at the last 'resetstats'
+    UPFS1APFilter::Counters mS1APFilterBaseline = {};
+
+    /// @brief Return the S1AP filter counters
+    String rh_s1apFilter(void *vparam);
+
+    /// @brief Glue code
+    static String read_handler_s1apFilter(Element *e, void *vparam) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.rh_s1apFilter(vparam);
+    }
+
+    /// @brief Restart counters and latency histogram from 0
+    int wh_resetStats(const String &str, void *vparam, ErrorHandler *errh);
+
+    /// @brief Glue code
+    static int write_handler_resetStats(const String &str, Element *e,
+                                        void *vparam, ErrorHandler *errh) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.wh_resetStats(str, vparam, errh);
+    }
+
+    ///@}
+
+    ///@name Click's read/write handlers for the trace level
+    ///
+    ///@{
+
+    /// @brief Return the current trace level
+    String rh_logLevel(void *vparam);
+
+    /// @brief Glue code
+    static String read_handler_logLevel(Element *e, void *vparam) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.rh_logLevel(vparam);
+    }
+
+    /// @brief Set the trace level
+    int wh_logLevel(const String &str, void *vparam, ErrorHandler *errh);
+
+    /// @brief Glue code
+    static int write_handler_logLevel(const String &str, Element *e,
+                                      void *vparam, ErrorHandler *errh) {
+        UPFRouter &self = *(static_cast<UPFRouter *>(e));
+        return self.wh_logLevel(str, vparam, errh);
+    }
+
+    ///@}
 };
 
 // clang-format off
@@ -0,0 +1,132 @@
+/*
+ * upfs1apfilter.{cc,hh} -- pre-filter of the S1AP traffic decoded by
+ * UPFRouter
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfs1apfilter.hh"
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+/// @brief S1AP procedures that change tunnels
+static const uint8_t relevantProcedures[] = {
+    S1AP_PROC_HANDOVER_RESOURCE_ALLOCATION,
+    S1AP_PROC_PATH_SWITCH_REQUEST,
+    S1AP_PROC_E_RAB_SETUP,
+    S1AP_PROC_E_RAB_MODIFY,
+    S1AP_PROC_E_RAB_RELEASE,
+    S1AP_PROC_E_RAB_RELEASE_INDICATION,
+    S1AP_PROC_INITIAL_CONTEXT_SETUP,
+    S1AP_PROC_UE_CONTEXT_RELEASE,
+};
+
+static bool isRelevantProcedure(uint8_t procedureCode) {
+    for (const uint8_t code : relevantProcedures) {
+        if (code == procedureCode) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool UPFS1APFilter::mustDecode(const click_ip *ip, std::size_t length) {
+    int procedure = PROCEDURE_NO_DATA;
+    const bool decode = classify(ip, length, procedure);
+
+    (decode ? mDecoded : mSkipped)[procedure].fetch_add(
+        1, std::memory_order_relaxed);
+    return decode;
+}
+
+bool UPFS1APFilter::classify(const click_ip *ip, std::size_t length,
+                             int &procedure) {
+    bool decode = false;
+
+    procedure = PROCEDURE_NO_DATA;
+
+    const bool walked =
+        upfForEachSCTPChunk(ip, length, [&](const UPFSCTPChunk &chunk) {
+            if (chunk.type == SCTP_CHUNK_DATA) {
+                int chunkProcedure;
+
+                if (classifyDataChunk(chunk, chunkProcedure)) {
+                    procedure = chunkProcedure;
+                    decode = true;
+                    return false;
+                }
+
+                // Skipped so far: counted as its first message
+                if (procedure == PROCEDURE_NO_DATA) {
+                    procedure = chunkProcedure;
+                }
+            } else if (chunk.type == SCTP_CHUNK_IDATA) {
+                procedure = PROCEDURE_OTHER;
+                decode = true;
+                return false;
+            }
+            return true;
+        });
+
+    if (!walked) {
+        procedure = PROCEDURE_OTHER;
+        return true;
+    }
+
+    return decode;
+}
+
+bool UPFS1APFilter::classifyDataChunk(const UPFSCTPChunk &chunk,
+                                      int &procedure) {
+    procedure = PROCEDURE_OTHER;
+
+    // The S1AP-PDU starts with its type and procedure code, but only
+    // in the first fragment of a message.
+    if (chunk.payloadLength < 2 || !(chunk.flags & SCTP_DATA_FLAG_BEGIN) ||
+        chunk.ppid != S1AP_PPID) {
+        return true;
+    }
+
+    // Aligned PER: the extension bit and the 2-bit index of the
+    // S1AP-PDU choice, then the procedure code (INTEGER (0..255)) in
+    // the next octet.
+    const uint8_t *pdu = chunk.payload;
+
+    if (pdu[0] & 0x80) {
+        return true;
+    }
+
+    const unsigned pduType = (pdu[0] >> 5) & 0x03;
+    procedure = pdu[1];
+
+    return pduType != S1AP_PDU_UNSUCCESSFUL_OUTCOME &&
+           isRelevantProcedure(pdu[1]);
+}
+
+void UPFS1APFilter::read(Counters &counters) const {
+    for (int i = 0; i < NUM_PROCEDURES; ++i) {
+        counters.decoded[i] = mDecoded[i].load(std::memory_order_relaxed);
+        counters.skipped[i] = mSkipped[i].load(std::memory_order_relaxed);
+    }
+}
+
+String UPFS1APFilter::unparseProcedure(int procedure) {
+    switch (procedure) {
+    case PROCEDURE_OTHER:
+        return "other";
+    case PROCEDURE_NO_DATA:
+        return "no_data";
+    default:
+        return String(procedure);
+    }
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_PROVIDES(UPFS1APFilter)
+// clang-format on
@@ -0,0 +1,91 @@
+#ifndef CLICK_UPFS1APFILTER_HH
+#define CLICK_UPFS1APFILTER_HH
+
+// clang-format off
+#include <click/string.hh>
+#include <clicknet/ip.h>
+CLICK_DECLS
+// clang-format on
+
+#include "upfs1appeek.hh"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Pre-filter of the S1AP traffic worth decoding for the UEMap.
+ *
+ * Only a few S1AP procedures set up, change or release GTPv1-U
+ * tunnels: Handover Resource Allocation, Path Switch, E-RAB Setup,
+ * E-RAB Modify, E-RAB Release (and Release Indication), Initial
+ * Context Setup and UE Context Release. Everything else (e.g. Paging,
+ * NAS transport, Reset) is just forwarded.
+ *
+ * An SCTP packet is peeked at without any ASN.1 decoding: for each
+ * DATA chunk carrying S1AP (payload protocol 18), the first two bytes
+ * of the aligned PER encoding of the S1AP-PDU give its type
+ * (initiatingMessage, successfulOutcome or unsuccessfulOutcome) and
+ * the procedure code. The packet is skipped only if none of its
+ * chunks is relevant: unsuccessful outcomes never are, and neither
+ * are packets without DATA chunks (e.g. SACK or HEARTBEAT). Anything
+ * that can't be peeked at (fragments, DATA chunks not starting a
+ * message, other payload protocols, PDU extensions) is decoded.
+ *
+ * Packets are counted per procedure code and verdict, from any number
+ * of threads at once.
+ */
+class UPFS1APFilter {
+  public:
+    /// @brief Counted procedures: S1AP procedure codes 0-255, then
+    ///        packets that can't be peeked at, then packets without
+    ///        DATA chunks
+    enum { PROCEDURE_OTHER = 256, PROCEDURE_NO_DATA, NUM_PROCEDURES };
+
+    /// @brief Packets decoded/skipped per procedure
+    struct Counters {
+        uint64_t decoded[NUM_PROCEDURES];
+        uint64_t skipped[NUM_PROCEDURES];
+    };
+
+    UPFS1APFilter() {
+        for (int i = 0; i < NUM_PROCEDURES; ++i) {
+            mDecoded[i].store(0, std::memory_order_relaxed);
+            mSkipped[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    UPFS1APFilter(const UPFS1APFilter &) = delete;
+    UPFS1APFilter &operator=(const UPFS1APFilter &) = delete;
+
+    /// @brief True if the IPv4 datagram carrying SCTP (starting with
+    ///        header 'ip' and 'length' bytes long) may change the
+    ///        UEMap, so it must be decoded (the packet is counted)
+    bool mustDecode(const click_ip *ip, std::size_t length);
+
+    /// @brief Read the current counters into 'counters'
+    void read(Counters &counters) const;
+
+    /// @brief Return the name of a counted procedure (for S1AP
+    ///        procedure codes, just the code)
+    static String unparseProcedure(int procedure);
+
+  private:
+    std::atomic<uint64_t> mDecoded[NUM_PROCEDURES];
+    std::atomic<uint64_t> mSkipped[NUM_PROCEDURES];
+
+    /// @brief Tell whether a datagram must be decoded, setting
+    ///        'procedure' to the one it's counted as
+    static bool classify(const click_ip *ip, std::size_t length,
+                         int &procedure);
+
+    /// @brief Tell whether an SCTP DATA chunk must be decoded,
+    ///        setting 'procedure'
+    static bool classifyDataChunk(const UPFSCTPChunk &chunk,
+                                  int &procedure);
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,260 @@
+/*
+ * upfs1appeek.{cc,hh} -- peek at the S1AP messages changing the UEMap
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfs1appeek.hh"
+
+#include <cstring>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+/// @brief S1AP protocol IE ids (3GPP TS 36.413)
+enum {
+    S1AP_IE_MME_UE_S1AP_ID = 0,
+    S1AP_IE_E_RAB_ADMITTED_LIST = 18,
+    S1AP_IE_E_RAB_TO_BE_SWITCHED_DL_LIST = 22,
+    S1AP_IE_E_RAB_SETUP_LIST_BEARER_SU_RES = 28,
+    S1AP_IE_E_RAB_SETUP_LIST_CTXT_SU_RES = 51,
+    S1AP_IE_E_RAB_RELEASE_LIST_BEARER_REL_COMP = 69,
+    S1AP_IE_SOURCE_MME_UE_S1AP_ID = 88,
+    S1AP_IE_E_RAB_RELEASED_LIST = 110
+};
+
+/*
+ * Reader of an aligned PER encoding, bit by bit. Reading past the end
+ * just sets the reader in error (reading 0s).
+ */
+class UPFPERReader {
+  public:
+    UPFPERReader(const uint8_t *data, std::size_t length)
+        : mData(data), mLength(length) {}
+
+    bool ok() const { return mOk; }
+
+    /// @brief Read an 'n' bits (n <= 32) unsigned integer
+    uint32_t bits(unsigned n) {
+        uint32_t value = 0;
+
+        if (n > 8 * mLength - mBit) {
+            mOk = false;
+            return 0;
+        }
+
+        for (unsigned i = 0; i < n; ++i, ++mBit) {
+            value = (value << 1) | ((mData[mBit >> 3] >> (7 - (mBit & 7))) & 1);
+        }
+        return value;
+    }
+
+    /// @brief Skip to the next octet boundary
+    void align() { mBit = (mBit + 7) & ~std::size_t(7); }
+
+    /// @brief Skip 'n' octets (at an octet boundary), returning where
+    ///        they are
+    const uint8_t *octets(std::size_t n) {
+        align();
+
+        if (n > mLength - mBit / 8) {
+            mOk = false;
+            return nullptr;
+        }
+
+        const uint8_t *p = mData + mBit / 8;
+        mBit += 8 * n;
+        return p;
+    }
+
+    /// @brief Read an unconstrained length determinant (fragmented
+    ///        lengths, over 16K, are not supported)
+    std::size_t length() {
+        align();
+
+        const uint32_t first = bits(8);
+
+        if (!(first & 0x80)) {
+            return first;
+        }
+        if ((first & 0xc0) == 0x80) {
+            return ((first & 0x3f) << 8) | bits(8);
+        }
+
+        mOk = false;
+        return 0;
+    }
+
+    /// @brief Read an open type (or anything preceded by its length),
+    ///        as a reader of its own
+    UPFPERReader openType() {
+        const std::size_t n = length();
+        const uint8_t *p = octets(n);
+
+        return p ? UPFPERReader(p, n) : UPFPERReader(nullptr, 0);
+    }
+
+  private:
+    const uint8_t *mData;
+    std::size_t mLength;
+    std::size_t mBit = 0;
+    bool mOk = true;
+};
+
+/// @brief Read an MME-UE-S1AP-ID, i.e. INTEGER (0..4294967295)
+static bool readMMEUEId(UPFPERReader r, uint32_t &id) {
+    // Number of octets (1..4), then the octets
+    const unsigned n = r.bits(2) + 1;
+    const uint8_t *p = r.octets(n);
+
+    if (!p) {
+        return false;
+    }
+
+    id = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        id = (id << 8) | p[i];
+    }
+    return true;
+}
+
+/// @brief Read a list of E-RAB items (SEQUENCE (SIZE (1..256)) OF
+///        ProtocolIE-SingleContainer), whose items all start with:
+///        the sequence preamble (extension bit, then 'optionals'
+///        bits), the e-RAB-ID and, if 'withTeid', the
+///        transportLayerAddress and gTP-TEID.
+static void readERABList(UPFPERReader r, unsigned optionals, bool withTeid,
+                         UPFS1APMessage &message) {
+    const unsigned count = r.bits(8) + 1;
+
+    for (unsigned i = 0; i < count && r.ok(); ++i) {
+        // ProtocolIE-Field: id, criticality, value
+        r.bits(16);
+        r.bits(2);
+        UPFPERReader item = r.openType();
+
+        item.bits(1 + optionals);
+
+        // e-RAB-ID: INTEGER (0..15, ...)
+        if (item.bits(1)) {
+            continue;
+        }
+        const uint8_t id = item.bits(4);
+        bool hasENBTeid = false;
+        uint32_t eNBTeid = 0;
+
+        if (withTeid) {
+            // transportLayerAddress: BIT STRING (SIZE (1..160, ...)),
+            // then gTP-TEID: OCTET STRING (SIZE (4))
+            if (item.bits(1)) {
+                continue;
+            }
+            const std::size_t addressBits = item.bits(8) + 1;
+            item.octets((addressBits + 7) / 8);
+
+            const uint8_t *teid = item.octets(4);
+            if (teid) {
+                hasENBTeid = true;
+                memcpy(&eNBTeid, teid, sizeof(eNBTeid));
+            }
+        }
+
+        if (item.ok() && message.numERABs < UPFS1APMessage::MAX_E_RABS) {
+            auto &eRAB = message.eRABs[message.numERABs++];
+            eRAB.id = id;
+            eRAB.hasENBTeid = hasENBTeid;
+            eRAB.eNBTeid = eNBTeid;
+        }
+    }
+}
+
+bool upfPeekS1APMessage(const uint8_t *pdu, std::size_t length,
+                        UPFS1APMessage &message) {
+    UPFPERReader r(pdu, length);
+
+    // S1AP-PDU: extension bit, choice index, then procedureCode,
+    // criticality and value of the chosen message
+    if (r.bits(1)) {
+        return false;
+    }
+
+    message.pduType = r.bits(2);
+    r.align();
+    message.procedureCode = r.bits(8);
+    message.hasMMEUEId = false;
+    message.numERABs = 0;
+
+    if (!r.ok() || !(message.isSetup() || message.isUEContextRelease() ||
+                     message.isERABRelease())) {
+        return false;
+    }
+
+    r.bits(2);
+    UPFPERReader value = r.openType();
+
+    // The message: extension bit, then the protocol IEs
+    value.bits(1);
+    value.align();
+    const unsigned count = value.bits(16);
+
+    for (unsigned i = 0; i < count && value.ok(); ++i) {
+        const unsigned id = value.bits(16);
+        value.bits(2);
+        UPFPERReader ie = value.openType();
+
+        switch (id) {
+        case S1AP_IE_MME_UE_S1AP_ID:
+        case S1AP_IE_SOURCE_MME_UE_S1AP_ID:
+            message.hasMMEUEId = readMMEUEId(ie, message.mmeUEId);
+            break;
+        case S1AP_IE_E_RAB_SETUP_LIST_CTXT_SU_RES:
+        case S1AP_IE_E_RAB_SETUP_LIST_BEARER_SU_RES:
+        case S1AP_IE_E_RAB_TO_BE_SWITCHED_DL_LIST:
+            readERABList(ie, 1, true, message);
+            break;
+        case S1AP_IE_E_RAB_ADMITTED_LIST:
+            // E-RABAdmittedItem: 5 optional data forwarding fields
+            readERABList(ie, 5, true, message);
+            break;
+        case S1AP_IE_E_RAB_RELEASE_LIST_BEARER_REL_COMP:
+        case S1AP_IE_E_RAB_RELEASED_LIST:
+            readERABList(ie, 1, false, message);
+            break;
+        default:
+            break;
+        }
+    }
+
+    return value.ok() && message.hasMMEUEId;
+}
+
+std::size_t upfPeekS1APMessages(const click_ip *ip, std::size_t length,
+                                UPFS1APMessage *messages, std::size_t max) {
+    const uint8_t unfragmented = SCTP_DATA_FLAG_BEGIN | SCTP_DATA_FLAG_END;
+    std::size_t count = 0;
+
+    upfForEachSCTPChunk(ip, length, [&](const UPFSCTPChunk &chunk) {
+        if (count == max) {
+            return false;
+        }
+
+        if (chunk.type == SCTP_CHUNK_DATA && chunk.ppid == S1AP_PPID &&
+            (chunk.flags & unfragmented) == unfragmented &&
+            upfPeekS1APMessage(chunk.payload, chunk.payloadLength,
+                               messages[count])) {
+            messages[count++].mmeAddress = ip->ip_dst.s_addr;
+        }
+        return true;
+    });
+
+    return count;
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_PROVIDES(UPFS1APPeek)
+// clang-format on
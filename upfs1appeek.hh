@@ -0,0 +1,214 @@
+#ifndef CLICK_UPFS1APPEEK_HH
+#define CLICK_UPFS1APPEEK_HH
+
+// clang-format off
+#include <click/glue.hh>
+#include <clicknet/ip.h>
+CLICK_DECLS
+// clang-format on
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Peek at the S1AP messages that set up, move or release the tunnels
+ * of a UE, reading just what is needed to tell which UE and which
+ * E-RABs they are about.
+ *
+ * The UPFlib router decodes S1AP into UEMap upserts, but doesn't tell
+ * which S1AP UE association they belong to, nor does it handle
+ * releases. Here the aligned PER encoding of the S1AP-PDU is walked
+ * down to its protocol IEs, reading only the MME UE S1AP ID and the
+ * E-RAB lists (E-RAB IDs, and eNodeB GTPv1-U TEIDs of the E-RABs set
+ * up), and skipping everything else by its length.
+ *
+ * All of these messages go from an eNodeB to an MME, so the MME is
+ * the destination of the packet. Only S1AP messages in a single SCTP
+ * DATA chunk are peeked at.
+ *
+ * The SCTP chunks of a datagram are walked by upfForEachSCTPChunk(),
+ * which UPFS1APFilter uses too.
+ */
+
+/// @brief SCTP header sizes, chunk types and DATA chunk flags (RFC
+///        4960, RFC 8260)
+enum {
+    SCTP_COMMON_HEADER_SIZE = 12,
+    SCTP_CHUNK_HEADER_SIZE = 4,
+    SCTP_DATA_HEADER_SIZE = 16,
+
+    SCTP_CHUNK_DATA = 0,
+    SCTP_CHUNK_IDATA = 64,
+
+    /// @brief Last/first fragment of a user message
+    SCTP_DATA_FLAG_END = 0x01,
+    SCTP_DATA_FLAG_BEGIN = 0x02
+};
+
+/// @brief SCTP payload protocol identifier of S1AP
+enum { S1AP_PPID = 18 };
+
+/// @brief S1AP-PDU types
+enum {
+    S1AP_PDU_INITIATING_MESSAGE = 0,
+    S1AP_PDU_SUCCESSFUL_OUTCOME = 1,
+    S1AP_PDU_UNSUCCESSFUL_OUTCOME = 2
+};
+
+/// @brief S1AP procedure codes (3GPP TS 36.413) of the procedures
+///        that set up, change or release tunnels
+enum {
+    S1AP_PROC_HANDOVER_RESOURCE_ALLOCATION = 1,
+    S1AP_PROC_PATH_SWITCH_REQUEST = 3,
+    S1AP_PROC_E_RAB_SETUP = 5,
+    S1AP_PROC_E_RAB_MODIFY = 6,
+    S1AP_PROC_E_RAB_RELEASE = 7,
+    S1AP_PROC_E_RAB_RELEASE_INDICATION = 8,
+    S1AP_PROC_INITIAL_CONTEXT_SETUP = 9,
+    S1AP_PROC_UE_CONTEXT_RELEASE = 23
+};
+
+/// @brief What UPFRouter needs to know of an S1AP message
+struct UPFS1APMessage {
+    /// @brief Maximum number of E-RABs kept per message
+    static const unsigned MAX_E_RABS = 16;
+
+    uint8_t pduType;
+    uint8_t procedureCode;
+
+    /// @brief Address of the MME (network byte order)
+    uint32_t mmeAddress;
+
+    /// @brief MME UE S1AP ID (if hasMMEUEId)
+    bool hasMMEUEId;
+    uint32_t mmeUEId;
+
+    /// @brief E-RABs set up, switched or released by the message
+    unsigned numERABs;
+    struct {
+        uint8_t id;
+
+        /// @brief eNodeB TEID (network byte order), of E-RABs set up
+        ///        or switched only (if hasENBTeid)
+        bool hasENBTeid;
+        uint32_t eNBTeid;
+    } eRABs[MAX_E_RABS];
+
+    /// @brief True if the message sets up or moves E-RABs
+    bool isSetup() const {
+        return (pduType == S1AP_PDU_SUCCESSFUL_OUTCOME &&
+                (procedureCode == S1AP_PROC_INITIAL_CONTEXT_SETUP ||
+                 procedureCode == S1AP_PROC_E_RAB_SETUP ||
+                 procedureCode == S1AP_PROC_HANDOVER_RESOURCE_ALLOCATION)) ||
+               (pduType == S1AP_PDU_INITIATING_MESSAGE &&
+                procedureCode == S1AP_PROC_PATH_SWITCH_REQUEST);
+    }
+
+    /// @brief True if the message completes the release of the UE
+    ///        context (UE Context Release Complete)
+    bool isUEContextRelease() const {
+        return pduType == S1AP_PDU_SUCCESSFUL_OUTCOME &&
+               procedureCode == S1AP_PROC_UE_CONTEXT_RELEASE;
+    }
+
+    /// @brief True if the message releases E-RABs (E-RAB Release
+    ///        Response or E-RAB Release Indication)
+    bool isERABRelease() const {
+        return (pduType == S1AP_PDU_SUCCESSFUL_OUTCOME &&
+                procedureCode == S1AP_PROC_E_RAB_RELEASE) ||
+               (pduType == S1AP_PDU_INITIATING_MESSAGE &&
+                procedureCode == S1AP_PROC_E_RAB_RELEASE_INDICATION);
+    }
+};
+
+/// @brief An SCTP chunk
+struct UPFSCTPChunk {
+    uint8_t type;
+    uint8_t flags;
+
+    /// @brief The chunk, header included
+    const uint8_t *data;
+    std::size_t length;
+
+    /// @brief Of DATA chunks: the payload protocol identifier and the
+    ///        user data (0 and null for other chunks)
+    uint32_t ppid;
+    const uint8_t *payload;
+    std::size_t payloadLength;
+};
+
+/// @brief Call 'f(const UPFSCTPChunk &)' on each chunk of the SCTP
+///        packet carried by an IPv4 datagram (starting with header
+///        'ip' and 'length' bytes long), until it returns false
+///
+/// @return false if the datagram can't be walked (not SCTP, a
+///         fragment, or a truncated header or chunk)
+template <typename F>
+bool upfForEachSCTPChunk(const click_ip *ip, std::size_t length, F f) {
+    if (length < sizeof(click_ip)) {
+        return false;
+    }
+
+    const std::size_t headerLength = ip->ip_hl << 2;
+
+    if (ip->ip_p != IP_PROTO_SCTP || IP_ISFRAG(ip) ||
+        headerLength < sizeof(click_ip) ||
+        length < headerLength + SCTP_COMMON_HEADER_SIZE) {
+        return false;
+    }
+
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(ip);
+    std::size_t offset = headerLength + SCTP_COMMON_HEADER_SIZE;
+
+    while (offset + SCTP_CHUNK_HEADER_SIZE <= length) {
+        UPFSCTPChunk chunk = {};
+
+        chunk.data = data + offset;
+        chunk.type = chunk.data[0];
+        chunk.flags = chunk.data[1];
+        chunk.length = (chunk.data[2] << 8) | chunk.data[3];
+
+        if (chunk.length < SCTP_CHUNK_HEADER_SIZE ||
+            chunk.length > length - offset) {
+            return false;
+        }
+
+        if (chunk.type == SCTP_CHUNK_DATA &&
+            chunk.length >= SCTP_DATA_HEADER_SIZE) {
+            chunk.ppid = (static_cast<uint32_t>(chunk.data[12]) << 24) |
+                         (chunk.data[13] << 16) | (chunk.data[14] << 8) |
+                         chunk.data[15];
+            chunk.payload = chunk.data + SCTP_DATA_HEADER_SIZE;
+            chunk.payloadLength = chunk.length - SCTP_DATA_HEADER_SIZE;
+        }
+
+        if (!f(static_cast<const UPFSCTPChunk &>(chunk))) {
+            break;
+        }
+
+        // Chunks are padded to 4 bytes
+        offset += (chunk.length + 3) & ~std::size_t(3);
+    }
+
+    return true;
+}
+
+/// @brief Peek at the S1AP messages of interest carried by an IPv4
+///        datagram (starting with header 'ip' and 'length' bytes
+///        long), storing up to 'max' of them into 'messages'
+///
+/// @return the number of messages stored
+std::size_t upfPeekS1APMessages(const click_ip *ip, std::size_t length,
+                                UPFS1APMessage *messages, std::size_t max);
+
+/// @brief Peek at an S1AP-PDU ('length' bytes at 'pdu')
+///
+/// @return false if it's not a message of interest, or it can't be
+///         read
+bool upfPeekS1APMessage(const uint8_t *pdu, std::size_t length,
+                        UPFS1APMessage &message);
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,256 @@
+#ifndef CLICK_UPFSPSCQUEUE_HH
+#define CLICK_UPFSPSCQUEUE_HH
+
+// clang-format off
+#include <click/glue.hh>
+CLICK_DECLS
+// clang-format on
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/*
+ * Bounded lock-free single-producer/single-consumer queue of values of
+ * type T, in a ring of slots allocated up front.
+ *
+ * One thread may push() while another one pop()s, without locking:
+ * each side only writes its own index, and reads the other one with
+ * acquire semantics. Neither side ever waits: push() fails when the
+ * queue is full, pop() when it is empty.
+ *
+ * T must be trivially copyable.
+ */
+template <typename T> class UPFSPSCQueue {
+  public:
+    UPFSPSCQueue() {}
+    ~UPFSPSCQueue() { delete[] mSlots; }
+
+    UPFSPSCQueue(const UPFSPSCQueue &) = delete;
+    UPFSPSCQueue &operator=(const UPFSPSCQueue &) = delete;
+
+    /// @brief Make room for (at least) 'capacity' values, dropping
+    ///        the queued ones (not while pushing or popping)
+    ///
+    /// @return false on allocation failure
+    bool reserve(std::size_t capacity) {
+        std::size_t nslots = 16;
+        while (nslots < capacity) {
+            nslots <<= 1;
+        }
+
+        T *slots = new (std::nothrow) T[nslots];
+        if (!slots) {
+            return false;
+        }
+
+        delete[] mSlots;
+        mSlots = slots;
+        mMask = nslots - 1;
+        mHead.store(0, std::memory_order_relaxed);
+        mTail.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// @brief Queue 'value' (producer only)
+    ///
+    /// @return false if the queue is full
+    bool push(const T &value) {
+        const uint64_t head = mHead.load(std::memory_order_relaxed);
+
+        if (head - mTail.load(std::memory_order_acquire) > mMask) {
+            return false;
+        }
+
+        mSlots[head & mMask] = value;
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @brief Take the oldest value into 'value' (consumer only)
+    ///
+    /// @return false if the queue is empty
+    bool pop(T &value) {
+        const uint64_t tail = mTail.load(std::memory_order_relaxed);
+
+        if (tail == mHead.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        value = mSlots[tail & mMask];
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @brief True if nothing is queued (just a hint, if the other side
+    ///        is running)
+    bool empty() const {
+        return mHead.load(std::memory_order_acquire) ==
+               mTail.load(std::memory_order_acquire);
+    }
+
+  private:
+    T *mSlots = nullptr;
+    std::size_t mMask = 0;
+
+    /// @brief Values ever pushed/popped (their difference is the
+    ///        number of values queued)
+    alignas(64) std::atomic<uint64_t> mHead = {0};
+    alignas(64) std::atomic<uint64_t> mTail = {0};
+};
+
+/*
+ * Bounded lock-free single-producer/single-consumer queue of records of
+ * bytes, of any length, copied into a ring allocated up front.
+ *
+ * The producer gets room for a record with prepare(), fills it in and
+ * publishes it with commit(); the consumer gets the oldest record with
+ * front(), and frees its room with pop() once done with it. A record
+ * never wraps around the end of the ring: if it doesn't fit there, the
+ * end is skipped. As with UPFSPSCQueue, neither side ever waits.
+ */
+class UPFSPSCByteRing {
+  public:
+    UPFSPSCByteRing() {}
+    ~UPFSPSCByteRing() { delete[] mRing; }
+
+    UPFSPSCByteRing(const UPFSPSCByteRing &) = delete;
+    UPFSPSCByteRing &operator=(const UPFSPSCByteRing &) = delete;
+
+    /// @brief Make room for (at least) 'capacity' bytes, dropping the
+    ///        queued records (not while pushing or popping)
+    ///
+    /// @return false on allocation failure
+    bool reserve(std::size_t capacity) {
+        std::size_t size = 4096;
+        while (size < capacity) {
+            size <<= 1;
+        }
+
+        uint64_t *ring = new (std::nothrow) uint64_t[size / ALIGNMENT];
+        if (!ring) {
+            return false;
+        }
+
+        delete[] mRing;
+        mRing = ring;
+        mMask = size - 1;
+        mHead.store(0, std::memory_order_relaxed);
+        mTail.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// @brief Get room for a record of 'length' bytes (producer only),
+    ///        aligned to 8 bytes, to be published by commit()
+    ///
+    /// @return null if the ring is full
+    unsigned char *prepare(uint32_t length) {
+        const std::size_t ringSize = mMask + 1;
+        const std::size_t size = recordSize(length);
+
+        if (size > ringSize / 2) {
+            // Would never fit
+            return nullptr;
+        }
+
+        const uint64_t head = mHead.load(std::memory_order_relaxed);
+        const std::size_t pos = head & mMask;
+        const std::size_t padding =
+            (ringSize - pos < size) ? ringSize - pos : 0;
+
+        if (ringSize - (head - mTail.load(std::memory_order_acquire)) <
+            padding + size) {
+            return nullptr;
+        }
+
+        unsigned char *slot = bytes() + pos;
+
+        if (padding) {
+            *reinterpret_cast<uint32_t *>(slot) = PADDING;
+            slot = bytes();
+        }
+
+        *reinterpret_cast<uint32_t *>(slot) = length;
+        mPrepared = head + padding + size;
+        return slot + ALIGNMENT;
+    }
+
+    /// @brief Publish the record got from prepare() (producer only)
+    void commit() { mHead.store(mPrepared, std::memory_order_release); }
+
+    /// @brief Get the oldest record, and its length into 'length'
+    ///        (consumer only)
+    ///
+    /// @return null if the ring is empty
+    const unsigned char *front(uint32_t &length) {
+        uint64_t tail = mTail.load(std::memory_order_relaxed);
+        const uint64_t head = mHead.load(std::memory_order_acquire);
+
+        while (tail != head) {
+            const std::size_t pos = tail & mMask;
+            const uint32_t recordLength =
+                *reinterpret_cast<const uint32_t *>(bytes() + pos);
+
+            if (recordLength != PADDING) {
+                length = recordLength;
+                return bytes() + pos + ALIGNMENT;
+            }
+
+            // Skip the unused end of the ring
+            tail += mMask + 1 - pos;
+            mTail.store(tail, std::memory_order_release);
+        }
+
+        return nullptr;
+    }
+
+    /// @brief Free the room of the record got from front() (consumer
+    ///        only)
+    void pop() {
+        const uint64_t tail = mTail.load(std::memory_order_relaxed);
+        const uint32_t length =
+            *reinterpret_cast<const uint32_t *>(bytes() + (tail & mMask));
+
+        mTail.store(tail + recordSize(length), std::memory_order_release);
+    }
+
+    /// @brief True if nothing is queued (just a hint, if the other side
+    ///        is running)
+    bool empty() const {
+        return mHead.load(std::memory_order_acquire) ==
+               mTail.load(std::memory_order_acquire);
+    }
+
+  private:
+    /// @brief Length of the unused end of the ring
+    static const uint32_t PADDING = 0xffffffff;
+
+    /// @brief Records (and their lengths) are aligned to this
+    static const std::size_t ALIGNMENT = sizeof(uint64_t);
+
+    /// @brief Room taken by a record of 'length' bytes
+    static std::size_t recordSize(uint32_t length) {
+        return (ALIGNMENT + length + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    unsigned char *bytes() const {
+        return reinterpret_cast<unsigned char *>(mRing);
+    }
+
+    uint64_t *mRing = nullptr;
+    std::size_t mMask = 0;
+
+    /// @brief Value of mHead once the prepared record is committed
+    uint64_t mPrepared = 0;
+
+    /// @brief Bytes ever produced/consumed (their difference is the
+    ///        amount of data in the ring)
+    alignas(64) std::atomic<uint64_t> mHead = {0};
+    alignas(64) std::atomic<uint64_t> mTail = {0};
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,76 @@
+/*
+ * upftimerwheel.{cc,hh} -- hierarchical timer wheel for UPFRouter
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upftimerwheel.hh"
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+void UPFTimerWheel::schedule(uint32_t key, uint32_t expiry) {
+    place(Entry{key, expiry});
+}
+
+void UPFTimerWheel::place(const Entry &entry) {
+    const int32_t delta = static_cast<int32_t>(entry.expiry - mNow);
+
+    if (delta <= 0) {
+        mExpired.push_back(entry);
+        return;
+    }
+
+    // The lowest level whose span covers the delay (too far in the
+    // future: the top level, to be placed again when moved down).
+    unsigned level = 0;
+    while (level < LEVELS - 1 &&
+           static_cast<uint32_t>(delta) >= (1u << (SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+
+    uint32_t expiry = entry.expiry;
+    if (static_cast<uint32_t>(delta) >= (1u << (SLOT_BITS * LEVELS))) {
+        expiry = mNow + (1u << (SLOT_BITS * LEVELS)) - 1;
+    }
+
+    const unsigned slot = (expiry >> (SLOT_BITS * level)) & (SLOTS - 1);
+    mSlots[level][slot].push_back(entry);
+    ++mSize;
+}
+
+void UPFTimerWheel::tick() {
+    ++mNow;
+
+    // Move down the entries of the upper levels whose time has come
+    // (top level first, so they can go down more than one level).
+    for (unsigned level = LEVELS - 1; level > 0; --level) {
+        if ((mNow & ((1u << (SLOT_BITS * level)) - 1)) != 0) {
+            continue;
+        }
+
+        const unsigned slot = (mNow >> (SLOT_BITS * level)) & (SLOTS - 1);
+        std::vector<Entry> entries;
+        entries.swap(mSlots[level][slot]);
+        mSize -= entries.size();
+
+        for (const Entry &entry : entries) {
+            place(entry);
+        }
+    }
+
+    // Then take the expired entries
+    std::vector<Entry> &entries = mSlots[0][mNow & (SLOTS - 1)];
+    mSize -= entries.size();
+    mExpired.insert(mExpired.end(), entries.begin(), entries.end());
+    entries.clear();
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_PROVIDES(UPFTimerWheel)
+// clang-format on
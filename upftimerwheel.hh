@@ -0,0 +1,81 @@
+#ifndef CLICK_UPFTIMERWHEEL_HH
+#define CLICK_UPFTIMERWHEEL_HH
+
+// clang-format off
+#include <click/glue.hh>
+CLICK_DECLS
+// clang-format on
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Hierarchical timer wheel of 32-bit keys, with expiry times in ticks.
+ *
+ * There are three levels of 256 slots: level 0 holds the entries
+ * expiring within 256 ticks, one slot per tick; each slot of level 1
+ * (2) covers 256 (65536) ticks, and its entries are moved down when
+ * their time comes. Scheduling and advancing by one tick are O(1), no
+ * matter how many entries there are.
+ *
+ * Entries can't be cancelled: the owner is expected to check, when an
+ * entry expires, whether it is still relevant (and maybe schedule it
+ * again). Expired entries are handed out at most 'budget' at a time,
+ * so the work done at once stays bounded.
+ */
+class UPFTimerWheel {
+  public:
+    /// @brief Schedule 'key' to expire at tick 'expiry'
+    void schedule(uint32_t key, uint32_t expiry);
+
+    /// @brief Advance up to tick 'now', then call f(key, expiry) for
+    ///        (at most 'budget') expired entries
+    ///
+    /// @return true if more expired entries are waiting
+    template <typename F> bool expire(uint32_t now, std::size_t budget, F f) {
+        while (static_cast<int32_t>(now - mNow) > 0) {
+            tick();
+        }
+
+        while (budget-- > 0 && !mExpired.empty()) {
+            const Entry entry = mExpired.back();
+            mExpired.pop_back();
+            f(entry.key, entry.expiry);
+        }
+
+        return !mExpired.empty();
+    }
+
+    /// @brief Number of entries scheduled (or expired and waiting)
+    std::size_t size() const { return mSize + mExpired.size(); }
+
+  private:
+    static const unsigned LEVELS = 3;
+    static const unsigned SLOT_BITS = 8;
+    static const unsigned SLOTS = 1 << SLOT_BITS;
+
+    struct Entry {
+        uint32_t key;
+        uint32_t expiry;
+    };
+
+    std::vector<Entry> mSlots[LEVELS][SLOTS];
+
+    /// @brief Entries in mSlots
+    std::size_t mSize = 0;
+
+    /// @brief Expired entries, not handed out yet
+    std::vector<Entry> mExpired;
+
+    /// @brief Last tick processed
+    uint32_t mNow = 0;
+
+    void place(const Entry &entry);
+    void tick();
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,96 @@
+#ifndef CLICK_UPFTRACE_HH
+#define CLICK_UPFTRACE_HH
+
+// clang-format off
+#include <click/glue.hh>
+#include <click/string.hh>
+CLICK_DECLS
+// clang-format on
+
+/*
+ * Leveled tracing for the UPF Click elements.
+ *
+ * Every trace call site checks the current level of its element
+ * before formatting anything, so disabled messages cost a single
+ * compare.
+ *
+ * Debug-level call sites (the per-packet ones) are removed entirely
+ * at compile time unless the package is configured with
+ * `--enable-debug-trace` (which defines UPF_DEBUG_TRACE).
+ */
+
+enum UPFTraceLevel {
+    UPF_TRACE_NONE = 0,
+    UPF_TRACE_ERROR = 1,
+    UPF_TRACE_WARNING = 2,
+    UPF_TRACE_INFO = 3,
+    UPF_TRACE_DEBUG = 4
+};
+
+/// @brief True if messages of level 'level' are enabled when the
+///        current trace level is 'curLevel'.
+#define UPF_TRACE_ENABLED(curLevel, level) unlikely((curLevel) >= (level))
+
+/// @brief Print a printf()-like message via click_chatter() if
+///        'level' is enabled.
+#define UPF_TRACE(curLevel, level, ...)                                        \
+    do {                                                                       \
+        if (UPF_TRACE_ENABLED(curLevel, level))                                \
+            click_chatter(__VA_ARGS__);                                        \
+    } while (0)
+
+#ifdef UPF_DEBUG_TRACE
+#define UPF_DEBUG_TRACE_ENABLED(curLevel)                                      \
+    UPF_TRACE_ENABLED(curLevel, UPF_TRACE_DEBUG)
+#define UPF_TRACE_DEBUG_MSG(curLevel, ...)                                     \
+    UPF_TRACE(curLevel, UPF_TRACE_DEBUG, __VA_ARGS__)
+#else
+#define UPF_DEBUG_TRACE_ENABLED(curLevel) false
+#define UPF_TRACE_DEBUG_MSG(curLevel, ...)                                     \
+    do {                                                                       \
+    } while (0)
+#endif
+
+/// @brief Parse a trace level, either by name (`none`, `error`,
+///        `warning`, `info`, `debug`) or by number (0-4).
+///
+/// @return true on success
+inline bool parseUPFTraceLevel(const String &str, int &level) {
+    static const char *const names[] = {"none", "error", "warning", "info",
+                                        "debug"};
+
+    for (int i = UPF_TRACE_NONE; i <= UPF_TRACE_DEBUG; ++i) {
+        if (str == names[i]) {
+            level = i;
+            return true;
+        }
+    }
+
+    if (str.length() == 1 && str[0] >= '0' && str[0] <= '4') {
+        level = str[0] - '0';
+        return true;
+    }
+
+    return false;
+}
+
+/// @brief Return the name of a trace level
+inline const char *unparseUPFTraceLevel(int level) {
+    switch (level) {
+    case UPF_TRACE_NONE:
+        return "none";
+    case UPF_TRACE_ERROR:
+        return "error";
+    case UPF_TRACE_WARNING:
+        return "warning";
+    case UPF_TRACE_INFO:
+        return "info";
+    default:
+        return "debug";
+    }
+}
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,93 @@
+/*
+ * upftransitclassifier.{cc,hh} -- pre-classifier of the traffic
+ * UPFRouter just forwards
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upftransitclassifier.hh"
+
+#include <click/args.hh>
+#include <click/straccum.hh>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+bool UPFTransitClassifier::addEntry(const String &entry) {
+    const String str = entry.trim_space();
+
+    if (str == "all") {
+        mAll = true;
+        return true;
+    }
+
+    // Format: <protocol>[-<port>]
+    const int dash = str.find_left('-');
+    int protocol;
+    int port = -1;
+
+    if (!IntArg().parse(dash < 0 ? str : str.substring(0, dash), protocol) ||
+        (dash >= 0 && !IntArg().parse(str.substring(dash + 1), port))) {
+        return false;
+    }
+
+    if (protocol < 0 || protocol > 0xff || port > 0xffff) {
+        return false;
+    }
+
+    if (port < 0) {
+        if (!hasProtocol(protocol)) {
+            mProtocols[protocol >> 6] |= uint64_t(1) << (protocol & 63);
+            ++mNumProtocols;
+        }
+    } else if (protocol == IP_PROTO_TCP || protocol == IP_PROTO_UDP ||
+               protocol == IP_PROTO_SCTP) {
+        mPorts.push_back(makeKey(protocol, port));
+    } else {
+        // No ports to match
+        return false;
+    }
+
+    return true;
+}
+
+void UPFTransitClassifier::clear() {
+    mAll = false;
+    std::fill(mProtocols, mProtocols + 4, 0);
+    mNumProtocols = 0;
+    mPorts.clear();
+}
+
+void UPFTransitClassifier::compile() {
+    std::sort(mPorts.begin(), mPorts.end());
+    mPorts.erase(std::unique(mPorts.begin(), mPorts.end()), mPorts.end());
+}
+
+String UPFTransitClassifier::unparse() const {
+    StringAccum sa;
+
+    if (mAll) {
+        sa << "all";
+    }
+
+    for (int protocol = 0; protocol <= 0xff; ++protocol) {
+        if (hasProtocol(protocol)) {
+            sa << (sa.length() ? " " : "") << protocol;
+        }
+    }
+
+    for (const uint32_t key : mPorts) {
+        sa << (sa.length() ? " " : "") << (key >> 16) << '-' << (key & 0xffff);
+    }
+
+    return sa.take_string();
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_PROVIDES(UPFTransitClassifier)
+// clang-format on
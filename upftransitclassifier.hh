@@ -0,0 +1,129 @@
+#ifndef CLICK_UPFTRANSITCLASSIFIER_HH
+#define CLICK_UPFTRANSITCLASSIFIER_HH
+
+// clang-format off
+#include <click/string.hh>
+#include <clicknet/ip.h>
+CLICK_DECLS
+// clang-format on
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Header-only pre-classifier of the traffic between eNodeBs and EPCs
+ * that UPFRouter just forwards to the other side (e.g. OAM or X2
+ * traffic), so it can skip the UPFlib router altogether.
+ *
+ * Transit traffic is given as a list of entries: `proto` (all the
+ * traffic of an IP protocol), `proto-port` (TCP, UDP or SCTP traffic
+ * from or to a port) or `all` (everything but SCTP, which may carry
+ * S1AP on any port). Whatever the entries, GTPv1-U traffic (UDP port
+ * 2152), S1AP traffic (SCTP port 36412) and IPv4 fragments (whose
+ * ports can't be told) are never transit traffic.
+ *
+ * Protocols are looked up in a 256-bit map, (protocol, port) pairs
+ * with a binary search in a sorted list: just a few loads per packet.
+ */
+class UPFTransitClassifier {
+  public:
+    /// @brief Add an entry in its human-readable form (e.g. `all`,
+    ///        `1` or `132-36422`)
+    ///
+    /// @return false if the entry can't be parsed
+    bool addEntry(const String &entry);
+
+    /// @brief Remove all entries
+    void clear();
+
+    /// @brief Sort the entries added so far (must be called after
+    ///        adding entries and before matching).
+    void compile();
+
+    /// @brief True if no traffic is transit traffic
+    bool empty() const {
+        return !mAll && mNumProtocols == 0 && mPorts.empty();
+    }
+
+    /// @brief True if the IPv4 datagram (starting with header 'ip' and
+    ///        'length' bytes long) is transit traffic.
+    bool match(const click_ip *ip, std::size_t length) const;
+
+    /// @brief Return the entries, space-separated
+    String unparse() const;
+
+  private:
+    /// @brief GTPv1-U and S1AP well-known ports
+    static const uint16_t GTPV1U_PORT = 2152;
+    static const uint16_t S1AP_PORT = 36412;
+
+    /// @brief True if `all` was given
+    bool mAll = false;
+
+    /// @brief Bit map of the protocols given as `proto`
+    uint64_t mProtocols[4] = {};
+
+    std::size_t mNumProtocols = 0;
+
+    /// @brief Sorted makeKey(protocol, port) of the `proto-port`
+    ///        entries
+    std::vector<uint32_t> mPorts;
+
+    static uint32_t makeKey(uint8_t protocol, uint16_t port) {
+        return (static_cast<uint32_t>(protocol) << 16) | port;
+    }
+
+    bool hasProtocol(uint8_t protocol) const {
+        return (mProtocols[protocol >> 6] >> (protocol & 63)) & 1;
+    }
+
+    bool hasPort(uint8_t protocol, uint16_t port) const {
+        return std::binary_search(mPorts.begin(), mPorts.end(),
+                                  makeKey(protocol, port));
+    }
+};
+
+inline bool UPFTransitClassifier::match(const click_ip *ip,
+                                        std::size_t length) const {
+    if (length < sizeof(click_ip) || ip->ip_v != 4 || IP_ISFRAG(ip)) {
+        return false;
+    }
+
+    const uint8_t protocol = ip->ip_p;
+    const std::size_t headerLength = ip->ip_hl << 2;
+
+    if (protocol != IP_PROTO_TCP && protocol != IP_PROTO_UDP &&
+        protocol != IP_PROTO_SCTP) {
+        return mAll || hasProtocol(protocol);
+    }
+
+    // TCP, UDP and SCTP all start with the source and destination
+    // ports
+    if (headerLength < sizeof(click_ip) || length < headerLength + 4) {
+        return false;
+    }
+
+    const uint8_t *ports = reinterpret_cast<const uint8_t *>(ip) + headerLength;
+    const uint16_t srcPort = (ports[0] << 8) | ports[1];
+    const uint16_t dstPort = (ports[2] << 8) | ports[3];
+
+    if ((protocol == IP_PROTO_UDP &&
+         (srcPort == GTPV1U_PORT || dstPort == GTPV1U_PORT)) ||
+        (protocol == IP_PROTO_SCTP &&
+         (srcPort == S1AP_PORT || dstPort == S1AP_PORT))) {
+        return false;
+    }
+
+    if ((mAll && protocol != IP_PROTO_SCTP) || hasProtocol(protocol)) {
+        return true;
+    }
+
+    return !mPorts.empty() &&
+           (hasPort(protocol, srcPort) || hasPort(protocol, dstPort));
+}
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif
@@ -0,0 +1,137 @@
+/*
+ * upfuemapfile.{cc,hh} -- UEMap snapshot files for UPFRouter
+ */
+
+// clang-format off
+// ALWAYS INCLUDE <click/config.h> FIRST
+#include <click/config.h>
+// clang-format on
+
+#include "upfuemapfile.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+// clang-format off
+CLICK_DECLS
+// clang-format on
+
+/// @brief Header of a snapshot file
+struct UPFUEMapFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+};
+
+/// @brief First bytes of a snapshot file (without the trailing NUL)
+static const char UEMAP_FILE_MAGIC[] = "UPFUEMAP";
+static const uint32_t UEMAP_FILE_VERSION = 1;
+
+bool UPFUEMapFile::open(const String &fileName, ErrorHandler *errh) {
+    close();
+
+    const int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        errh->error("%s: %s", fileName.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        errh->error("%s: %s", fileName.c_str(), strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    const std::size_t fileSize = st.st_size;
+    if (fileSize < sizeof(UPFUEMapFileHeader)) {
+        errh->error("%s: not a UEMap snapshot", fileName.c_str());
+        ::close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (map == MAP_FAILED) {
+        errh->error("%s: %s", fileName.c_str(), strerror(errno));
+        return false;
+    }
+
+    const UPFUEMapFileHeader *header =
+        static_cast<const UPFUEMapFileHeader *>(map);
+
+    if (memcmp(header->magic, UEMAP_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != UEMAP_FILE_VERSION ||
+        header->recordSize != sizeof(UPFUEMapRecord) ||
+        header->count > (fileSize - sizeof(UPFUEMapFileHeader)) /
+                            sizeof(UPFUEMapRecord)) {
+        errh->error("%s: not a UEMap snapshot (or a truncated one)",
+                    fileName.c_str());
+        munmap(map, fileSize);
+        return false;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    madvise(map, fileSize, MADV_SEQUENTIAL);
+#endif
+
+    mMap = map;
+    mMapSize = fileSize;
+    mRecords = reinterpret_cast<const UPFUEMapRecord *>(header + 1);
+    mSize = header->count;
+    return true;
+}
+
+void UPFUEMapFile::close() {
+    if (mMap) {
+        munmap(mMap, mMapSize);
+        mMap = nullptr;
+        mMapSize = 0;
+        mRecords = nullptr;
+        mSize = 0;
+    }
+}
+
+bool UPFUEMapFile::save(const String &fileName, const UPFUEMapRecord *records,
+                        std::size_t count, ErrorHandler *errh) {
+    const String tmpFileName = fileName + ".tmp";
+
+    FILE *f = fopen(tmpFileName.c_str(), "wb");
+    if (!f) {
+        errh->error("%s: %s", tmpFileName.c_str(), strerror(errno));
+        return false;
+    }
+
+    UPFUEMapFileHeader header;
+    memcpy(header.magic, UEMAP_FILE_MAGIC, sizeof(header.magic));
+    header.version = UEMAP_FILE_VERSION;
+    header.recordSize = sizeof(UPFUEMapRecord);
+    header.count = count;
+
+    bool ok = (fwrite(&header, sizeof(header), 1, f) == 1 &&
+               (count == 0 ||
+                fwrite(records, sizeof(UPFUEMapRecord), count, f) == count));
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmpFileName.c_str(), fileName.c_str()) < 0) {
+        errh->error("%s: %s", fileName.c_str(), strerror(errno));
+        unlink(tmpFileName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// clang-format off
+CLICK_ENDDECLS
+ELEMENT_REQUIRES(userlevel)
+ELEMENT_PROVIDES(UPFUEMapFile)
+// clang-format on
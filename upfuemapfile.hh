@@ -0,0 +1,74 @@
+#ifndef CLICK_UPFUEMAPFILE_HH
+#define CLICK_UPFUEMAPFILE_HH
+
+// clang-format off
+#include <click/error.hh>
+#include <click/string.hh>
+CLICK_DECLS
+// clang-format on
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Binary snapshot of the UPFRouter UEMap, used to restore it on a warm
+ * restart without waiting for UEs to re-attach.
+ *
+ * The file is a fixed-size header followed by an array of fixed-size
+ * records, so it is mapped in memory and read in place, with nothing
+ * to parse. Header fields are in host byte order (snapshots aren't
+ * meant to move across architectures), while addresses and TEIDs are
+ * in network byte order, as in UPFRouter's own copy of the UEMap.
+ */
+
+/// @brief A UE and its GTPv1-U tunnel endpoints
+struct UPFUEMapRecord {
+    uint32_t ueAddress;
+    uint32_t eNBAddress;
+    uint32_t eNBTeid;
+    uint32_t epcAddress;
+    uint32_t epcTeid;
+};
+
+class UPFUEMapFile {
+  public:
+    UPFUEMapFile() {}
+    ~UPFUEMapFile() { close(); }
+
+    UPFUEMapFile(const UPFUEMapFile &) = delete;
+    UPFUEMapFile &operator=(const UPFUEMapFile &) = delete;
+
+    /// @brief Map the snapshot 'fileName' in memory (read-only)
+    ///
+    /// @return false (reporting to 'errh') if it can't be read or is
+    ///         not a valid snapshot
+    bool open(const String &fileName, ErrorHandler *errh);
+
+    /// @brief Unmap the snapshot
+    void close();
+
+    /// @brief Records of the snapshot
+    const UPFUEMapRecord *records() const { return mRecords; }
+
+    /// @brief Number of records of the snapshot
+    std::size_t size() const { return mSize; }
+
+    /// @brief Write 'count' records into the snapshot 'fileName'
+    ///        (through a temporary file, renamed when complete, so a
+    ///        previous snapshot is never left half-written)
+    ///
+    /// @return false (reporting to 'errh') on failure
+    static bool save(const String &fileName, const UPFUEMapRecord *records,
+                     std::size_t count, ErrorHandler *errh);
+
+  private:
+    void *mMap = nullptr;
+    std::size_t mMapSize = 0;
+    const UPFUEMapRecord *mRecords = nullptr;
+    std::size_t mSize = 0;
+};
+
+// clang-format off
+CLICK_ENDDECLS
+// clang-format on
+#endif